@@ -5,6 +5,8 @@
  *      Author: lital
  */
 
+#define _GNU_SOURCE
+
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,28 +14,92 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+
+#include "hw4_xor.h"
+#include "hw4_uring.h"
 
 #define BUF_SIZE 1048576 //1024*1024
+#define DIRECT_ALIGN 4096 //alignment of the buffers, offsets and lengths of O_DIRECT
+
+/**The state of one reader in the reduction tree of a step.
+ * Reader i XORs the results of readers i+1, i+2, i+4... up to its lowest set
+ * bit into its own buffer, in parallel with the other pairs, and hands the
+ * result to its parent, reader i with that bit cleared. Reader 0 gets the
+ * XOR of all the chunks of the step after log2(numInputs) levels and writes it,
+ * or in the pipelined mode hands it to the writer thread.
+ * Step k uses buffer k % depth, so with more than one buffer a reader reads
+ * the next chunks ahead while its parent has not consumed its results yet*/
+typedef struct slot_t {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char **buffs; //depth buffers: the reader's chunk, then the XOR of the chunks of its subtree
+	int *lens; //length of the result in each buffer
+	int ready; //the last step whose result is ready, -1 for none
+	int consumed; //the last step whose result the parent has XORed, or the writer written, -1 for none
+	int done; //every input of the subtree has ended, the result of step ready was the last, empty
+} Slot;
+
+/**An input file of the range mode, mapped when possible, read with pread otherwise*/
+typedef struct input_t {
+	int fd;
+	off_t size;
+	const char *map; //the mapped file, NULL when it is read with pread
+} Input;
+
+/**A step of the asynchronous mode: the chunks of the inputs at one output
+ * offset, read with many steps in flight, then XORed and written*/
+typedef struct async_step_t {
+	long step; //the output range, BUF_SIZE bytes at step*BUF_SIZE
+	char **buffs; //one aligned buffer per input, the first input with data gets the result
+	int *lens; //bytes read into each buffer
+	int pending; //reads not completed yet
+	int out; //the input whose buffer holds the result
+	int outLen; //bytes of the result to write, rounded up for O_DIRECT
+	int written; //bytes of the result written
+} AsyncStep;
 
 //globals
-char shared_buff [BUF_SIZE] = {0}; //shared buffer
+Slot *slots = NULL; //one per input
+char **inNames = NULL; //input file names
+int numInputs = 0; //number of input files
+int depth = 1; //buffers per reader, more in the pipelined mode
+int pipelined = 0; //read ahead, and write from a thread of its own
 int outFD; //output file descriptor
-int outFileSize = 0; //total size of output file
-int cnt = 0; //number of threads finished the current step
-int maxLen = 0; //
-int numThreads; //number of threads at current step
-int currStep = 0; //the current step
-
-pthread_mutex_t lock;
-pthread_cond_t  cond;
+long outFileSize = 0; //total size of output file, written by the writing thread only
+Input *inputs = NULL; //the inputs of the range mode
+int numWorkers = 0; //workers of the range mode, 0 for the reduction tree
+long nextRange = 0; //the next output range to be taken by a worker
+int asyncDepth = 0; //steps in flight of the asynchronous mode, 0 for the other modes
+int directIO = 0; //open the files with O_DIRECT in the asynchronous mode
 
 /** Frees all the memory associated with the program */
 void freeResources(){
 	close(outFD);
-	pthread_mutex_destroy( &lock );
-	pthread_cond_destroy( &cond );
+	for (int i = 0; slots != NULL && i < numInputs; i++){
+		for (int j = 0; slots[i].buffs != NULL && j < depth; j++){
+			free(slots[i].buffs[j]);
+		}
+		free(slots[i].buffs);
+		free(slots[i].lens);
+		pthread_mutex_destroy( &slots[i].lock );
+		pthread_cond_destroy( &slots[i].cond );
+	}
+	free(slots);
+	slots = NULL;
+	for (int i = 0; inputs != NULL && i < numInputs; i++){
+		if (inputs[i].map != NULL){
+			munmap((void *)inputs[i].map, inputs[i].size);
+		}
+		if (inputs[i].fd >= 0){
+			close(inputs[i].fd);
+		}
+	}
+	free(inputs);
+	inputs = NULL;
 }
 
 /**Prints the error massage specified,
@@ -48,146 +114,641 @@ void handleError(const char *msg, const char *err) {
 	exit(EXIT_FAILURE);
 }
 
-/**In every step, reads the next chunk of size BUF_SIZE from the input file specified,
- * XORs the data in the chunk into the shared buffer.
- * If it is the last thread to XOR its data, it also writes the result to the output file.
+/** Locks the slot, exits on error */
+void lockSlot(Slot *s){
+	int rc = pthread_mutex_lock(&s->lock);
+	if( 0 != rc ) {
+		handleError("ERROR in pthread_mutex_lock()", strerror(rc));
+	}
+}
+
+/** Unlocks the slot, exits on error */
+void unlockSlot(Slot *s){
+	int rc = pthread_mutex_unlock(&s->lock);
+	if( 0 != rc ) {
+		handleError("ERROR in pthread_mutex_unlock()", strerror(rc));
+	}
+}
+
+/** Waits for a change of the locked slot, exits on error */
+void waitSlot(Slot *s){
+	int rc = pthread_cond_wait(&s->cond, &s->lock);
+	if( 0 != rc ) {
+		handleError("ERROR in pthread_cond_wait()", strerror(rc));
+	}
+}
+
+/** XORs the result of a child into the result of its parent.
+ * The parent's result is zero padded, so the bytes past its end are copied
  *
- * @param t - the input file name
+ * @param dst - the parent's buffer
+ * @param dstLen - the length of the parent's result, updated
+ * @param src - the child's buffer
+ * @param srcLen - the length of the child's result
+ * */
+void combine(char *dst, int *dstLen, const char *src, int srcLen){
+	int common = (*dstLen < srcLen) ? *dstLen : srcLen;
+	xorInto((unsigned char *)dst, (const unsigned char *)src, common);
+	if (srcLen > *dstLen){
+		memcpy(dst + *dstLen, src + *dstLen, srcLen - *dstLen);
+		*dstLen = srcLen;
+	}
+}
+
+/** Writes the whole buffer to the output file, exits on error */
+void writeOut(const char *p, int n){
+	while (n > 0){
+		int lenWrote = write(outFD, p, n);
+		if (lenWrote < 0){ //error
+			handleError("ERROR unable writing to file", strerror(errno));
+		}
+		n -= lenWrote;
+		p += lenWrote;
+	}
+}
+
+/** Returns whether the buffer of the step is free, its result of depth
+ * steps before consumed, or waits until it is
+ *
+ * @param s - the reader's slot
+ * @param step - the step
+ * @param wait - wait for the buffer
+ * */
+int bufferFree(Slot *s, int step, int wait){
+	lockSlot(s);
+	while (wait && s->consumed < step - depth){
+		waitSlot(s);
+	}
+	int isFree = s->consumed >= step - depth;
+	unlockSlot(s);
+	return isFree;
+}
+
+/** Reads the chunk of the step into its buffer, nothing past the end of the input
+ *
+ * @param s - the reader's slot
+ * @param fd - the input file
+ * @param step - the step
+ * @param eofStep - the first step without data, updated when the input ends
+ * */
+void readChunk(Slot *s, int fd, int step, int *eofStep){
+	int len = 0;
+	if (step < *eofStep){
+		len = read(fd, s->buffs[step % depth], BUF_SIZE); //read next chunk from input file
+		if (len < 0){ //error
+			close(fd);
+			handleError("ERROR: Unable reading file", strerror(errno));
+		}
+		if (len == 0){
+			*eofStep = step;
+		}
+	}
+	s->lens[step % depth] = len;
+}
+
+/**In every step, reads the next chunk of size BUF_SIZE from the input file of
+ * the reader, XORs the results of its children in the reduction tree into it,
+ * and hands it to its parent. Reader 0 writes the result of the step to the
+ * output file instead, unless pipelined. While a child is not ready a pipelined
+ * reader reads the chunks of the next steps into its free buffers.
+ * A reader leaves once every input of its subtree has ended
+ *
+ * @param t - the index of the reader and of its input file
  * */
 void* reader(void* t)
 {
-	int rc;
-	int localStep = 0; //current step of the thread
-	char *fName = (char *)t; //input file name
+	int id = (int)(long)t; //index of the reader
+	Slot *self = &slots[id];
+	char *fName = inNames[id]; //input file name
 	int fd = open(fName, O_RDONLY);
 	if (fd < 0){ //error
 		handleError("ERROR: Unable opening file", strerror(errno));
 	}
 
-	char buffer[BUF_SIZE];
-	char *p;
-	int lenRead, lenWrote;
+	int hasParent = (id != 0 || pipelined); //reader 0 writes its results itself, unless pipelined
+	int eofStep = INT_MAX; //the first step without data
+	int readStep = 0; //the next step to read
+	unsigned long childDone = 0; //bit mask of the children whose subtree has ended
+	for (int step = 0; ; step++){
+		//the parent must have consumed the result of depth steps before, for the buffer to be reused
+		for (; readStep <= step; readStep++){
+			if (hasParent){
+				bufferFree(self, readStep, 1);
+			}
+			readChunk(self, fd, readStep, &eofStep);
+		}
+		char *buff = self->buffs[step % depth];
+		int len = self->lens[step % depth];
+
+		//XOR the results of the children, the nearest last
+		int done = (step >= eofStep);
+		for (unsigned long mask = 1; !(id & mask) && id + mask < (unsigned long)numInputs; mask <<= 1){
+			if (childDone & mask){
+				continue;
+			}
+			Slot *child = &slots[id + mask];
+			while (1){
+				int readAhead = pipelined && readStep < step + depth && readStep < eofStep && bufferFree(self, readStep, 0);
+				lockSlot(child);
+				while (!readAhead && child->ready < step){
+					waitSlot(child);
+				}
+				int ready = (child->ready >= step);
+				unlockSlot(child);
+				if (ready){
+					break;
+				}
+				readChunk(self, fd, readStep++, &eofStep);
+			}
+
+			//the child waits for consumed to reuse the buffer, so it is ours meanwhile
+			combine(buff, &len, child->buffs[step % depth], child->lens[step % depth]);
 
-	while ((lenRead = read(fd, buffer, BUF_SIZE)) >= 0){ //read next chunk from input file
+			lockSlot(child);
+			if (child->done && child->ready == step){
+				childDone |= mask;
+			}
+			else {
+				done = 0;
+			}
+			child->consumed = step;
+			pthread_cond_broadcast(&child->cond);
+			unlockSlot(child);
+		}
 
-		//lock
-		rc = pthread_mutex_lock(&lock);
-		if( 0 != rc ) {
-			close(fd);
-			handleError("ERROR in pthread_mutex_lock()", strerror(rc));
+		if (!hasParent){
+			writeOut(buff, len);
+			outFileSize += len;
+		}
+		else {
+			lockSlot(self);
+			self->lens[step % depth] = len;
+			self->done = done;
+			self->ready = step;
+			pthread_cond_broadcast(&self->cond);
+			unlockSlot(self);
 		}
 
-		//wait for next step
-		while (localStep != currStep){
-			rc = pthread_cond_wait(&cond, &lock);
-			if( 0 != rc ) { //error
-				close(fd);
-				handleError("ERROR in pthread_cond_wait()", strerror(rc));
-			}
+		if (done){ //no input of the subtree has data left
+			break;
 		}
+	}
+
+	close(fd);
 
-		localStep++;
+	pthread_exit(NULL);
+}
 
-		//xor to shared buffer
-		for (int i = 0; i < lenRead; i++){
-			shared_buff[i] ^= buffer[i];
+/**Writes the results of reader 0 to the output file in step order, while the
+ * readers go on with the next steps, and frees each buffer for reader 0 again.
+ * The buffers of reader 0 are the rotating output buffers of the pipelined mode*/
+void* writer(void* t)
+{
+	Slot *root = &slots[0];
+	for (int step = 0; ; step++){
+		lockSlot(root);
+		while (root->ready < step){
+			waitSlot(root);
 		}
+		int done = (root->done && root->ready == step);
+		unlockSlot(root);
 
-		cnt++;
+		writeOut(root->buffs[step % depth], root->lens[step % depth]);
+		outFileSize += root->lens[step % depth];
 
-		if (lenRead > maxLen){
-			maxLen = lenRead;
+		lockSlot(root);
+		root->consumed = step;
+		pthread_cond_broadcast(&root->cond);
+		unlockSlot(root);
+		if (done){
+			break;
 		}
+	}
 
-		//the last thread
-		if (cnt == numThreads){
-			//write to file
-			p = shared_buff;
-			int n = maxLen;
-			while ((lenWrote = write(outFD, p, n)) != n){
-				n -= lenWrote;
-				p += lenWrote;
+	pthread_exit(NULL);
+}
+
+/**Computes output ranges of size BUF_SIZE, taken in turn with the other workers:
+ * XORs the part of every input inside the range and writes it at its offset.
+ * The workers share nothing but the counter of the next range
+ *
+ * @param t - unused
+ * */
+void* rangeWorker(void* t)
+{
+	char *buff = (char *)malloc(BUF_SIZE); //the XOR of the range
+	char *chunk = (char *)malloc(BUF_SIZE); //the part of an input read with pread
+	if (buff == NULL || chunk == NULL){
+		handleError("ERROR: malloc has failed", strerror(errno));
+	}
+
+	while (1){
+		off_t off = __atomic_fetch_add(&nextRange, 1, __ATOMIC_RELAXED) * (off_t)BUF_SIZE;
+		if (off >= outFileSize){
+			break;
+		}
+		int len = (outFileSize - off < BUF_SIZE) ? outFileSize - off : BUF_SIZE;
+
+		int filled = 0; //bytes of buff holding data, the rest is zero
+		for (int i = 0; i < numInputs; i++){
+			Input *in = &inputs[i];
+			if (in->size <= off){
+				continue;
+			}
+			int n = (in->size - off < len) ? in->size - off : len;
+			const char *src = chunk;
+			if (in->map != NULL){
+				src = in->map + off;
 			}
-			if (lenWrote < 0){ //error
-				close(fd);
-				handleError("ERROR unable writing to file", strerror(errno));
+			else {
+				for (int got = 0; got < n; ){
+					ssize_t r = pread(in->fd, chunk + got, n - got, off + got);
+					if (r <= 0){ //error, or the file shrank
+						handleError("ERROR: Unable reading file", (r < 0) ? strerror(errno) : "unexpected end of file");
+					}
+					got += r;
+				}
+			}
+			if (filled == 0){
+				memcpy(buff, src, n);
+				filled = n;
+			}
+			else {
+				combine(buff, &filled, src, n);
 			}
-			//update globals
-			memset(shared_buff, 0, BUF_SIZE);
-			outFileSize += maxLen;
-			maxLen = 0;
-			cnt = 0;
-			//continue to next step
-			currStep++;
-			pthread_cond_broadcast(&cond);
 		}
+		memset(buff + filled, 0, len - filled);
 
-		//EOF
-		if (lenRead == 0){
-			numThreads--;
-			if (cnt > 0){
-				cnt--;
+		for (int done = 0; done < len; ){
+			ssize_t w = pwrite(outFD, buff + done, len - done, off + done);
+			if (w < 0){ //error
+				handleError("ERROR: Unable writing file", strerror(errno));
 			}
+			done += w;
 		}
+	}
 
-		//unlock
-		rc = pthread_mutex_unlock(&lock);
-		if( 0 != rc ) {
-			close(fd);
-			handleError("ERROR in pthread_mutex_unlock()", strerror( rc ));
+	free(buff);
+	free(chunk);
+	pthread_exit(NULL);
+}
+
+/**Opens the inputs, and sets the output size to the size of the largest.
+ * For the range mode they are mapped, inputs that cannot be mapped are read
+ * with pread. With directIO they are opened with O_DIRECT when the file system allows it
+ *
+ * @param map - map the inputs
+ * */
+void openInputs(int map){
+	inputs = (Input *)calloc(numInputs, sizeof(Input));
+	if (inputs == NULL){
+		handleError("ERROR: malloc has failed", strerror(errno));
+	}
+	for (int i = 0; i < numInputs; i++){
+		inputs[i].fd = -1;
+	}
+	for (int i = 0; i < numInputs; i++){
+		struct stat st;
+		inputs[i].fd = open(inNames[i], O_RDONLY | (directIO ? O_DIRECT : 0));
+		if (inputs[i].fd < 0 && directIO && errno == EINVAL){ //no O_DIRECT on this file system
+			inputs[i].fd = open(inNames[i], O_RDONLY);
+		}
+		if (inputs[i].fd < 0 || fstat(inputs[i].fd, &st) < 0){ //error
+			handleError("ERROR: Unable opening file", strerror(errno));
+		}
+		if (!S_ISREG(st.st_mode)){
+			handleError("ERROR: The range and asynchronous modes need regular input files", inNames[i]);
+		}
+		inputs[i].size = st.st_size;
+		if (map && st.st_size > 0){
+			void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, inputs[i].fd, 0);
+			if (map != MAP_FAILED){
+				madvise(map, st.st_size, MADV_SEQUENTIAL);
+				inputs[i].map = (const char *)map;
+			}
 		}
+		outFileSize = (st.st_size > outFileSize) ? st.st_size : outFileSize;
+	}
+}
 
-		if (lenRead == 0) {//exit the loop
-			break;
+/** Returns len rounded up to DIRECT_ALIGN*/
+int alignUp(int len){
+	return (len + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+}
+
+/** Queues a read, or a write, on the ring. A full submission ring is handed
+ * to the kernel first, exits if there is still no room or on error
+ *
+ * @param u - the ring
+ * @param op - IORING_OP_READ or IORING_OP_WRITE
+ * @param fd - the file
+ * @param buf - the bytes
+ * @param len - number of bytes
+ * @param off - the offset in the file
+ * @param tag - the tag of the request
+ * */
+void queueIO(Uring *u, int op, int fd, void *buf, unsigned len, off_t off, uint64_t tag){
+	if (uringQueue(u, op, fd, buf, len, off, tag) == 0){
+		return;
+	}
+	if (uringSubmit(u, 0) < 0){
+		handleError("ERROR: io_uring_enter", strerror(errno));
+	}
+	if (uringQueue(u, op, fd, buf, len, off, tag) < 0){
+		handleError("ERROR: io_uring", "submission ring is full");
+	}
+}
+
+/** Queues the reads of the chunks of a step, and exits on error
+ *
+ * @param u - the ring
+ * @param s - the step's state
+ * @param idx - the index of the state, in the tags of the requests
+ * @param step - the output range to read
+ * */
+void startStep(Uring *u, AsyncStep *s, int idx, long step){
+	off_t off = step * (off_t)BUF_SIZE;
+	s->step = step;
+	s->pending = 0;
+	s->out = -1;
+	s->written = 0;
+	for (int i = 0; i < numInputs; i++){
+		s->lens[i] = 0;
+		if (inputs[i].size <= off){
+			continue;
 		}
+		//a whole aligned block, O_DIRECT reads only what the file has
+		int n = (inputs[i].size - off < BUF_SIZE) ? inputs[i].size - off : BUF_SIZE;
+		queueIO(u, IORING_OP_READ, inputs[i].fd, s->buffs[i], alignUp(n), off, ((uint64_t)idx << 32) | i);
+		s->pending++;
 	}
+}
 
-	if (lenRead < 0){ //error
-		close(fd);
-		handleError("ERROR: Unable reading file", strerror(errno));
+/** XORs the chunks of a completed step into the buffer of its first input,
+ * and queues writing it
+ *
+ * @param u - the ring
+ * @param s - the step's state
+ * @param idx - the index of the state, in the tags of the requests
+ * @param outDirect - the output is opened with O_DIRECT
+ * */
+void finishStep(Uring *u, AsyncStep *s, int idx, int outDirect){
+	off_t off = s->step * (off_t)BUF_SIZE;
+	int len = (outFileSize - off < BUF_SIZE) ? outFileSize - off : BUF_SIZE;
+	int filled = 0; //bytes of the result holding data
+	for (int i = 0; i < numInputs; i++){
+		if (s->lens[i] == 0){
+			continue;
+		}
+		if (s->out < 0){
+			s->out = i;
+			filled = s->lens[i];
+		}
+		else {
+			combine(s->buffs[s->out], &filled, s->buffs[i], s->lens[i]);
+		}
 	}
+	s->outLen = outDirect ? alignUp(len) : len;
+	memset(s->buffs[s->out] + filled, 0, s->outLen - filled);
+	queueIO(u, IORING_OP_WRITE, outFD, s->buffs[s->out], s->outLen, off, ((uint64_t)idx << 32) | numInputs);
+}
 
-	close(fd);
+/**Merges the inputs with asynchronous I/O from a single thread: keeps
+ * asyncDepth output ranges in flight, each with a read outstanding per input,
+ * XORs a range once all its reads have completed and writes it asynchronously.
+ * The tags of the requests hold the index of the step's state and the input,
+ * or numInputs for the write
+ *
+ * @param u - the ring, with room for all the requests in flight
+ * @param outDirect - the output is opened with O_DIRECT
+ * */
+void asyncMerge(Uring *u, int outDirect){
+	long numSteps = (outFileSize + BUF_SIZE - 1) / BUF_SIZE;
+	AsyncStep *steps = (AsyncStep *)calloc(asyncDepth, sizeof(AsyncStep));
+	if (steps == NULL){
+		handleError("ERROR: malloc has failed", strerror(errno));
+	}
+	for (int j = 0; j < asyncDepth; j++){
+		steps[j].buffs = (char **)calloc(numInputs, sizeof(char *));
+		steps[j].lens = (int *)calloc(numInputs, sizeof(int));
+		if (steps[j].buffs == NULL || steps[j].lens == NULL){
+			handleError("ERROR: malloc has failed", strerror(errno));
+		}
+		for (int i = 0; i < numInputs; i++){
+			if (posix_memalign((void **)&steps[j].buffs[i], DIRECT_ALIGN, BUF_SIZE) != 0){
+				handleError("ERROR: malloc has failed", strerror(ENOMEM));
+			}
+		}
+	}
 
-	pthread_exit(NULL);
+	long nextStep = 0, doneSteps = 0;
+	for (int j = 0; j < asyncDepth && nextStep < numSteps; j++){
+		startStep(u, &steps[j], j, nextStep++);
+	}
+	while (doneSteps < numSteps){
+		if (uringSubmit(u, 1) < 0){
+			handleError("ERROR: io_uring_enter", strerror(errno));
+		}
+		struct io_uring_cqe cqe;
+		while (uringReap(u, &cqe)){
+			int idx = cqe.user_data >> 32;
+			int i = cqe.user_data & 0xffffffff;
+			AsyncStep *s = &steps[idx];
+			off_t off = s->step * (off_t)BUF_SIZE;
+			if (cqe.res < 0){
+				handleError((i < numInputs) ? "ERROR: Unable reading file" : "ERROR: Unable writing file", strerror(-cqe.res));
+			}
+
+			if (i < numInputs){ //a read
+				int n = (inputs[i].size - off < BUF_SIZE) ? inputs[i].size - off : BUF_SIZE;
+				if (cqe.res == 0){
+					handleError("ERROR: Unable reading file", "unexpected end of file");
+				}
+				s->lens[i] += cqe.res;
+				if (s->lens[i] < n){ //a short read, read the rest
+					queueIO(u, IORING_OP_READ, inputs[i].fd, s->buffs[i] + s->lens[i], alignUp(n) - s->lens[i], off + s->lens[i], cqe.user_data);
+					continue;
+				}
+				s->lens[i] = n;
+				if (--s->pending == 0){
+					finishStep(u, s, idx, outDirect);
+				}
+			}
+			else { //the write
+				s->written += cqe.res;
+				if (s->written < s->outLen){ //a short write, write the rest
+					queueIO(u, IORING_OP_WRITE, outFD, s->buffs[s->out] + s->written, s->outLen - s->written, off + s->written, cqe.user_data);
+					continue;
+				}
+				doneSteps++;
+				if (nextStep < numSteps){
+					startStep(u, s, idx, nextStep++);
+				}
+			}
+		}
+	}
+
+	//the last block of O_DIRECT is written whole
+	if (outDirect && ftruncate(outFD, outFileSize) < 0){
+		handleError("ERROR: Unable writing file", strerror(errno));
+	}
+	for (int j = 0; j < asyncDepth; j++){
+		for (int i = 0; i < numInputs; i++){
+			free(steps[j].buffs[i]);
+		}
+		free(steps[j].buffs);
+		free(steps[j].lens);
+	}
+	free(steps);
+}
+
+/**Prints the usage message and exits*/
+void usage(char *prog){
+	printf("Usage: %s [-p depth | -r workers | -a depth [-d]] <output file> <input file>...\n", prog);
+	printf("  -p  pipelined: read up to depth chunks ahead per input, and write from a thread of its own\n");
+	printf("  -r  range mode: map the inputs, and split the output between workers by byte ranges\n");
+	printf("  -a  asynchronous: keep depth chunks of every input in flight with io_uring\n");
+	printf("  -d  with -a, open the files with O_DIRECT\n");
+	exit(EXIT_FAILURE);
 }
 
 int main (int argc, char *argv[])
 {
-	char *outName = argv[1]; //output file name
-	int numInputs = argc-2; //num of input files
-	numThreads = numInputs;
+	int opt;
+	while ((opt = getopt(argc, argv, "p:r:a:d")) != -1){
+		switch (opt){
+		case 'p':
+			depth = atoi(optarg);
+			pipelined = 1;
+			break;
+		case 'r':
+			numWorkers = atoi(optarg);
+			if (numWorkers < 1){
+				usage(argv[0]);
+			}
+			break;
+		case 'a':
+			asyncDepth = atoi(optarg);
+			if (asyncDepth < 1){
+				usage(argv[0]);
+			}
+			break;
+		case 'd':
+			directIO = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind < 2 || depth < 1 || (pipelined && depth < 2) ||
+			(pipelined + (numWorkers > 0) + (asyncDepth > 0) > 1) || (directIO && asyncDepth == 0)){
+		usage(argv[0]);
+	}
+	char *outName = argv[optind]; //output file name
+	numInputs = argc-optind-1; //num of input files
+	inNames = argv+optind+1;
 
 	printf("Hello, creating %s from %d input files\n", outName, numInputs);
 
-	outFD = open(outName, O_CREAT|O_WRONLY|O_TRUNC, 777);
+	//the asynchronous mode falls back to the reduction tree without io_uring
+	Uring ring;
+	if (asyncDepth > 0 && uringInit(&ring, asyncDepth * (numInputs + 1)) < 0){
+		fprintf(stderr, "WARNING: io_uring is unavailable (%s), using the reader threads\n", strerror(errno));
+		asyncDepth = 0;
+		directIO = 0;
+	}
+
+	int outDirect = directIO;
+	outFD = open(outName, O_CREAT|O_WRONLY|O_TRUNC | (outDirect ? O_DIRECT : 0), 0777);
+	if (outFD < 0 && outDirect && errno == EINVAL){ //no O_DIRECT on this file system
+		outDirect = 0;
+		outFD = open(outName, O_CREAT|O_WRONLY|O_TRUNC, 0777);
+	}
 	if (outFD < 0){ //error
 		perror("ERROR: Unable opening file");
 		exit(EXIT_FAILURE);
 	}
 
-	pthread_t thread[numInputs];
+	if (asyncDepth > 0){
+		openInputs(0);
+		asyncMerge(&ring, outDirect);
+		uringFree(&ring);
+
+		printf("Created %s with size %ld bytes\n", outName, outFileSize);
+
+		freeResources();
+		exit(EXIT_SUCCESS);
+	}
+
+	pthread_t thread[numInputs > numWorkers ? numInputs : numWorkers];
+	pthread_t writerThread;
 	int       rc;
 	void*     status;
 
-	//Initialize mutex
-	rc = pthread_mutex_init( &lock, NULL );
-	if(rc){ //error
-		handleError("ERROR in pthread_mutex_init()", strerror(rc));
+	if (numWorkers > 0){
+		openInputs(1);
+		for (int i=0; i<numWorkers; i++){
+			rc = pthread_create(&thread[i], NULL, rangeWorker, NULL);
+			if(rc) { //error
+				handleError("ERROR in pthread_create()", strerror(rc));
+			}
+		}
+		for (int i=0; i<numWorkers; i++){
+			rc = pthread_join(thread[i], &status);
+			if (rc) { //error
+				handleError("ERROR in pthread_join()", strerror( rc ));
+			}
+		}
+
+		printf("Created %s with size %ld bytes\n", outName, outFileSize);
+
+		freeResources();
+		pthread_exit(EXIT_SUCCESS);
 	}
-	//Initialize cond
-	rc = pthread_cond_init(&cond, NULL);
-	if(rc){ //error
-		handleError("ERROR in pthread_cond_init()", strerror(rc));
+
+	slots = (Slot *)calloc(numInputs, sizeof(Slot));
+	if (slots == NULL){
+		handleError("ERROR: malloc has failed", strerror(errno));
+	}
+	for (int i=0; i<numInputs; i++){
+		//Initialize mutex
+		rc = pthread_mutex_init( &slots[i].lock, NULL );
+		if(rc){ //error
+			handleError("ERROR in pthread_mutex_init()", strerror(rc));
+		}
+		//Initialize cond
+		rc = pthread_cond_init(&slots[i].cond, NULL);
+		if(rc){ //error
+			handleError("ERROR in pthread_cond_init()", strerror(rc));
+		}
+		slots[i].ready = -1;
+		slots[i].consumed = -1;
+		slots[i].buffs = (char **)calloc(depth, sizeof(char *));
+		slots[i].lens = (int *)calloc(depth, sizeof(int));
+		if (slots[i].buffs == NULL || slots[i].lens == NULL){
+			handleError("ERROR: malloc has failed", strerror(errno));
+		}
+		for (int j=0; j<depth; j++){
+			slots[i].buffs[j] = (char *)malloc(BUF_SIZE);
+			if (slots[i].buffs[j] == NULL){
+				handleError("ERROR: malloc has failed", strerror(errno));
+			}
+		}
 	}
 
-	currStep = 0;
 	//Launch threads
 	for (int i=0; i<numInputs; i++){
 		rc = pthread_create( &thread[i],
 				NULL,
 				reader,
-				(void*) argv[i+2] );
+				(void*)(long)i );
+		if(rc) { //error
+			handleError("ERROR in pthread_create()", strerror(rc));
+		}
+	}
+
+	if (pipelined){
+		rc = pthread_create(&writerThread, NULL, writer, NULL);
 		if(rc) { //error
 			handleError("ERROR in pthread_create()", strerror(rc));
 		}
@@ -197,14 +758,18 @@ int main (int argc, char *argv[])
 	for( int i = 0; i < numInputs; i++ ) {
 		rc = pthread_join(thread[i], &status);
 		if (rc) { //error
-			handleError("ERROR in pthread_mutex_join()", strerror( rc ));
+			handleError("ERROR in pthread_join()", strerror( rc ));
+		}
+	}
+	if (pipelined){
+		rc = pthread_join(writerThread, &status);
+		if (rc) { //error
+			handleError("ERROR in pthread_join()", strerror( rc ));
 		}
 	}
 
-	printf("Created %s with size %d bytes\n", outName, outFileSize);
+	printf("Created %s with size %ld bytes\n", outName, outFileSize);
 
 	freeResources();
 	pthread_exit(EXIT_SUCCESS);
 }
-
-
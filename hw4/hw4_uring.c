@@ -0,0 +1,140 @@
+/*
+ * hw4_uring.c
+ *
+ *  Created on: 22 May 2018
+ *      Author: lital
+ *
+ * A minimal io_uring for the asynchronous mode of the merger, without
+ * liburing: only what it needs, reads and writes at offsets, submitted in
+ * batches and reaped from the completion ring.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "hw4_uring.h"
+
+int uringInit(Uring *u, unsigned entries){
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+#ifdef __NR_io_uring_setup
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0){
+		return -1;
+	}
+	u->entries = p.sq_entries;
+	u->sqMapLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cqMapLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP){
+		u->sqMapLen = u->cqMapLen = (u->sqMapLen > u->cqMapLen) ? u->sqMapLen : u->cqMapLen;
+	}
+	u->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	u->sqMap = mmap(NULL, u->sqMapLen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sqMap == MAP_FAILED){
+		u->sqMap = NULL;
+		int err = errno;
+		uringFree(u);
+		errno = err;
+		return -1;
+	}
+	u->cqMap = u->sqMap;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)){
+		u->cqMap = mmap(NULL, u->cqMapLen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+	}
+	u->sqes = (struct io_uring_sqe *)mmap(NULL, u->sqesLen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->cqMap == MAP_FAILED || u->sqes == MAP_FAILED){
+		u->cqMap = (u->cqMap == MAP_FAILED) ? NULL : u->cqMap;
+		u->sqes = (u->sqes == MAP_FAILED) ? NULL : u->sqes;
+		int err = errno;
+		uringFree(u);
+		errno = err;
+		return -1;
+	}
+
+	char *sq = (char *)u->sqMap, *cq = (char *)u->cqMap;
+	u->sqHead = (unsigned *)(sq + p.sq_off.head);
+	u->sqTail = (unsigned *)(sq + p.sq_off.tail);
+	u->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sqArray = (unsigned *)(sq + p.sq_off.array);
+	u->cqHead = (unsigned *)(cq + p.cq_off.head);
+	u->cqTail = (unsigned *)(cq + p.cq_off.tail);
+	u->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+void uringFree(Uring *u){
+	if (u->sqes != NULL){
+		munmap(u->sqes, u->sqesLen);
+	}
+	if (u->cqMap != NULL && u->cqMap != u->sqMap){
+		munmap(u->cqMap, u->cqMapLen);
+	}
+	if (u->sqMap != NULL){
+		munmap(u->sqMap, u->sqMapLen);
+	}
+	if (u->fd >= 0){
+		close(u->fd);
+	}
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+
+int uringQueue(Uring *u, int op, int fd, void *buf, unsigned len, off_t off, uint64_t data){
+	unsigned tail = *u->sqTail;
+	if (tail - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE) >= u->entries){
+		return -1;
+	}
+	unsigned idx = tail & *u->sqMask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = data;
+	u->sqArray[idx] = idx;
+	//the kernel reads the entry once it sees the new tail
+	__atomic_store_n(u->sqTail, tail + 1, __ATOMIC_RELEASE);
+	u->queued++;
+	return 0;
+}
+
+int uringSubmit(Uring *u, unsigned waitNr){
+	unsigned flags = (waitNr > 0) ? IORING_ENTER_GETEVENTS : 0;
+	while (u->queued > 0 || waitNr > 0){
+		int rc = syscall(__NR_io_uring_enter, u->fd, u->queued, waitNr, flags, NULL, 0);
+		if (rc < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		u->queued -= ((unsigned)rc < u->queued) ? (unsigned)rc : u->queued;
+		waitNr = 0; //the kernel returns once it has waited
+		flags = 0;
+	}
+	return 0;
+}
+
+int uringReap(Uring *u, struct io_uring_cqe *cqe){
+	unsigned head = *u->cqHead;
+	if (head == __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE)){
+		return 0;
+	}
+	*cqe = u->cqes[head & *u->cqMask];
+	__atomic_store_n(u->cqHead, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
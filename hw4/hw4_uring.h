@@ -0,0 +1,66 @@
+/*
+ * hw4_uring.h
+ *
+ *  Created on: 22 May 2018
+ *      Author: lital
+ */
+
+#ifndef HW4_URING_H_
+#define HW4_URING_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+/**An io_uring instance, set up with the system calls directly.
+ * The submission and completion rings are mapped from the kernel: requests
+ * are queued in the submission ring and handed to the kernel in one system
+ * call, which also waits for completions when asked to*/
+typedef struct uring_t {
+	int fd;
+	unsigned entries; //size of the submission ring
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	struct io_uring_sqe *sqes;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_cqe *cqes;
+	unsigned queued; //requests queued and not submitted yet
+	void *sqMap, *cqMap; //the mapped rings, the same with IORING_FEAT_SINGLE_MMAP
+	size_t sqMapLen, cqMapLen, sqesLen;
+} Uring;
+
+/**Sets up a ring of entries requests
+ *
+ * @return
+ * 0 - on success
+ * -1 - on error, errno is set, ENOSYS when the kernel has no io_uring
+ * */
+int uringInit(Uring *u, unsigned entries);
+
+/**Unmaps the rings and closes the ring's descriptor*/
+void uringFree(Uring *u);
+
+/**Queues a read, or a write, of len bytes at off, tagged with data
+ *
+ * @return
+ * 0 - on success
+ * -1 - the submission ring is full, submit first
+ * */
+int uringQueue(Uring *u, int op, int fd, void *buf, unsigned len, off_t off, uint64_t data);
+
+/**Submits the queued requests and waits until at least waitNr have completed
+ *
+ * @return
+ * 0 - on success
+ * -1 - on error, errno is set
+ * */
+int uringSubmit(Uring *u, unsigned waitNr);
+
+/**Takes the oldest completion, if any
+ *
+ * @return
+ * 1 - a completion was copied to cqe
+ * 0 - no request has completed
+ * */
+int uringReap(Uring *u, struct io_uring_cqe *cqe);
+
+#endif /* HW4_URING_H_ */
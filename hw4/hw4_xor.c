@@ -0,0 +1,153 @@
+/*
+ * hw4_xor.c
+ *
+ *  Created on: 22 May 2018
+ *      Author: lital
+ *
+ * XOR kernels of the merger.
+ * The bytes kernel is the original loop, kept as the reference. The word
+ * kernel XORs 8 bytes at a time, and the vector kernels a whole register:
+ * they XOR the unaligned head of dst word by word, so every store of the
+ * main loop is aligned while the loads of src may not be, run four registers
+ * per iteration, and finish the tail word by word.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "hw4_xor.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define XOR_X86
+#include <immintrin.h>
+#endif
+
+#define UNROLL 4 //registers XORed per iteration of the vector loops
+
+/** The original byte by byte loop, which must not be vectorized by the compiler*/
+__attribute__((optimize("no-tree-vectorize")))
+static void xorBytes(unsigned char *dst, const unsigned char *src, size_t len){
+	for (size_t i = 0; i < len; i++){
+		dst[i] ^= src[i];
+	}
+}
+
+/** XORs 8 bytes at a time, then the last bytes one by one*/
+static inline __attribute__((always_inline)) void xorWords(unsigned char *dst, const unsigned char *src, size_t len){
+	size_t i = 0;
+	for (; i+sizeof(uint64_t) <= len; i += sizeof(uint64_t)){
+		uint64_t a, b;
+		memcpy(&a, dst+i, sizeof(a));
+		memcpy(&b, src+i, sizeof(b));
+		a ^= b;
+		memcpy(dst+i, &a, sizeof(a));
+	}
+	for (; i < len; i++){
+		dst[i] ^= src[i];
+	}
+}
+
+static void xorWord(unsigned char *dst, const unsigned char *src, size_t len){
+	xorWords(dst, src, len);
+}
+
+#ifdef XOR_X86
+
+/** Defines a vector kernel from the intrinsics of a register width.
+ * dst is aligned first, so only the loads of src are unaligned*/
+#define DEFINE_VECTOR_KERNEL(name, isa, vec, width, loadu, load, store, xor) \
+	__attribute__((target(isa))) \
+	static void name(unsigned char *dst, const unsigned char *src, size_t len){ \
+		size_t head = (-(uintptr_t)dst) & (width-1); \
+		head = (head < len) ? head : len; \
+		xorWords(dst, src, head); \
+		dst += head; \
+		src += head; \
+		len -= head; \
+		for (; len >= UNROLL*width; len -= UNROLL*width){ \
+			for (int k = 0; k < UNROLL; k++){ \
+				vec a = load((const vec*)(dst + k*width)); \
+				vec b = loadu((const vec*)(src + k*width)); \
+				store((vec*)(dst + k*width), xor(a, b)); \
+			} \
+			dst += UNROLL*width; \
+			src += UNROLL*width; \
+		} \
+		for (; len >= width; len -= width){ \
+			store((vec*)dst, xor(load((const vec*)dst), loadu((const vec*)src))); \
+			dst += width; \
+			src += width; \
+		} \
+		xorWords(dst, src, len); \
+	}
+
+DEFINE_VECTOR_KERNEL(xorSse2, "sse2", __m128i, 16, _mm_loadu_si128, _mm_load_si128, _mm_store_si128, _mm_xor_si128)
+DEFINE_VECTOR_KERNEL(xorAvx2, "avx2", __m256i, 32, _mm256_loadu_si256, _mm256_load_si256, _mm256_store_si256, _mm256_xor_si256)
+DEFINE_VECTOR_KERNEL(xorAvx512, "avx512f", __m512i, 64, _mm512_loadu_si512, _mm512_load_si512, _mm512_store_si512, _mm512_xor_si512)
+
+static int hasSse2(void){
+	return __builtin_cpu_supports("sse2");
+}
+
+static int hasAvx2(void){
+	return __builtin_cpu_supports("avx2");
+}
+
+static int hasAvx512(void){
+	return __builtin_cpu_supports("avx512f");
+}
+
+#endif /* XOR_X86 */
+
+static int always(void){
+	return 1;
+}
+
+const XorKernel xor_kernels[] = {
+	{ "bytes", xorBytes, always },
+	{ "word", xorWord, always },
+#ifdef XOR_X86
+	{ "sse2", xorSse2, hasSse2 },
+	{ "avx2", xorAvx2, hasAvx2 },
+	{ "avx512f", xorAvx512, hasAvx512 },
+#endif
+};
+const int num_xor_kernels = sizeof(xor_kernels)/sizeof(xor_kernels[0]);
+
+static const XorKernel *selected = NULL; //the kernel used by xorInto
+
+/** Picks the kernel named by HW4_XOR_KERNEL, or the fastest supported one*/
+static const XorKernel *selectKernel(void){
+	const XorKernel *best = &xor_kernels[0];
+	for (int i=0; i<num_xor_kernels; i++){
+		if (xor_kernels[i].supported()){
+			best = &xor_kernels[i];
+		}
+	}
+
+	char *name = getenv("HW4_XOR_KERNEL");
+	if (name != NULL){
+		for (int i=0; i<num_xor_kernels; i++){
+			if (strcmp(xor_kernels[i].name, name) == 0 && xor_kernels[i].supported()){
+				return &xor_kernels[i];
+			}
+		}
+		fprintf(stderr, "WARNING: kernel %s is not supported, using %s\n", name, best->name);
+	}
+	return best;
+}
+
+const XorKernel *getXorKernel(void){
+	const XorKernel *k = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+	if (k == NULL){
+		k = selectKernel();
+		__atomic_store_n(&selected, k, __ATOMIC_RELEASE);
+	}
+	return k;
+}
+
+void xorInto(unsigned char *dst, const unsigned char *src, size_t len){
+	getXorKernel()->run(dst, src, len);
+}
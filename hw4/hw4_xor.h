@@ -0,0 +1,34 @@
+/*
+ * hw4_xor.h
+ *
+ *  Created on: 22 May 2018
+ *      Author: lital
+ */
+
+#ifndef HW4_XOR_H_
+#define HW4_XOR_H_
+
+#include <stddef.h>
+
+/**An XOR kernel: XORs len bytes of src into dst.
+ * Neither buffer needs to be aligned, and they must not overlap*/
+typedef void (*xor_fn)(unsigned char *dst, const unsigned char *src, size_t len);
+
+/**Describes one implementation of the XOR kernel*/
+typedef struct xor_kernel_t {
+	const char *name;
+	xor_fn run;
+	int (*supported)(void); //does the running CPU support the kernel
+} XorKernel;
+
+extern const XorKernel xor_kernels[]; //all kernels, slowest first
+extern const int num_xor_kernels;
+
+/**XORs len bytes of src into dst with the fastest kernel the CPU
+ * supports, or the one named by the HW4_XOR_KERNEL environment variable*/
+void xorInto(unsigned char *dst, const unsigned char *src, size_t len);
+
+/**Returns the kernel used by xorInto*/
+const XorKernel *getXorKernel(void);
+
+#endif /* HW4_XOR_H_ */
@@ -0,0 +1,144 @@
+/*
+ * hw4_xor_bench.c
+ *
+ *  Created on: 22 May 2018
+ *      Author: lital
+ *
+ * Microbenchmark of the XOR kernels of the merger.
+ * Checks that every kernel supported by the CPU gives exactly the same
+ * bytes as the original byte loop, for every alignment of both buffers and
+ * lengths around the register widths, and reports GB/s of dst for a chunk
+ * of the merger, which stays in the cache, and for a buffer that does not.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "hw4_xor.h"
+
+#define CHUNK_SIZE (1024*1024) //the chunk of hw4.c
+#define LARGE_SIZE (64*1024*1024) //larger than the caches
+#define DEFAULT_RUNS 20
+#define MAX_OFFSET 64 //alignments checked, of each buffer
+#define MAX_CHECK_LEN 300 //lengths checked at every alignment
+
+static uint64_t rngState = 0x9E3779B97F4A7C15ULL;
+
+/** Returns the next value of a xorshift64* generator*/
+static uint64_t nextRand(void){
+	rngState ^= rngState >> 12;
+	rngState ^= rngState << 25;
+	rngState ^= rngState >> 27;
+	return rngState * 0x2545F4914F6CDD1DULL;
+}
+
+/** Fills the buffer with random bytes*/
+static void fillRandom(unsigned char *buff, size_t len){
+	for (size_t i=0; i<len; i++){
+		buff[i] = nextRand() >> 56;
+	}
+}
+
+/** Returns the current monotonic time in seconds*/
+static double now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Compares the kernel with the byte loop at every alignment and many lengths,
+ * and on a whole chunk, checking the bytes around dst are left alone
+ *
+ * @return
+ * 0 - the kernel gives the same bytes
+ * -1 - it does not
+ * */
+static int checkKernel(const XorKernel *k, unsigned char *src, unsigned char *dst, unsigned char *expected){
+	for (int dOff = 0; dOff < MAX_OFFSET; dOff++){
+		for (int sOff = 0; sOff < MAX_OFFSET; sOff++){
+			for (size_t len = 0; len <= MAX_CHECK_LEN; len += 1 + (len > 70) * 7){
+				fillRandom(dst, MAX_OFFSET + len + 1);
+				memcpy(expected, dst, MAX_OFFSET + len + 1);
+				xor_kernels[0].run(expected + dOff, src + sOff, len);
+				k->run(dst + dOff, src + sOff, len);
+				if (memcmp(dst, expected, MAX_OFFSET + len + 1) != 0){
+					printf("ERROR: kernel %s differs from bytes at offsets %d/%d, length %zu\n", k->name, dOff, sOff, len);
+					return -1;
+				}
+			}
+		}
+	}
+	fillRandom(dst, CHUNK_SIZE + 8);
+	memcpy(expected, dst, CHUNK_SIZE + 8);
+	xor_kernels[0].run(expected + 3, src + 5, CHUNK_SIZE);
+	k->run(dst + 3, src + 5, CHUNK_SIZE);
+	if (memcmp(dst, expected, CHUNK_SIZE + 8) != 0){
+		printf("ERROR: kernel %s differs from bytes on a whole chunk\n", k->name);
+		return -1;
+	}
+	return 0;
+}
+
+/** Returns the best time of XORing size bytes with the kernel*/
+static double timeKernel(const XorKernel *k, unsigned char *dst, const unsigned char *src, size_t size, int runs){
+	double best = 1e9;
+	for (int r=0; r<runs; r++){
+		double t0 = now();
+		k->run(dst, src, size);
+		double t = now() - t0;
+		best = (t < best) ? t : best;
+	}
+	return best;
+}
+
+int main(int argc, char *argv[]){
+	int runs = (argc > 1) ? atoi(argv[1]) : DEFAULT_RUNS;
+	if (runs < 1){
+		printf("Usage: %s [runs]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	unsigned char *src = (unsigned char*)aligned_alloc(64, LARGE_SIZE);
+	unsigned char *dst = (unsigned char*)aligned_alloc(64, LARGE_SIZE);
+	unsigned char *expected = (unsigned char*)aligned_alloc(64, CHUNK_SIZE + 64);
+	if (src == NULL || dst == NULL || expected == NULL){
+		printf("ERROR: malloc has failed\n");
+		exit(EXIT_FAILURE);
+	}
+	fillRandom(src, LARGE_SIZE);
+	fillRandom(dst, LARGE_SIZE);
+
+	const size_t sizes[] = { CHUNK_SIZE, LARGE_SIZE };
+	const char *sizeNames[] = { "chunk", "large" };
+	printf("default kernel: %s\n", getXorKernel()->name);
+	printf("%-10s %-8s %10s %10s\n", "kernel", "data", "GB/s", "speedup");
+
+	int failed = 0;
+	double base[2] = {0, 0}; //GB/s of the byte loop
+	for (int k=0; k<num_xor_kernels; k++){
+		const XorKernel *kernel = &xor_kernels[k];
+		if (!kernel->supported()){
+			printf("%-10s %-8s %10s\n", kernel->name, "", "unsupported");
+			continue;
+		}
+		if (k > 0 && checkKernel(kernel, src, dst, expected) < 0){
+			failed = 1;
+			continue;
+		}
+		for (int s=0; s<2; s++){
+			double gbs = sizes[s] / timeKernel(kernel, dst, src, sizes[s], (s == 0) ? runs * 10 : runs) / 1e9;
+			if (k == 0){
+				base[s] = gbs;
+			}
+			printf("%-10s %-8s %10.2f %9.1fx\n", kernel->name, sizeNames[s], gbs, gbs / base[s]);
+		}
+	}
+
+	free(src);
+	free(dst);
+	free(expected);
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -0,0 +1,732 @@
+/*
+ * pcc_bench.c
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ *
+ * Benchmark suite of the pcc pipeline, measuring each stage in isolation:
+ *  kernel - the printable character counting kernels over a few byte
+ *           distributions, each checked against the naive kernel. The full
+ *           byte histogram used for byte classes is measured alongside them,
+ *           as the "bytes" kernel
+ *  global - updateGlobalCounter called from a growing number of threads, each
+ *           on its own shard as the workers do, and for comparison through a
+ *           single counter behind a mutex, as the server used to
+ *  e2e    - pcc_server over loopback, fed pipelined framed requests of a few
+ *           payload sizes, with the counts of the replies checked
+ * The data comes from a fixed seed and every thread is pinned to its own CPU,
+ * so runs of two builds on the same machine are comparable. Each benchmark
+ * reports its best run, as a table like the one of google-benchmark, or with
+ * -j as its JSON, which its compare.py can diff between builds.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <regex.h>
+#include <sched.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <x86intrin.h>
+
+#include "pcc_hist.h"
+#include "pcc_count.h"
+#include "pcc_proto.h"
+
+#define DEFAULT_SIZE (16 << 20) //bytes per kernel run, and largest e2e payload
+#define DEFAULT_RUNS 20
+#define DEFAULT_UPDATES (1 << 20) //updateGlobalCounter calls per thread
+#define DEFAULT_E2E_BYTES (256 << 20) //payload bytes sent per e2e benchmark
+#define DEFAULT_SERVER "./pcc_server"
+#define E2E_DEPTH 16 //requests in flight on the e2e connection
+#define E2E_MIN_REQUESTS 64 //requests per e2e benchmark, whatever the payload size
+#define CONNECT_TRIES 200 //attempts to connect to the starting server, 10 ms apart
+#define MAX_NAME 64
+
+/**Represents a byte distribution to benchmark*/
+typedef struct dist_t {
+	const char *name;
+	void (*fill)(unsigned char *buff, size_t len);
+} Dist;
+
+/**The result of one benchmark*/
+typedef struct bench_result_t {
+	char name[MAX_NAME];
+	long iterations; //operations timed by the best run
+	int runs; //number of runs
+	double realNs; //wall time of the best run, per iteration
+	double cpuNs; //CPU time of the best run, per iteration
+	double bytesPerSec; //0 if the benchmark moves no bytes
+	double itemsPerSec; //0 if it counts no items
+	double bytesPerCycle; //0 unless measured with the TSC
+} BenchResult;
+
+static uint64_t rngState = 0x9E3779B97F4A7C15ULL;
+static int num_cpus = 1; //CPUs the threads are pinned to, round robin
+static int json = 0; //print the results as JSON
+static int num_results = 0; //results printed so far
+static regex_t filter; //benchmarks to run
+static int use_filter = 0;
+
+/** Returns the next value of a xorshift64* generator*/
+static uint64_t nextRand(void){
+	rngState ^= rngState >> 12;
+	rngState ^= rngState << 25;
+	rngState ^= rngState >> 27;
+	return rngState * 0x2545F4914F6CDD1DULL;
+}
+
+/** Uniformly random bytes, like the data pcc_client sends*/
+static void fillRandom(unsigned char *buff, size_t len){
+	for (size_t i=0; i<len; i++){
+		buff[i] = nextRand() >> 56;
+	}
+}
+
+/** English-like text: mostly lower case letters, spaces and newlines*/
+static void fillText(unsigned char *buff, size_t len){
+	static const char alphabet[] = "etaoinshrdlcumwfgypbvkjxqz      ,.\nETAOIN0123456789";
+	for (size_t i=0; i<len; i++){
+		buff[i] = alphabet[(nextRand() >> 32) % (sizeof(alphabet)-1)];
+	}
+}
+
+/** Binary data with a printable char every few hundred bytes*/
+static void fillSparse(unsigned char *buff, size_t len){
+	for (size_t i=0; i<len; i++){
+		uint64_t r = nextRand();
+		buff[i] = ((r & 0xff) < 1) ? MIN_PCC + (r >> 8) % NUM_PCC : 128 + (r >> 16) % 128;
+	}
+}
+
+/** A single repeated printable char, the worst case for one counter array*/
+static void fillSame(unsigned char *buff, size_t len){
+	memset(buff, 'a', len);
+}
+
+/** Counts the printable chars through a full byte histogram*/
+static void countViaBytes(const unsigned char *buffer, size_t len, unsigned long *cntArr){
+	unsigned long bins[NUM_BYTES] = {0};
+	byteCount(buffer, len, bins);
+	bytesToPcc(bins, cntArr);
+}
+
+static int always(void){
+	return 1;
+}
+
+static const PccKernel bytes_kernel = { "bytes", countViaBytes, always };
+
+static const Dist dists[] = {
+	{ "random", fillRandom },
+	{ "text", fillText },
+	{ "sparse", fillSparse },
+	{ "same", fillSame },
+};
+
+/** Returns the current time of the clock in nanoseconds*/
+static double nowNs(clockid_t clock){
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/** Pins the calling thread to a CPU, round robin over the online ones*/
+static void pinSelf(int i){
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(i % num_cpus, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0){
+		perror("WARNING: Failed pinning a thread");
+	}
+}
+
+/** Returns whether the benchmark was selected by the -f filter*/
+static int selected(const char *name){
+	return !use_filter || regexec(&filter, name, 0, NULL, 0) == 0;
+}
+
+/** Prints the context of the results: the JSON object opening,
+ * or the header of the table*/
+static void printHeader(const char *prog){
+	if (json){
+		char host[256] = "";
+		char date[64] = "";
+		time_t t = time(NULL);
+		gethostname(host, sizeof(host)-1);
+		strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&t));
+		printf("{\n  \"context\": {\n");
+		printf("    \"date\": \"%s\",\n", date);
+		printf("    \"host_name\": \"%s\",\n", host);
+		printf("    \"executable\": \"%s\",\n", prog);
+		printf("    \"num_cpus\": %d,\n", num_cpus);
+		printf("    \"pcc_kernel\": \"%s\",\n", getPccKernel()->name);
+		printf("    \"library_build_type\": \"release\"\n");
+		printf("  },\n  \"benchmarks\": [");
+		return;
+	}
+	printf("default kernel: %s\n", getPccKernel()->name);
+	printf("%-32s %15s %15s %12s %s\n", "Benchmark", "Time", "CPU", "Iterations", "UserCounters...");
+}
+
+/** Prints one result, as a row of the table or a JSON object*/
+static void report(const BenchResult *r){
+	if (json){
+		printf("%s\n    {\n", (num_results > 0) ? "," : "");
+		printf("      \"name\": \"%s\",\n", r->name);
+		printf("      \"run_name\": \"%s\",\n", r->name);
+		printf("      \"run_type\": \"iteration\",\n");
+		printf("      \"repetitions\": %d,\n", r->runs);
+		printf("      \"iterations\": %ld,\n", r->iterations);
+		printf("      \"real_time\": %.6e,\n", r->realNs);
+		printf("      \"cpu_time\": %.6e,\n", r->cpuNs);
+		if (r->bytesPerSec > 0){
+			printf("      \"bytes_per_second\": %.6e,\n", r->bytesPerSec);
+		}
+		if (r->itemsPerSec > 0){
+			printf("      \"items_per_second\": %.6e,\n", r->itemsPerSec);
+		}
+		if (r->bytesPerCycle > 0){
+			printf("      \"bytes_per_cycle\": %.6e,\n", r->bytesPerCycle);
+		}
+		printf("      \"time_unit\": \"ns\"\n    }");
+	}
+	else {
+		printf("%-32s %12.0f ns %12.0f ns %12ld", r->name, r->realNs, r->cpuNs, r->iterations);
+		if (r->bytesPerSec > 0){
+			printf(" bytes_per_second=%.3fG/s", r->bytesPerSec / 1e9);
+		}
+		if (r->itemsPerSec > 0){
+			printf(" items_per_second=%.3fM/s", r->itemsPerSec / 1e6);
+		}
+		if (r->bytesPerCycle > 0){
+			printf(" bytes_per_cycle=%.3f", r->bytesPerCycle);
+		}
+		printf("\n");
+	}
+	fflush(stdout);
+	num_results++;
+}
+
+/** Benchmarks every kernel the CPU supports on every distribution
+ *
+ * @return
+ * 0 - on success
+ * -1 - a kernel gave different counts than the naive one
+ * */
+static int benchKernels(unsigned char *buff, size_t size, int runs){
+	int failed = 0;
+	pinSelf(0);
+	for (size_t d=0; d<sizeof(dists)/sizeof(dists[0]); d++){
+		dists[d].fill(buff, size);
+		//odd offsets and lengths exercise the unaligned head and the tail
+		unsigned long expected[NUM_PCC] = {0};
+		pcc_kernels[0].count(buff+1, size-3, expected);
+
+		for (int k=0; k<=num_pcc_kernels; k++){
+			const PccKernel *kernel = (k < num_pcc_kernels) ? &pcc_kernels[k] : &bytes_kernel;
+			BenchResult r = { .iterations = 1, .runs = runs };
+			snprintf(r.name, sizeof(r.name), "kernel/%s/%s", kernel->name, dists[d].name);
+			if (!selected(r.name) || !kernel->supported()){
+				continue;
+			}
+
+			unsigned long cntArr[NUM_PCC] = {0};
+			kernel->count(buff+1, size-3, cntArr);
+			if (memcmp(cntArr, expected, sizeof(cntArr)) != 0){
+				fprintf(stderr, "ERROR: kernel %s differs from naive on %s data\n", kernel->name, dists[d].name);
+				failed = 1;
+			}
+
+			uint64_t bestCycles = UINT64_MAX;
+			r.realNs = r.cpuNs = 1e18;
+			for (int i=0; i<runs; i++){
+				memset(cntArr, 0, sizeof(cntArr));
+				double t0 = nowNs(CLOCK_MONOTONIC);
+				double c0 = nowNs(CLOCK_THREAD_CPUTIME_ID);
+				uint64_t tsc = __rdtsc();
+				kernel->count(buff, size, cntArr);
+				uint64_t cycles = __rdtsc() - tsc;
+				double cpu = nowNs(CLOCK_THREAD_CPUTIME_ID) - c0;
+				double t = nowNs(CLOCK_MONOTONIC) - t0;
+				bestCycles = (cycles < bestCycles) ? cycles : bestCycles;
+				r.cpuNs = (cpu < r.cpuNs) ? cpu : r.cpuNs;
+				r.realNs = (t < r.realNs) ? t : r.realNs;
+			}
+			r.bytesPerSec = size / (r.realNs / 1e9);
+			r.bytesPerCycle = (double)size / bestCycles;
+			report(&r);
+		}
+	}
+	return failed ? -1 : 0;
+}
+
+/**The threads of one global benchmark*/
+typedef struct global_bench_t {
+	int numThreads;
+	int locked; //update one counter behind a mutex instead of a shard each
+	long updates; //calls per thread
+	const unsigned long *cntArr; //the counts added by each call
+	pthread_barrier_t start; //released once every thread is pinned
+} GlobalBench;
+
+/**A thread of a global benchmark*/
+typedef struct global_thread_t {
+	pthread_t thread;
+	GlobalBench *b;
+	int index;
+	double startNs; //when the thread started updating
+	double endNs; //when it was done
+	double cpuNs; //its CPU time meanwhile
+} GlobalThread;
+
+static pthread_mutex_t locked_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long locked_cnt[NUM_PCC]; //the single counter of the locked benchmarks
+
+/** Adds the counts the specified number of times, to the thread's shard
+ * or to the locked counter*/
+static void* globalThread(void *arg){
+	GlobalThread *t = (GlobalThread*)arg;
+	GlobalBench *b = t->b;
+	pinSelf(t->index);
+	PccShard *shard = getPccShard(t->index);
+	pthread_barrier_wait(&b->start);
+	//timed by each thread, as the main thread may not run before they are done
+	t->startNs = nowNs(CLOCK_MONOTONIC);
+	double c0 = nowNs(CLOCK_THREAD_CPUTIME_ID);
+	for (long i=0; i<b->updates; i++){
+		if (b->locked){
+			pthread_mutex_lock(&locked_lock);
+			for (int j=0; j<NUM_PCC; j++){
+				locked_cnt[j] += b->cntArr[j];
+			}
+			pthread_mutex_unlock(&locked_lock);
+		}
+		else {
+			updateGlobalCounter(shard, b->cntArr);
+		}
+	}
+	t->cpuNs = nowNs(CLOCK_THREAD_CPUTIME_ID) - c0;
+	t->endNs = nowNs(CLOCK_MONOTONIC);
+	return NULL;
+}
+
+/** Times one run of a global benchmark
+ *
+ * @param b - the benchmark
+ * @param realNs - set to the wall time of the run, from the first thread starting to the last one done
+ * @param cpuNs - set to the CPU time of the threads
+ * */
+static void runGlobal(GlobalBench *b, double *realNs, double *cpuNs){
+	GlobalThread *threads = (GlobalThread*)calloc(b->numThreads, sizeof(GlobalThread));
+	if (threads == NULL){
+		printf("ERROR: malloc has failed\n");
+		exit(EXIT_FAILURE);
+	}
+	pthread_barrier_init(&b->start, NULL, b->numThreads + 1);
+	for (int i=0; i<b->numThreads; i++){
+		threads[i].b = b;
+		threads[i].index = i;
+		if (pthread_create(&threads[i].thread, NULL, globalThread, &threads[i]) != 0){
+			perror("ERROR in pthread_create()");
+			exit(EXIT_FAILURE);
+		}
+	}
+	pthread_barrier_wait(&b->start); //every thread is pinned, let them start together
+	double first = 1e300, last = 0;
+	*cpuNs = 0;
+	for (int i=0; i<b->numThreads; i++){
+		pthread_join(threads[i].thread, NULL);
+		first = (threads[i].startNs < first) ? threads[i].startNs : first;
+		last = (threads[i].endNs > last) ? threads[i].endNs : last;
+		*cpuNs += threads[i].cpuNs;
+	}
+	*realNs = last - first;
+	pthread_barrier_destroy(&b->start);
+	free(threads);
+}
+
+/** Benchmarks updateGlobalCounter with 1, 2, 4... up to maxThreads threads,
+ * sharded and locked
+ *
+ * @return
+ * 0 - on success
+ * -1 - the counters lost updates
+ * */
+static int benchGlobal(unsigned char *buff, int maxThreads, long updates, int runs){
+	//the counts of a typical 4 KiB request
+	unsigned long cntArr[NUM_PCC] = {0};
+	fillRandom(buff, 4096);
+	pccCount(buff, 4096, cntArr);
+
+	if (initPccCount(maxThreads) < 0){
+		printf("ERROR: malloc has failed\n");
+		exit(EXIT_FAILURE);
+	}
+	unsigned long calls[2] = {0, 0}; //updates made by the sharded and the locked runs
+	for (int locked=0; locked<=1; locked++){
+		for (int n=1; n<=maxThreads; n = (n < maxThreads && n*2 > maxThreads) ? maxThreads : n*2){
+			GlobalBench b = { .numThreads = n, .locked = locked, .updates = updates, .cntArr = cntArr };
+			BenchResult r = { .iterations = n * updates, .runs = runs };
+			snprintf(r.name, sizeof(r.name), "global/%s/threads:%d", locked ? "locked" : "sharded", n);
+			if (!selected(r.name)){
+				continue;
+			}
+			r.realNs = r.cpuNs = 1e18;
+			for (int i=0; i<runs; i++){
+				double t, cpu;
+				runGlobal(&b, &t, &cpu);
+				calls[locked] += r.iterations;
+				r.realNs = (t < r.realNs) ? t : r.realNs;
+				r.cpuNs = (cpu < r.cpuNs) ? cpu : r.cpuNs;
+			}
+			r.itemsPerSec = r.iterations / (r.realNs / 1e9);
+			r.realNs /= r.iterations;
+			r.cpuNs /= r.iterations;
+			report(&r);
+		}
+	}
+
+	//every update made is in the counters
+	int failed = 0;
+	unsigned long total[NUM_PCC];
+	snapshotPccCount(total);
+	for (int i=0; i<NUM_PCC; i++){
+		if (total[i] != cntArr[i] * calls[0] || locked_cnt[i] != cntArr[i] * calls[1]){
+			failed = 1;
+		}
+	}
+	if (failed){
+		fprintf(stderr, "ERROR: updateGlobalCounter lost updates\n");
+	}
+	freePccCount();
+	return failed ? -1 : 0;
+}
+
+/** Returns a loopback port no socket is bound to right now*/
+static unsigned int freePort(void){
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+			getsockname(fd, (struct sockaddr*)&addr, &len) < 0){
+		perror("ERROR: Failed finding a free port");
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+	return ntohs(addr.sin_port);
+}
+
+/** Starts the server on the port, on every CPU but the client's first one
+ *
+ * @return the server's pid*/
+static pid_t startServer(const char *server, int workers, unsigned int port){
+	pid_t pid = fork();
+	if (pid < 0){
+		perror("ERROR in fork()");
+		exit(EXIT_FAILURE);
+	}
+	if (pid > 0){
+		return pid;
+	}
+	if (num_cpus > 1){
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int i=1; i<num_cpus; i++){
+			CPU_SET(i, &set);
+		}
+		sched_setaffinity(0, sizeof(set), &set);
+	}
+	int devnull = open("/dev/null", O_WRONLY);
+	if (devnull >= 0){ //the final counts and the drain summary
+		dup2(devnull, STDOUT_FILENO);
+		dup2(devnull, STDERR_FILENO);
+	}
+	char workersArg[16], portArg[16];
+	snprintf(workersArg, sizeof(workersArg), "%d", workers);
+	snprintf(portArg, sizeof(portArg), "%u", port);
+	execl(server, server, "-w", workersArg, portArg, (char*)NULL);
+	perror("ERROR: Failed starting the server");
+	_exit(EXIT_FAILURE);
+}
+
+/** Connects to the server on the loopback port and exchanges the hello,
+ * retrying while the server starts
+ *
+ * @return the connected socket*/
+static int connectServer(unsigned int port){
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	for (int i=0; i<CONNECT_TRIES; i++){
+		int fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+		if (fd < 0){
+			break;
+		}
+		if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0){
+			int one = 1;
+			uint32_t hello = htonl(PCC_HELLO(PCC_VERSION));
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			if (send(fd, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello) ||
+					recv(fd, &hello, sizeof(hello), MSG_WAITALL) != sizeof(hello) ||
+					(ntohl(hello) & PCC_MAGIC_MASK) != PCC_MAGIC){
+				fprintf(stderr, "ERROR: The server does not speak the framed protocol\n");
+				exit(EXIT_FAILURE);
+			}
+			return fd;
+		}
+		close(fd);
+		usleep(10000);
+	}
+	perror("ERROR: Failed connecting to the server");
+	exit(EXIT_FAILURE);
+}
+
+/** Reads the next final reply and returns its count
+ *
+ * @return
+ * the count of the reply
+ * -1 - on error, or if the request failed
+ * */
+static long readCount(int fd){
+	unsigned char hdr[PCC_REP_HDR_SIZE];
+	unsigned char body[PCC_MAX_COMPACT_LEN];
+	PccRepHdr rep;
+	do {
+		if (recv(fd, hdr, sizeof(hdr), MSG_WAITALL) != sizeof(hdr)){
+			return -1;
+		}
+		unpackRepHdr(hdr, &rep);
+		if (rep.len > sizeof(body) || (rep.len > 0 && recv(fd, body, rep.len, MSG_WAITALL) != (ssize_t)rep.len)){
+			return -1;
+		}
+	} while (rep.type == PCC_REP_PROGRESS);
+	if (rep.status != PCC_STATUS_OK || rep.len < sizeof(uint64_t)){
+		return -1;
+	}
+	return unpackU64(body);
+}
+
+/** Sends numRequests pipelined count requests of the first len bytes of buff
+ *
+ * @return
+ * the sum of the counts of the replies
+ * -1 - on error
+ * */
+static long runE2e(int fd, const unsigned char *buff, size_t len, long numRequests){
+	long total = 0;
+	long inFlight = 0;
+	for (long i=0; i<numRequests; i++){
+		if (inFlight == E2E_DEPTH){
+			long cnt = readCount(fd);
+			if (cnt < 0){
+				return -1;
+			}
+			total += cnt;
+			inFlight--;
+		}
+		unsigned char hdr[PCC_REQ_HDR_SIZE];
+		PccReqHdr req = { .id = i+1, .type = PCC_REQ_COUNT, .flags = 0, .optLen = 0, .len = len };
+		packReqHdr(&req, hdr);
+		if (send(fd, hdr, sizeof(hdr), MSG_NOSIGNAL|MSG_MORE) != sizeof(hdr)){
+			return -1;
+		}
+		for (size_t sent = 0; sent < len; ){
+			ssize_t n = send(fd, buff + sent, len - sent, MSG_NOSIGNAL);
+			if (n < 0 && errno != EINTR){
+				return -1;
+			}
+			sent += (n > 0) ? n : 0;
+		}
+		inFlight++;
+	}
+	for (; inFlight > 0; inFlight--){
+		long cnt = readCount(fd);
+		if (cnt < 0){
+			return -1;
+		}
+		total += cnt;
+	}
+	return total;
+}
+
+/** Benchmarks pcc_server over loopback with payloads from 4 KiB to size bytes
+ *
+ * @return
+ * 0 - on success
+ * -1 - a reply failed or had the wrong count
+ * */
+static int benchE2e(unsigned char *buff, size_t size, const char *server, int workers, unsigned long totalBytes, int runs){
+	const size_t lens[] = { 4096, 64*1024, 1024*1024, 16*1024*1024 };
+	int any = 0;
+	for (size_t l=0; l<sizeof(lens)/sizeof(lens[0]); l++){
+		char name[MAX_NAME];
+		snprintf(name, sizeof(name), "e2e/len:%zu/workers:%d", lens[l], workers);
+		any |= lens[l] <= size && selected(name);
+	}
+	if (!any){
+		return 0;
+	}
+
+	fillRandom(buff, size);
+	unsigned int port = freePort();
+	pid_t pid = startServer(server, workers, port);
+	pinSelf(0);
+	int fd = connectServer(port);
+
+	int failed = 0;
+	for (size_t l=0; l<sizeof(lens)/sizeof(lens[0]) && !failed; l++){
+		size_t len = lens[l];
+		BenchResult r = { .runs = runs };
+		snprintf(r.name, sizeof(r.name), "e2e/len:%zu/workers:%d", len, workers);
+		if (len > size || !selected(r.name)){
+			continue;
+		}
+		unsigned long cntArr[NUM_PCC] = {0};
+		pcc_kernels[0].count(buff, len, cntArr);
+		long expected = 0;
+		for (int i=0; i<NUM_PCC; i++){
+			expected += cntArr[i];
+		}
+
+		r.iterations = totalBytes / len;
+		if (r.iterations < E2E_MIN_REQUESTS){
+			r.iterations = E2E_MIN_REQUESTS;
+		}
+		r.realNs = r.cpuNs = 1e18;
+		for (int i=0; i<runs && !failed; i++){
+			double t0 = nowNs(CLOCK_MONOTONIC);
+			double c0 = nowNs(CLOCK_THREAD_CPUTIME_ID);
+			long total = runE2e(fd, buff, len, r.iterations);
+			double cpu = nowNs(CLOCK_THREAD_CPUTIME_ID) - c0;
+			double t = nowNs(CLOCK_MONOTONIC) - t0;
+			if (total != expected * r.iterations){
+				fprintf(stderr, "ERROR: %s counted %ld printable characters instead of %ld\n", r.name, total, expected * r.iterations);
+				failed = 1;
+			}
+			r.realNs = (t < r.realNs) ? t : r.realNs;
+			r.cpuNs = (cpu < r.cpuNs) ? cpu : r.cpuNs;
+		}
+		if (failed){
+			break;
+		}
+		r.bytesPerSec = len * r.iterations / (r.realNs / 1e9);
+		r.itemsPerSec = r.iterations / (r.realNs / 1e9);
+		r.realNs /= r.iterations;
+		r.cpuNs /= r.iterations;
+		report(&r);
+	}
+
+	close(fd);
+	kill(pid, SIGINT);
+	waitpid(pid, NULL, 0);
+	return failed ? -1 : 0;
+}
+
+/**Prints the usage message and exits*/
+static void usage(char *prog){
+	printf("Usage: %s [-s bytes] [-r runs] [-t threads] [-u updates] [-e bytes] [-w workers] [-S server] [-f regex] [-j]\n", prog);
+	printf("  -s  bytes per kernel run, and the largest e2e payload, %d by default\n", DEFAULT_SIZE);
+	printf("  -r  runs of each benchmark, the best is reported, %d by default\n", DEFAULT_RUNS);
+	printf("  -t  most threads of the global benchmarks, one per CPU by default\n");
+	printf("  -u  updateGlobalCounter calls per thread, %d by default\n", DEFAULT_UPDATES);
+	printf("  -e  payload bytes of each e2e run, %d by default, 0 to skip the e2e benchmarks\n", DEFAULT_E2E_BYTES);
+	printf("  -w  workers of the e2e server, 1 by default\n");
+	printf("  -S  the pcc_server binary, %s by default\n", DEFAULT_SERVER);
+	printf("  -f  only run the benchmarks whose name matches this regular expression\n");
+	printf("  -j  print the results as google-benchmark JSON\n");
+	printf("  benchmarks are named kernel/<kernel>/<data>, global/<sharded|locked>/threads:<n>\n");
+	printf("  and e2e/len:<bytes>/workers:<n>\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]){
+	num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t size = DEFAULT_SIZE;
+	int runs = DEFAULT_RUNS;
+	int maxThreads = num_cpus;
+	long updates = DEFAULT_UPDATES;
+	unsigned long e2eBytes = DEFAULT_E2E_BYTES;
+	int workers = 1;
+	const char *server = DEFAULT_SERVER;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:r:t:u:e:w:S:f:j")) != -1){
+		switch (opt){
+		case 's':
+			size = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case 't':
+			maxThreads = atoi(optarg);
+			break;
+		case 'u':
+			updates = atol(optarg);
+			break;
+		case 'e':
+			e2eBytes = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			workers = atoi(optarg);
+			break;
+		case 'S':
+			server = optarg;
+			break;
+		case 'f':
+			if (regcomp(&filter, optarg, REG_EXTENDED|REG_NOSUB) != 0){
+				usage(argv[0]);
+			}
+			use_filter = 1;
+			break;
+		case 'j':
+			json = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (size < 4096 || runs < 1 || maxThreads < 1 || updates < 1 || workers < 1 || num_cpus < 1){
+		usage(argv[0]);
+	}
+
+	unsigned char *buff = (unsigned char*)malloc(size);
+	if (buff == NULL){
+		printf("ERROR: malloc has failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printHeader(argv[0]);
+	int failed = 0;
+	failed |= benchKernels(buff, size, runs) < 0;
+	failed |= benchGlobal(buff, maxThreads, updates, runs) < 0;
+	if (e2eBytes > 0){
+		failed |= benchE2e(buff, size, server, workers, e2eBytes, runs) < 0;
+	}
+	if (json){
+		printf("\n  ]\n}\n");
+	}
+
+	free(buff);
+	if (use_filter){
+		regfree(&filter);
+	}
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
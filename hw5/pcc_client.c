@@ -17,8 +17,31 @@
 #include <arpa/inet.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
+
+#include "pcc_hist.h"
+#include "pcc_proto.h"
+#include "pcc_load.h"
+#include "pcc_latency.h"
+#include "pcc_ring.h"
 
 #define BUFFER_SIZE 2048
+#define MAX_REPLY_BODY 4096 //maximum length of a reply body the client keeps
+#define CHUNK_SIZE (64*1024) //payload bytes sent between checks for replies
+#define MAX_CLASS_NAME 16 //maximum length of a byte class name the client prints
+#define MAX_PARTS 64 //maximum number of connections a file is split across
+#define MIN_PART_SIZE (64*1024*1024) //smallest part of a file worth its own connection
+#define PART_ALIGN (1024*1024) //parts start at multiples of this, a multiple of the page size
+#define SENDFILE_MAX (1024*1024*1024) //bytes passed to a single sendfile call
+#define MAX_CLASS_OPTS (PCC_MAX_OPT_LEN - 2*PCC_OPT_HDR_SIZE - sizeof(uint32_t) - PCC_MAX_KEY_LEN) //leaves room for the other options
+
+static const char *class_names[PCC_NUM_CLASSES] = { "printable", "digit", "alpha", "space",
+		"control", "utf8lead", "utf8cont", "high" }; //indexed by PCC_CLASS_*
 
 /**
  * Writes the specified 4 bytes number to the file descriptor
@@ -63,7 +86,7 @@ int readInt (int fd, uint32_t *res){
 
 	while(left > 0) {
 		bytes_read = read(fd, data, left);
-		if (bytes_read < 0){
+		if (bytes_read <= 0){
 			return -1;
 		}
 		else{
@@ -103,11 +126,57 @@ int writeArr(int fd, int len, unsigned char *arr){
 
 }
 
-int main(int argc, char *argv[]) {
-	//command line arguments
-	char *host = argv[1];
-	char *port = argv[2];
-	unsigned long len = strtoul(argv[3], NULL, 10);
+/** Reads exactly len bytes from the file descriptor
+ *
+ * @return
+ * 0 - on success
+ * -1 - on error or if the connection was closed
+ * */
+int readAll(int fd, void *buf, size_t len){
+	char *data = (char*)buf;
+	while (len > 0){
+		ssize_t bytes_read = read(fd, data, len);
+		if (bytes_read <= 0){
+			return -1;
+		}
+		data += bytes_read;
+		len -= bytes_read;
+	}
+	return 0;
+}
+
+/** Connects to the UNIX socket path of a server running on this host
+ *
+ * @return the connected socket file descriptor*/
+int connectLocal(const char *path){
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)){
+		printf("ERROR: The UNIX socket path is too long\n");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(addr.sun_path, path);
+	int sockfd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (sockfd == -1) {
+		perror("Failed creating socket");
+		exit(EXIT_FAILURE);
+	}
+	if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		perror("Could not connect");
+		exit(EXIT_FAILURE);
+	}
+	return sockfd;
+}
+
+/** Connects to the specified host and port, or to the UNIX socket
+ * path in host if port is NULL
+ *
+ * @return the connected socket file descriptor*/
+int connectTo(char *host, char *port){
+	if (port == NULL){
+		return connectLocal(host);
+	}
 
 	//create socket
 	int sockfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -137,19 +206,16 @@ int main(int argc, char *argv[]) {
 		exit(EXIT_FAILURE);
 	}
 	freeaddrinfo(result);
+	return sockfd;
+}
 
-	//send the length to the server
-	if (writeInt(sockfd, htonl(len)) < 0){
-		perror("Failed sending data to server");
-		exit(EXIT_FAILURE);
-	}
-
-	//read from "/dev/urandom" and send the data to server
-	int fd = open ("/dev/urandom",O_RDONLY);
-	if (fd == -1){
-		perror("Failed opening file");
-		exit(EXIT_FAILURE);
-	}
+/** Reads len bytes from "/dev/urandom" and sends them to the server
+ *
+ * @param sockfd - socket file descriptor
+ * @param fd - "/dev/urandom" file descriptor
+ * @param len - number of bytes to send
+ * */
+void sendRandom(int sockfd, int fd, unsigned long len){
 	unsigned char buffer[BUFFER_SIZE];
 	unsigned long toRead = len;
 	int bytesRead;
@@ -171,6 +237,1034 @@ int main(int argc, char *argv[]) {
 		toRead -= bytesRead;
 
 	}
+}
+
+/**A framed protocol session over one connection*/
+typedef struct session_t {
+	int sockfd; //socket file descriptor
+	int randfd; //"/dev/urandom" file descriptor
+	int inFlight; //number of requests waiting for their final reply
+	unsigned long total; //sum of the counts of the successful requests
+	uint32_t progressMiB; //ask for a progress reply every this many MiB, 0 for none
+	int histogram; //ask for the histogram in the progress replies
+	unsigned long cancelAfter; //cancel each request after sending this many bytes, 0 to never cancel
+	char *key; //stream key of the count requests, NULL for none
+	char *query; //key whose histogram is read at the end, NULL for none
+	uint32_t queryId; //id of the query request
+	int bytes; //ask for the count of each byte value
+	int compact; //ask for compact replies with the histogram
+	int json; //print the replies as JSON lines
+	int numClasses; //number of byte classes counted by each request
+	char classNames[PCC_MAX_CLASSES][MAX_CLASS_NAME]; //the byte classes, in reply order
+	unsigned char classOpts[PCC_MAX_OPT_LEN]; //the options asking for them
+	size_t classOptLen; //length of classOpts
+	size_t ringSize; //size of the shared memory ring the requests are written to, 0 to send them on the socket
+	PccRing ring; //the ring, once attached
+} Session;
+
+/** Parses a comma separated list of byte classes into options of the session.
+ * A class is the name of a built-in one or a range of byte values, as in 0x80-0xff
+ *
+ * @return
+ * 0 - on success
+ * -1 - a class is unknown, or there are too many of them
+ * */
+int parseClasses(Session *s, char *list){
+	for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")){
+		if (s->numClasses == PCC_MAX_CLASSES || s->classOptLen + PCC_OPT_HDR_SIZE + PCC_BYTE_SET_SIZE > MAX_CLASS_OPTS){
+			return -1;
+		}
+		int id = 0;
+		while (id < PCC_NUM_CLASSES && strcmp(name, class_names[id]) != 0){
+			id++;
+		}
+		if (id < PCC_NUM_CLASSES){
+			uint8_t classId = id;
+			s->classOptLen += packOption(s->classOpts+s->classOptLen, PCC_OPT_CLASSES, &classId, sizeof(classId));
+		}
+		else {
+			char *end;
+			unsigned long lo = strtoul(name, &end, 0);
+			unsigned long hi = (*end == '-') ? strtoul(end+1, &end, 0) : lo;
+			if (*end != '\0' || end == name || lo > hi || hi >= NUM_BYTES){
+				return -1;
+			}
+			unsigned char set[PCC_BYTE_SET_SIZE] = {0};
+			for (unsigned long b=lo; b<=hi; b++){
+				set[b/8] |= 1 << (b%8);
+			}
+			s->classOptLen += packOption(s->classOpts+s->classOptLen, PCC_OPT_BYTE_SET, set, sizeof(set));
+		}
+		snprintf(s->classNames[s->numClasses++], MAX_CLASS_NAME, "%s", name);
+	}
+	return 0;
+}
+
+/**A decoded final reply to a count request or a query*/
+typedef struct result_t {
+	unsigned long count; //number of printable chars
+	int numClasses; //number of byte class counts
+	unsigned long classCnt[PCC_MAX_CLASSES];
+	int histLen; //number of counts in hist: 0, NUM_PCC or NUM_BYTES
+	int first; //the byte value counted by hist[0]
+	unsigned long hist[NUM_BYTES];
+} Result;
+
+/** Prints the non zero counts of a histogram, by char or by byte value*/
+void printHistogram(const char *label, const unsigned long *hist, int num, int first){
+	printf("  %s:", label);
+	for (int i=0; i<num; i++){
+		if (hist[i] > 0 && i+first >= MIN_PCC && i+first <= MAX_PCC){
+			printf(" '%c':%lu", i+first, hist[i]);
+		}
+		else if (hist[i] > 0){
+			printf(" 0x%02x:%lu", i+first, hist[i]);
+		}
+	}
+	printf("\n");
+}
+
+/** Prints a string as a JSON string*/
+void printJsonString(const char *str){
+	putchar('"');
+	for (; *str != '\0'; str++){
+		if (*str == '"' || *str == '\\'){
+			printf("\\%c", *str);
+		}
+		else if ((unsigned char)*str < MIN_PCC){
+			printf("\\u%04x", *str);
+		}
+		else {
+			putchar(*str);
+		}
+	}
+	putchar('"');
+}
+
+/** Prints a reply as one line of JSON*/
+void printJson(Session *s, const PccRepHdr *rep, const Result *r){
+	static const char *statuses[] = { "ok", "bad_request", "cancelled", "busy", "not_found" };
+	printf("{\"id\":%u,\"status\":", rep->id);
+	if (rep->status < sizeof(statuses)/sizeof(statuses[0])){
+		printf("\"%s\"", statuses[rep->status]);
+	}
+	else {
+		printf("%u", rep->status);
+	}
+	if (s->query != NULL && rep->id == s->queryId){
+		printf(",\"key\":");
+		printJsonString(s->query);
+	}
+	if (r != NULL){
+		printf(",\"count\":%lu", r->count);
+	}
+	if (r != NULL && r->numClasses > 0){
+		printf(",\"classes\":{");
+		for (int i=0; i<r->numClasses; i++){
+			printf(i > 0 ? "," : "");
+			printJsonString(s->classNames[i]);
+			printf(":%lu", r->classCnt[i]);
+		}
+		printf("}");
+	}
+	if (r != NULL && r->histLen > 0){
+		printf(",\"histogram\":{");
+		for (int i=0, sep=0; i<r->histLen; i++){
+			if (r->hist[i] > 0){
+				printf("%s\"%d\":%lu", sep++ ? "," : "", i+r->first, r->hist[i]);
+			}
+		}
+		printf("}");
+	}
+	printf("}\n");
+}
+
+/** Decodes the body of a successful final reply, in the fixed or compact form
+ *
+ * @return
+ * 0 - on success
+ * -1 - the body is malformed
+ * */
+int decodeResult(Session *s, const PccRepHdr *rep, const unsigned char *body, Result *r){
+	int query = (rep->id == s->queryId);
+	memset(r, 0, sizeof(*r));
+	r->numClasses = query ? 0 : s->numClasses;
+	r->first = (!query && s->bytes) ? 0 : MIN_PCC;
+
+	if (s->compact){
+		size_t pos = 0;
+		uint64_t num;
+		if (unpackVarint(body, rep->len, &pos, &num) < 0){
+			return -1;
+		}
+		r->count = num;
+		for (int i=0; i<r->numClasses; i++){
+			if (unpackVarint(body, rep->len, &pos, &num) < 0){
+				return -1;
+			}
+			r->classCnt[i] = num;
+		}
+		r->histLen = (r->first == 0) ? NUM_BYTES : NUM_PCC;
+		return unpackHistogram(body, rep->len, &pos, r->hist, r->histLen);
+	}
+
+	if (query){
+		r->histLen = NUM_PCC;
+	}
+	else if (s->bytes){
+		r->histLen = NUM_BYTES;
+	}
+	if (rep->len != (1 + r->numClasses + r->histLen)*sizeof(uint64_t)){
+		return -1;
+	}
+	r->count = unpackU64(body);
+	for (int i=0; i<r->numClasses; i++){
+		r->classCnt[i] = unpackU64(body + (1+i)*sizeof(uint64_t));
+	}
+	for (int i=0; i<r->histLen; i++){
+		r->hist[i] = unpackU64(body + (1+r->numClasses+i)*sizeof(uint64_t));
+	}
+	return 0;
+}
+
+/** Reads the next framed reply from the socket
+ *
+ * @param sockfd - socket file descriptor
+ * @param rep - filled with the reply header
+ * @param body - filled with the reply body, MAX_REPLY_BODY bytes at most
+ * */
+void readFrame(int sockfd, PccRepHdr *rep, unsigned char *body){
+	unsigned char hdr[PCC_REP_HDR_SIZE];
+	if (readAll(sockfd, hdr, sizeof(hdr)) < 0){
+		perror("Failed getting data from server");
+		exit(EXIT_FAILURE);
+	}
+	unpackRepHdr(hdr, rep);
+	if (rep->len > MAX_REPLY_BODY || readAll(sockfd, body, rep->len) < 0){
+		printf("ERROR: Bad reply from server\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/** Prints a final reply, decoded into r if it succeeded
+ *
+ * @param s - the session
+ * @param rep - the reply header
+ * @param body - the reply body
+ * @param r - the decoded result, NULL unless the status is PCC_STATUS_OK
+ * */
+void printReply(Session *s, const PccRepHdr *rep, const unsigned char *body, const Result *r){
+	if (s->json){
+		printJson(s, rep, r);
+	}
+	else if (rep->status == PCC_STATUS_CANCELLED && rep->len >= sizeof(uint64_t)){
+		printf("request %u: cancelled after %lu printable characters\n", rep->id, (unsigned long)unpackU64(body));
+	}
+	else if (rep->status == PCC_STATUS_BUSY){
+		printf("request %u: rejected, the server is busy\n", rep->id);
+	}
+	else if (rep->status == PCC_STATUS_NOT_FOUND){
+		printf("request %u: key '%s' not found\n", rep->id, s->query);
+	}
+	else if (rep->status != PCC_STATUS_OK){
+		printf("request %u: failed with status %u\n", rep->id, rep->status);
+	}
+	else if (rep->id == s->queryId){ //the histogram of a key
+		printf("request %u: key '%s' has %lu printable characters\n", rep->id, s->query, r->count);
+		printHistogram("histogram", r->hist, r->histLen, r->first);
+	}
+	else {
+		printf("request %u: # of printable characters: %lu\n", rep->id, r->count);
+		for (int i=0; i<r->numClasses; i++){
+			printf("  %s: %lu\n", s->classNames[i], r->classCnt[i]);
+		}
+		if (r->histLen > 0){
+			printHistogram((r->first == 0) ? "bytes" : "histogram", r->hist, r->histLen, r->first);
+		}
+	}
+}
+
+/** Reads the next framed reply and prints it
+ *
+ * @param s - the session
+ * */
+void readReply(Session *s){
+	unsigned char body[MAX_REPLY_BODY];
+	PccRepHdr rep;
+	readFrame(s->sockfd, &rep, body);
+
+	if (rep.type == PCC_REP_PROGRESS){
+		unsigned long hist[NUM_PCC];
+		unsigned long sent = (rep.len >= 2*sizeof(uint64_t)) ? unpackU64(body) : 0;
+		unsigned long cnt = (rep.len >= 2*sizeof(uint64_t)) ? unpackU64(body+sizeof(uint64_t)) : 0;
+		if (s->json){
+			printf("{\"id\":%u,\"progress\":%lu,\"count\":%lu}\n", rep.id, sent, cnt);
+			return;
+		}
+		printf("request %u: %lu bytes sent, %lu printable characters so far\n", rep.id, sent, cnt);
+		if (rep.len >= (2+NUM_PCC)*sizeof(uint64_t)){
+			for (int i=0; i<NUM_PCC; i++){
+				hist[i] = unpackU64(body + (2+i)*sizeof(uint64_t));
+			}
+			printHistogram("histogram", hist, NUM_PCC, MIN_PCC);
+		}
+		return;
+	}
+
+	s->inFlight--;
+	Result r;
+	if (rep.status == PCC_STATUS_OK && decodeResult(s, &rep, body, &r) < 0){
+		printf("ERROR: Bad reply from server\n");
+		exit(EXIT_FAILURE);
+	}
+	if (rep.status == PCC_STATUS_OK && rep.id != s->queryId){
+		s->total += r.count;
+	}
+	printReply(s, &rep, body, (rep.status == PCC_STATUS_OK) ? &r : NULL);
+}
+
+/** Reads and prints the replies that have already arrived, without blocking*/
+void drainReplies(Session *s){
+	struct pollfd pfd = { .fd = s->sockfd, .events = POLLIN };
+	while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN)){
+		readReply(s);
+	}
+}
+
+/** Creates a shared memory ring and passes it to the server over the local
+ * connection, after which every request is written to the ring. Exits if
+ * the server refuses it
+ *
+ * @param sockfd - the connection, to a UNIX socket
+ * @param r - filled with the ring
+ * @param size - size of the ring, a power of two
+ * */
+void shareRing(int sockfd, PccRing *r, size_t size){
+	if (createRing(r, size) < 0){
+		perror("Failed creating the shared memory ring");
+		exit(EXIT_FAILURE);
+	}
+	unsigned char hdr[PCC_REQ_HDR_SIZE];
+	PccReqHdr req = { .id = 0, .type = PCC_REQ_ATTACH, .flags = 0, .optLen = 0, .len = 0 };
+	packReqHdr(&req, hdr);
+
+	int fds[PCC_RING_FDS] = { r->memfd, r->dataFd, r->spaceFd };
+	char control[CMSG_SPACE(sizeof(fds))];
+	memset(control, 0, sizeof(control));
+	struct iovec iov = { .iov_base = hdr, .iov_len = sizeof(hdr) };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+	if (sendmsg(sockfd, &mh, MSG_NOSIGNAL) != sizeof(hdr)){
+		perror("Failed sending data to server");
+		exit(EXIT_FAILURE);
+	}
+
+	PccRepHdr rep;
+	unsigned char body[MAX_REPLY_BODY];
+	readFrame(sockfd, &rep, body);
+	if (rep.status != PCC_STATUS_OK){
+		printf("ERROR: The server refused the shared memory ring\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/** Waits until the server frees room in the full ring. The replies that
+ * arrive meanwhile are read, as the server stops reading the ring while
+ * they are not
+ *
+ * @param r - the ring
+ * @param sockfd - the connection the ring was passed on
+ * @param s - the session whose replies are read, NULL if none are expected before the end
+ * */
+void waitRing(PccRing *r, int sockfd, Session *s){
+	if (!ringProducerSleep(r)){
+		return;
+	}
+	struct pollfd pfds[2] = {
+		{ .fd = r->spaceFd, .events = POLLIN },
+		{ .fd = sockfd, .events = (s != NULL) ? POLLIN : 0 },
+	};
+	while (poll(pfds, 2, -1) < 0){
+		if (errno != EINTR){
+			perror("ERROR in poll()");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (pfds[0].revents & POLLIN){
+		uint64_t room;
+		if (read(r->spaceFd, &room, sizeof(room)) < 0){
+			perror("Failed reading the ring's eventfd");
+			exit(EXIT_FAILURE);
+		}
+	}
+	else if (pfds[1].revents & POLLIN){
+		readReply(s);
+	}
+	else if (pfds[1].revents & (POLLHUP|POLLERR)){
+		printf("ERROR: The server closed the connection\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/** Writes len bytes to the ring, waiting for room as needed
+ *
+ * @param r - the ring
+ * @param sockfd - the connection the ring was passed on
+ * @param s - the session whose replies are read while waiting, or NULL
+ * @param buf - the bytes
+ * @param len - number of bytes
+ * */
+void writeRing(PccRing *r, int sockfd, Session *s, const void *buf, size_t len){
+	const unsigned char *data = (const unsigned char*)buf;
+	while (len > 0){
+		unsigned char *space;
+		size_t n = ringWritable(r, &space);
+		if (n == 0){
+			waitRing(r, sockfd, s);
+			continue;
+		}
+		n = (len < n) ? len : n;
+		memcpy(space, data, n);
+		ringCommit(r, n);
+		data += n;
+		len -= n;
+	}
+}
+
+/** Reads len bytes of a file straight into the ring, without copying them
+ * through the client, waiting for room as needed
+ *
+ * @param r - the ring
+ * @param sockfd - the connection the ring was passed on
+ * @param s - the session whose replies are read while waiting, or NULL
+ * @param fd - the file
+ * @param offset - offset of the first byte, -1 to read from the current one
+ * @param len - number of bytes
+ * */
+void fillRing(PccRing *r, int sockfd, Session *s, int fd, off_t offset, unsigned long len){
+	while (len > 0){
+		unsigned char *space;
+		size_t n = ringWritable(r, &space);
+		if (n == 0){
+			waitRing(r, sockfd, s);
+			continue;
+		}
+		n = (len < n) ? len : n;
+		ssize_t got = (offset < 0) ? read(fd, space, n) : pread(fd, space, n, offset);
+		if (got < 0 && errno == EINTR){
+			continue;
+		}
+		if (got <= 0){
+			perror("Failed reading file");
+			exit(EXIT_FAILURE);
+		}
+		ringCommit(r, got);
+		if (offset >= 0){
+			offset += got;
+		}
+		len -= got;
+	}
+}
+
+/** Sends bytes of a request on the session's connection, or writes them to its ring
+ *
+ * @param s - the session
+ * @param buf - the bytes
+ * @param len - number of bytes
+ * */
+void sendBytes(Session *s, const void *buf, size_t len){
+	if (s->ringSize > 0){
+		writeRing(&s->ring, s->sockfd, s, buf, len);
+	}
+	else if (writeArr(s->sockfd, len, (unsigned char*)buf) < 0){
+		perror("Failed sending data to server");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/** Sends the payload of a request in chunks, printing the replies that arrive
+ * in between. With cancelAfter the payload is chunked and cancelled after
+ * that many bytes
+ *
+ * @param s - the session
+ * @param len - payload length
+ * */
+void sendPayload(Session *s, unsigned long len){
+	int chunked = s->cancelAfter > 0;
+	unsigned long limit = (chunked && s->cancelAfter < len) ? s->cancelAfter : len;
+	unsigned long sent = 0;
+	while (sent < limit){
+		unsigned long n = (limit - sent < CHUNK_SIZE) ? limit - sent : CHUNK_SIZE;
+		if (chunked){
+			uint32_t chunkLen = htonl(n);
+			sendBytes(s, &chunkLen, sizeof(chunkLen));
+		}
+		if (s->ringSize > 0){ //the replies are read whenever the ring is full
+			fillRing(&s->ring, s->sockfd, s, s->randfd, -1, n);
+		}
+		else {
+			sendRandom(s->sockfd, s->randfd, n);
+			drainReplies(s);
+		}
+		sent += n;
+	}
+	if (chunked){
+		uint32_t end = htonl(limit < len ? PCC_CHUNK_CANCEL : 0);
+		sendBytes(s, &end, sizeof(end));
+	}
+}
+
+/** Says hello and checks the server speaks the framed protocol, exits if not
+ *
+ * @param sockfd - socket file descriptor
+ * */
+void sayHello(int sockfd){
+	uint32_t hello;
+	if (writeInt(sockfd, htonl(PCC_HELLO(PCC_VERSION))) < 0 || readInt(sockfd, &hello) < 0){
+		perror("Failed sending data to server");
+		exit(EXIT_FAILURE);
+	}
+	hello = ntohl(hello);
+	if (hello == PCC_BUSY){
+		printf("ERROR: The server is busy\n");
+		exit(EXIT_FAILURE);
+	}
+	if ((hello & PCC_MAGIC_MASK) != PCC_MAGIC){
+		printf("ERROR: The server does not support the framed protocol\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/** Packs the options and flags of the session's count requests
+ *
+ * @param s - the session
+ * @param opts - filled with the options, PCC_MAX_OPT_LEN bytes at most
+ * @param flags - set to the PCC_FLAG_* of the requests
+ *
+ * @return the length of the options
+ * */
+size_t countOptions(Session *s, unsigned char *opts, uint8_t *flags){
+	size_t optLen = 0;
+	*flags = 0;
+	if (s->progressMiB > 0){
+		uint32_t mib = htonl(s->progressMiB);
+		optLen += packOption(opts+optLen, PCC_OPT_PROGRESS, &mib, sizeof(mib));
+	}
+	if (s->key != NULL){
+		optLen += packOption(opts+optLen, PCC_OPT_KEY, s->key, strlen(s->key));
+	}
+	memcpy(opts+optLen, s->classOpts, s->classOptLen);
+	optLen += s->classOptLen;
+	if (s->histogram){
+		*flags |= PCC_FLAG_HISTOGRAM;
+	}
+	if (s->bytes){
+		*flags |= PCC_FLAG_BYTES;
+	}
+	if (s->compact){
+		*flags |= PCC_FLAG_COMPACT;
+	}
+	if (s->cancelAfter > 0){
+		*flags |= PCC_FLAG_CHUNKED;
+	}
+	return optLen;
+}
+
+/** Sends the specified number of requests over one connection with the framed
+ * protocol, keeping up to depth requests in flight without waiting for their replies
+ *
+ * @param s - the session
+ * @param len - payload length of each request
+ * @param numRequests - number of requests to send
+ * @param depth - maximum number of requests waiting for a reply
+ * */
+void runPipelined(Session *s, unsigned long len, int numRequests, int depth){
+	sayHello(s->sockfd);
+	if (s->ringSize > 0){
+		shareRing(s->sockfd, &s->ring, s->ringSize);
+	}
+	s->randfd = open ("/dev/urandom",O_RDONLY);
+	if (s->randfd == -1){
+		perror("Failed opening file");
+		exit(EXIT_FAILURE);
+	}
+
+	//the options and flags are the same for every request
+	unsigned char opts[PCC_MAX_OPT_LEN];
+	uint8_t flags;
+	size_t optLen = countOptions(s, opts, &flags);
+
+	for (int i=0; i<numRequests; i++){
+		while (s->inFlight == depth){ //wait for the oldest reply
+			readReply(s);
+		}
+
+		unsigned char hdr[PCC_REQ_HDR_SIZE];
+		PccReqHdr req = { .id = i+1, .type = PCC_REQ_COUNT, .flags = flags, .optLen = optLen, .len = len };
+		packReqHdr(&req, hdr);
+		sendBytes(s, hdr, sizeof(hdr));
+		sendBytes(s, opts, optLen);
+		s->inFlight++;
+		sendPayload(s, len);
+	}
+	close(s->randfd);
+
+	while (s->inFlight > 0){
+		readReply(s);
+	}
+	if (numRequests > 0 && !s->json){
+		printf("total # of printable characters: %lu\n", s->total);
+	}
+
+	//read back the histogram of a key, after the counts above were added to it
+	if (s->query != NULL){
+		unsigned char hdr[PCC_REQ_HDR_SIZE];
+		optLen = packOption(opts, PCC_OPT_KEY, s->query, strlen(s->query));
+		s->queryId = numRequests+1;
+		PccReqHdr req = { .id = s->queryId, .type = PCC_REQ_QUERY, .flags = s->compact ? PCC_FLAG_COMPACT : 0, .optLen = optLen, .len = 0 };
+		packReqHdr(&req, hdr);
+		sendBytes(s, hdr, sizeof(hdr));
+		sendBytes(s, opts, optLen);
+		s->inFlight++;
+		readReply(s);
+	}
+	if (s->ringSize > 0){
+		freeRing(&s->ring);
+	}
+}
+
+/**One part of a file upload, counted by one request over its own connection*/
+typedef struct upload_part_t {
+	pthread_t thread;
+	Session *s; //the session the options of the request come from
+	char *host;
+	char *port;
+	int fd; //the file
+	uint32_t id; //the id of the request, the part's number
+	off_t offset; //offset of the part in the file
+	unsigned long len; //length of the part
+	PccRepHdr rep; //the final reply
+	unsigned char body[MAX_REPLY_BODY]; //its body
+	Result result; //the decoded reply, if it succeeded
+} UploadPart;
+
+/** Sends len bytes of the file from its offset through a mapping of the file,
+ * for the files sendfile does not support
+ *
+ * @param sockfd - socket file descriptor
+ * @param fd - the file
+ * @param offset - offset of the first byte to send
+ * @param len - number of bytes to send
+ * */
+void sendMapped(int sockfd, int fd, off_t offset, unsigned long len){
+	off_t start = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+	size_t mapLen = len + (offset - start);
+	unsigned char *map = (unsigned char*)mmap(NULL, mapLen, PROT_READ, MAP_SHARED, fd, start);
+	if (map == MAP_FAILED){
+		perror("Failed mapping file");
+		exit(EXIT_FAILURE);
+	}
+	madvise(map, mapLen, MADV_SEQUENTIAL);
+	unsigned char *data = map + (offset - start);
+	while (len > 0){
+		int n = (len < SENDFILE_MAX) ? len : SENDFILE_MAX;
+		if (writeArr(sockfd, n, data) < 0){
+			perror("Failed sending data to server");
+			exit(EXIT_FAILURE);
+		}
+		data += n;
+		len -= n;
+	}
+	munmap(map, mapLen);
+}
+
+/** Sends len bytes of the file from its offset with sendfile, so the
+ * payload goes from the page cache to the socket without being copied
+ * through the client. Falls back to a mapping of the file if the file
+ * does not support sendfile
+ *
+ * @param sockfd - socket file descriptor
+ * @param fd - the file
+ * @param offset - offset of the first byte to send
+ * @param len - number of bytes to send
+ * */
+void sendFile(int sockfd, int fd, off_t offset, unsigned long len){
+	while (len > 0){
+		ssize_t n = sendfile(sockfd, fd, &offset, (len < SENDFILE_MAX) ? len : SENDFILE_MAX);
+		if (n < 0 && errno == EINTR){
+			continue;
+		}
+		if (n < 0 && (errno == EINVAL || errno == ENOSYS)){
+			sendMapped(sockfd, fd, offset, len);
+			return;
+		}
+		if (n < 0){
+			perror("Failed sending data to server");
+			exit(EXIT_FAILURE);
+		}
+		if (n == 0){
+			printf("ERROR: The file was truncated while being sent\n");
+			exit(EXIT_FAILURE);
+		}
+		len -= n;
+	}
+}
+
+/** Uploads one part of a file as a count request over its own connection
+ * and keeps the final reply
+ *
+ * @param arg - the part*/
+void* uploadPart(void *arg){
+	UploadPart *p = (UploadPart*)arg;
+	int sockfd = connectTo(p->host, p->port);
+	sayHello(sockfd);
+
+	unsigned char hdr[PCC_REQ_HDR_SIZE];
+	unsigned char opts[PCC_MAX_OPT_LEN];
+	uint8_t flags;
+	size_t optLen = countOptions(p->s, opts, &flags);
+	PccReqHdr req = { .id = p->id, .type = PCC_REQ_COUNT, .flags = flags, .optLen = optLen, .len = p->len };
+	packReqHdr(&req, hdr);
+	PccRing ring;
+	if (p->s->ringSize > 0){ //each part has its own ring, the session's replies are not read here
+		shareRing(sockfd, &ring, p->s->ringSize);
+		writeRing(&ring, sockfd, NULL, hdr, sizeof(hdr));
+		writeRing(&ring, sockfd, NULL, opts, optLen);
+		fillRing(&ring, sockfd, NULL, p->fd, p->offset, p->len);
+	}
+	else {
+		if (writeArr(sockfd, sizeof(hdr), hdr) < 0 || writeArr(sockfd, optLen, opts) < 0){
+			perror("Failed sending data to server");
+			exit(EXIT_FAILURE);
+		}
+		sendFile(sockfd, p->fd, p->offset, p->len);
+	}
+
+	do { //no progress is asked for, but skip it anyway
+		readFrame(sockfd, &p->rep, p->body);
+	} while (p->rep.type == PCC_REP_PROGRESS);
+	if (p->rep.status == PCC_STATUS_OK && decodeResult(p->s, &p->rep, p->body, &p->result) < 0){
+		printf("ERROR: Bad reply from server\n");
+		exit(EXIT_FAILURE);
+	}
+	if (p->s->ringSize > 0){
+		freeRing(&ring);
+	}
+	close(sockfd);
+	return NULL;
+}
+
+/** Counts the printable chars of a file. The file is split into up to
+ * numParts parts of at least MIN_PART_SIZE bytes, uploaded in parallel over
+ * a connection each, and the replies of the parts are added up
+ *
+ * @param s - the session, with the options of the requests
+ * @param host - the server, or the UNIX socket path of a local one
+ * @param port - its port, NULL for a UNIX socket
+ * @param path - the file
+ * @param numParts - maximum number of connections
+ *
+ * @return
+ * 0 - if every part was counted
+ * -1 - otherwise
+ * */
+int uploadFile(Session *s, char *host, char *port, const char *path, int numParts){
+	int fd = open(path, O_RDONLY);
+	if (fd == -1){
+		perror("Failed opening file");
+		exit(EXIT_FAILURE);
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)){
+		printf("ERROR: %s is not a regular file\n", path);
+		exit(EXIT_FAILURE);
+	}
+	unsigned long size = st.st_size;
+	unsigned long most = (size > MIN_PART_SIZE) ? size / MIN_PART_SIZE : 1;
+	if ((unsigned long)numParts > most){
+		numParts = most;
+	}
+	unsigned long partLen = (size / numParts + PART_ALIGN - 1) / PART_ALIGN * PART_ALIGN;
+	if (partLen == 0){
+		partLen = size;
+	}
+
+	UploadPart *parts = (UploadPart*)calloc(numParts, sizeof(UploadPart));
+	if (parts == NULL){
+		printf("ERROR: malloc has failed\n");
+		exit(EXIT_FAILURE);
+	}
+	uint64_t start = latNow();
+	int launched = 0;
+	for (unsigned long offset = 0; launched < numParts && (offset < size || launched == 0); offset += partLen){
+		UploadPart *p = &parts[launched];
+		p->s = s;
+		p->host = host;
+		p->port = port;
+		p->fd = fd;
+		p->id = launched+1;
+		p->offset = offset;
+		p->len = (size - offset < partLen) ? size - offset : partLen;
+		if (pthread_create(&p->thread, NULL, uploadPart, p)){
+			perror("ERROR in pthread_create()");
+			exit(EXIT_FAILURE);
+		}
+		launched++;
+	}
+
+	//add up the replies of the parts
+	Result sum;
+	memset(&sum, 0, sizeof(sum));
+	int failed = 0;
+	for (int i=0; i<launched; i++){
+		UploadPart *p = &parts[i];
+		pthread_join(p->thread, NULL);
+		if (launched > 1 || p->rep.status != PCC_STATUS_OK){
+			printReply(s, &p->rep, p->body, (p->rep.status == PCC_STATUS_OK) ? &p->result : NULL);
+		}
+		if (p->rep.status != PCC_STATUS_OK){
+			failed = 1;
+			continue;
+		}
+		Result *r = &p->result;
+		sum.count += r->count;
+		sum.numClasses = r->numClasses;
+		sum.histLen = r->histLen;
+		sum.first = r->first;
+		for (int j=0; j<r->numClasses; j++){
+			sum.classCnt[j] += r->classCnt[j];
+		}
+		for (int j=0; j<r->histLen; j++){
+			sum.hist[j] += r->hist[j];
+		}
+	}
+	double secs = (latNow() - start) / 1e9;
+	close(fd);
+	free(parts);
+	if (failed){
+		return -1;
+	}
+
+	PccRepHdr total = { .id = 0, .type = PCC_REP_RESULT, .status = PCC_STATUS_OK };
+	if (s->json){ //the sum of the parts has id 0
+		printJson(s, &total, &sum);
+		return 0;
+	}
+	printf("%s: %lu bytes over %d connection%s in %.3f s, %.1f MB/s\n", path, size, launched, (launched > 1) ? "s" : "", secs, (secs > 0) ? size / secs / 1e6 : 0);
+	printf("# of printable characters: %lu\n", sum.count);
+	for (int i=0; i<sum.numClasses; i++){
+		printf("  %s: %lu\n", s->classNames[i], sum.classCnt[i]);
+	}
+	if (sum.histLen > 0){
+		printHistogram((sum.first == 0) ? "bytes" : "histogram", sum.hist, sum.histLen, sum.first);
+	}
+	return 0;
+}
+
+/**Prints the usage message and exits*/
+void usage(char *prog){
+	printf("Usage: %s [-n requests] [-d depth] [-P MiB] [-H] [-x bytes] [-k key] [-q key] [-C classes] [-b] [-z] [-J] <host> <port> <len>\n", prog);
+	printf("       %s -f file [-p conns] [-k key] [-q key] [-C classes] [-b] [-z] [-J] <host> <port>\n", prog);
+	printf("       %s -u path [-m MiB] [options] [len], for a server on this host\n", prog);
+	printf("       %s [-t threads] [-c conns] [-T seconds] [-r rate] [-l] [-L] [-n requests] [-d depth] <host> <port> <size>\n", prog);
+	printf("  -n  send this many requests over one connection with the framed protocol\n");
+	printf("  -d  maximum number of requests waiting for a reply, all of them by default\n");
+	printf("  -P  ask for a progress reply every this many MiB of payload\n");
+	printf("  -H  ask for the histogram of the printable chars in the progress replies\n");
+	printf("  -x  cancel each request after sending this many bytes\n");
+	printf("  -k  add the counts to the histogram of this stream key\n");
+	printf("  -q  then read back the histogram of this key, alone without -n\n");
+	printf("  -C  also count these comma separated byte classes: printable, digit, alpha, space,\n");
+	printf("      control, utf8lead, utf8cont, high, or a range of byte values such as 0x80-0xff\n");
+	printf("  -b  also count each of the 256 byte values\n");
+	printf("  -z  ask for compact replies, which carry the whole histogram\n");
+	printf("  -J  print the replies as JSON, one object per line\n");
+	printf("  -f  count this file instead of random bytes, sent with sendfile\n");
+	printf("  -p  split the file across up to this many parallel connections, one per %d MiB at most\n", MIN_PART_SIZE >> 20);
+	printf("  -u  connect to the server's UNIX socket at this path instead of <host> <port>\n");
+	printf("  -m  write the requests to a shared memory ring of this many MiB, a power of two, with -u\n");
+	printf("load mode, selected by any of the options below:\n");
+	printf("  -t  number of threads\n");
+	printf("  -c  number of connections per thread\n");
+	printf("  -T  run for this many seconds, -n then limits the requests per connection\n");
+	printf("  -r  start this many requests per second (open loop), as many as -d allows by default\n");
+	printf("  -l  use the legacy protocol, with a new connection per request\n");
+	printf("  -L  print the latency histogram\n");
+	printf("  size is N, uniform:MIN-MAX or exp:MEAN bytes\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+	int numRequests = 0; //0 for the legacy single request protocol
+	int depth = 0;
+	Session session;
+	memset(&session, 0, sizeof(session));
+	LoadConfig load;
+	memset(&load, 0, sizeof(load));
+	load.threads = 1;
+	load.conns = 1;
+	int framed = 0;
+	int loadMode = 0;
+	char *path = NULL; //the file to count, NULL for random bytes
+	int numParts = 1;
+	char *local = NULL; //UNIX socket path of a local server, NULL for <host> <port>
+	int opt;
+	while ((opt = getopt(argc, argv, "n:d:P:Hx:k:q:C:bzJt:c:T:r:lLf:p:u:m:")) != -1){
+		framed = 1; //every option needs the framed protocol
+		switch (opt){
+		case 't':
+			load.threads = atoi(optarg);
+			loadMode = 1;
+			break;
+		case 'c':
+			load.conns = atoi(optarg);
+			loadMode = 1;
+			break;
+		case 'T':
+			load.duration = atof(optarg);
+			loadMode = 1;
+			break;
+		case 'r':
+			load.rate = atof(optarg);
+			loadMode = 1;
+			break;
+		case 'l':
+			load.legacy = 1;
+			loadMode = 1;
+			break;
+		case 'L':
+			load.printHist = 1;
+			loadMode = 1;
+			break;
+		case 'n':
+			numRequests = atoi(optarg);
+			break;
+		case 'd':
+			depth = atoi(optarg);
+			break;
+		case 'P':
+			session.progressMiB = strtoul(optarg, NULL, 10);
+			break;
+		case 'H':
+			session.histogram = 1;
+			break;
+		case 'x':
+			session.cancelAfter = strtoul(optarg, NULL, 10);
+			break;
+		case 'C':
+			if (parseClasses(&session, optarg) < 0){
+				usage(argv[0]);
+			}
+			break;
+		case 'b':
+			session.bytes = 1;
+			break;
+		case 'z':
+			session.compact = 1;
+			break;
+		case 'J':
+			session.json = 1;
+			break;
+		case 'f':
+			path = optarg;
+			break;
+		case 'p':
+			numParts = atoi(optarg);
+			break;
+		case 'u':
+			local = optarg;
+			break;
+		case 'm':
+			session.ringSize = strtoul(optarg, NULL, 10) << 20;
+			break;
+		case 'k':
+		case 'q':
+			if (strlen(optarg) == 0 || strlen(optarg) > PCC_MAX_KEY_LEN){
+				usage(argv[0]);
+			}
+			*(opt == 'k' ? &session.key : &session.query) = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	int addrArgs = (local != NULL) ? 0 : 2; //<host> <port>, unless connecting to local
+	if (path != NULL && (loadMode || numRequests > 0 || session.cancelAfter > 0 || session.progressMiB > 0 ||
+			numParts < 1 || numParts > MAX_PARTS || argc - optind < addrArgs)){
+		usage(argv[0]);
+	}
+	if (path == NULL && (argc - optind < addrArgs + 1 || numRequests < 0 || depth < 0)){
+		usage(argv[0]);
+	}
+	if (session.ringSize > 0 && (local == NULL || loadMode)){
+		usage(argv[0]);
+	}
+
+	//command line arguments, a NULL port stands for the UNIX socket path in host
+	char *host = (local != NULL) ? local : argv[optind];
+	char *port = (local != NULL) ? NULL : argv[optind+1];
+
+	if (path != NULL){
+		int rc = uploadFile(&session, host, port, path, numParts);
+		if (rc == 0 && session.query != NULL){ //read back the key the parts were added to
+			session.sockfd = connectTo(host, port);
+			runPipelined(&session, 0, 0, 0);
+			close(session.sockfd);
+		}
+		return (rc == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	char *lenArg = argv[optind+addrArgs];
+	unsigned long len = strtoul(lenArg, NULL, 10);
+
+	int sockfd = connectTo(host, port);
+
+	if (loadMode){
+		if (load.threads < 1 || load.conns < 1 || load.rate < 0 || load.duration < 0 ||
+				parseSizeDist(lenArg, &load) < 0){
+			usage(argv[0]);
+		}
+		//the load connects to the address that worked
+		load.addrLen = sizeof(load.addr);
+		if (getpeername(sockfd, (struct sockaddr*)&load.addr, &load.addrLen) < 0){
+			perror("ERROR in getpeername()");
+			exit(EXIT_FAILURE);
+		}
+		close(sockfd);
+		load.requests = numRequests;
+		if (load.requests == 0 && load.duration == 0){
+			load.requests = 1;
+		}
+		load.depth = (depth > 0) ? depth : 1;
+		return (runLoad(&load) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (framed){
+		if (numRequests == 0 && session.query == NULL){
+			numRequests = 1;
+		}
+		session.sockfd = sockfd;
+		runPipelined(&session, len, numRequests, (depth > 0) ? depth : numRequests);
+		close(sockfd);
+		return EXIT_SUCCESS;
+	}
+
+	//send the length to the server
+	if (writeInt(sockfd, htonl(len)) < 0){
+		perror("Failed sending data to server");
+		exit(EXIT_FAILURE);
+	}
+
+	//read from "/dev/urandom" and send the data to server
+	int fd = open ("/dev/urandom",O_RDONLY);
+	if (fd == -1){
+		perror("Failed opening file");
+		exit(EXIT_FAILURE);
+	}
+	sendRandom(sockfd, fd, len);
 	close(fd);
 
 
@@ -181,6 +1275,10 @@ int main(int argc, char *argv[]) {
 		exit(EXIT_FAILURE);
 	}
 	num = ntohl(num);
+	if (num == PCC_BUSY){
+		printf("ERROR: The server is busy\n");
+		exit(EXIT_FAILURE);
+	}
 	printf("# of printable characters: %u\n", num);
 
 	close(sockfd);
@@ -0,0 +1,72 @@
+/*
+ * pcc_count.c
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ *
+ * The global pcc_count, sharded per worker.
+ * A worker folds a finished request into its own cache line aligned shard,
+ * so requests never contend with each other. Readers sum the shards when the
+ * statistics are needed.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcc_count.h"
+
+static PccShard *shards = NULL; //shards array
+static int num_shards = 0; //total number of shards
+
+int initPccCount(int num){
+	if (posix_memalign((void**)&shards, CACHE_LINE, num*sizeof(PccShard)) != 0){
+		return -1;
+	}
+	memset(shards, 0, num*sizeof(PccShard));
+	num_shards = num;
+	return 0;
+}
+
+PccShard *getPccShard(int i){
+	return &shards[i];
+}
+
+void updateGlobalCounter(PccShard *shard, const unsigned long *cntArr){
+	unsigned long seq = shard->seq;
+	__atomic_store_n(&shard->seq, seq+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE); //the odd sequence is visible before any counter
+	for (int i=0; i<NUM_PCC; i++){
+		__atomic_store_n(&shard->cnt[i], shard->cnt[i]+cntArr[i], __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&shard->seq, seq+2, __ATOMIC_RELEASE);
+}
+
+/** Copies a consistent view of the shard to cntArr*/
+static void readShard(PccShard *shard, unsigned long *cntArr){
+	unsigned long before, after;
+	do {
+		before = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+		for (int i=0; i<NUM_PCC; i++){
+			cntArr[i] = __atomic_load_n(&shard->cnt[i], __ATOMIC_RELAXED);
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE); //the counters are read before the sequence
+		after = __atomic_load_n(&shard->seq, __ATOMIC_RELAXED);
+	} while ((before & 1) || before != after); //retry if the owner was in the middle of an update
+}
+
+void snapshotPccCount(unsigned long *cntArr){
+	unsigned long shardArr[NUM_PCC];
+	memset(cntArr, 0, NUM_PCC*sizeof(unsigned long));
+	for (int s=0; s<num_shards; s++){
+		readShard(&shards[s], shardArr);
+		for (int i=0; i<NUM_PCC; i++){
+			cntArr[i] += shardArr[i];
+		}
+	}
+}
+
+void freePccCount(void){
+	free(shards);
+	shards = NULL;
+	num_shards = 0;
+}
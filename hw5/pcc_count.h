@@ -0,0 +1,43 @@
+/*
+ * pcc_count.h
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ */
+
+#ifndef PCC_COUNT_H_
+#define PCC_COUNT_H_
+
+#include "pcc_hist.h"
+
+#define CACHE_LINE 64
+
+/**One shard of the global printable character counter.
+ * Each shard is written by a single thread only and is read with a
+ * sequence lock, so neither side ever takes a lock*/
+typedef struct pcc_shard_t {
+	unsigned long seq; //odd while the owner is updating the shard
+	unsigned long cnt[NUM_PCC];
+} __attribute__((aligned(CACHE_LINE))) PccShard;
+
+/**Allocates the specified number of zeroed shards
+ *
+ * @return
+ * 0 - on success
+ * -1 - on error*/
+int initPccCount(int num);
+
+/**Returns the shard with the specified index*/
+PccShard *getPccShard(int i);
+
+/**Adds cntArr to the shard. Must only be called by the shard's owner*/
+void updateGlobalCounter(PccShard *shard, const unsigned long *cntArr);
+
+/**Fills cntArr with the total of all shards, without stopping the writers.
+ * Every update is either fully included or not included at all*/
+void snapshotPccCount(unsigned long *cntArr);
+
+/**Frees the shards*/
+void freePccCount(void);
+
+#endif /* PCC_COUNT_H_ */
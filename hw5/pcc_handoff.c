@@ -0,0 +1,254 @@
+/*
+ * pcc_handoff.c
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ *
+ * Zero downtime restart of pcc_server.
+ * A running server listens on a UNIX socket. A new server started with the
+ * same path connects to it and gets the listening sockets as SCM_RIGHTS, so
+ * the port is never closed: connections keep queueing on the same sockets
+ * while the old server drains and the new one starts accepting them.
+ * The connection between the two stays open until the old server exits,
+ * which tells the new one its last snapshot of pcc_count is on disk.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "pcc_handoff.h"
+
+static int predecessor_fd = -1; //connection to the server the sockets were taken from
+static int successor_fd = -1; //connection to the server the sockets were handed to
+static int unixfd = -1; //the UNIX socket successors connect to
+static char sock_path[sizeof(((struct sockaddr_un*)0)->sun_path)]; //its path
+static int stop_fd = -1; //readable once the handoff thread should stop
+static const int *listen_fds = NULL; //the sockets to hand over
+static int num_listen_fds = 0;
+static int stats_fd = -1;
+static void (*handoff_done)(void) = NULL; //called once the sockets have been handed over
+static pthread_t handoff_thread;
+static int started = 0; //has the handoff thread been started
+
+/** Fills the address of the UNIX socket path
+ *
+ * @return
+ * 0 - on success
+ * -1 - the path is too long
+ * */
+static int unixAddr(const char *path, struct sockaddr_un *addr){
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)){
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+/** Closes the descriptors received with a message that is not used*/
+static void closeReceived(struct msghdr *mh){
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(mh); cm != NULL; cm = CMSG_NXTHDR(mh, cm)){
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS){
+			continue;
+		}
+		int num = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (int i=0; i<num; i++){
+			int fd;
+			memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+			close(fd);
+		}
+	}
+}
+
+int takeListeners(const char *path, int *fds, int *statsfd){
+	struct sockaddr_un addr;
+	*statsfd = -1;
+	if (unixAddr(path, &addr) < 0){
+		return -1;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd < 0){
+		return -1;
+	}
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0){
+		int err = errno;
+		close(fd);
+		errno = err;
+		return (err == ENOENT || err == ECONNREFUSED) ? 0 : -1; //nobody to take over from
+	}
+
+	HandoffMsg msg;
+	char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+	memset(control, 0, sizeof(control));
+	struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+	ssize_t n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC|MSG_WAITALL);
+	if (n < 0){
+		mh.msg_controllen = 0; //nothing was received
+	}
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+	if (n != sizeof(msg) || (mh.msg_flags & MSG_CTRUNC) || msg.magic != HANDOFF_MAGIC || msg.numListeners + 1 > HANDOFF_MAX_FDS ||
+			cm == NULL || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS ||
+			cm->cmsg_len != CMSG_LEN((msg.numListeners + (msg.hasStats != 0)) * sizeof(int))){
+		closeReceived(&mh);
+		close(fd);
+		errno = EPROTO;
+		return -1;
+	}
+	memcpy(fds, CMSG_DATA(cm), msg.numListeners * sizeof(int));
+	if (msg.hasStats){
+		memcpy(statsfd, CMSG_DATA(cm) + msg.numListeners * sizeof(int), sizeof(int));
+	}
+	predecessor_fd = fd;
+	return msg.numListeners;
+}
+
+void waitPredecessor(void){
+	if (predecessor_fd < 0){
+		return;
+	}
+	char done;
+	while (read(predecessor_fd, &done, sizeof(done)) < 0 && errno == EINTR){
+		//the predecessor writes a byte, or just closes the connection, when it exits
+	}
+	close(predecessor_fd);
+	predecessor_fd = -1;
+}
+
+/** Sends the listening sockets over the connection
+ *
+ * @return
+ * 0 - on success
+ * -1 - on error
+ * */
+static int sendListeners(int fd){
+	int all[HANDOFF_MAX_FDS];
+	int num = num_listen_fds;
+	memcpy(all, listen_fds, num * sizeof(int));
+	if (stats_fd >= 0){
+		all[num++] = stats_fd;
+	}
+	HandoffMsg msg = { .magic = HANDOFF_MAGIC, .numListeners = num_listen_fds, .hasStats = (stats_fd >= 0) };
+	char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))];
+	memset(control, 0, sizeof(control));
+	struct iovec iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = CMSG_SPACE(num * sizeof(int)) };
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(num * sizeof(int));
+	memcpy(CMSG_DATA(cm), all, num * sizeof(int));
+	return (sendmsg(fd, &mh, MSG_NOSIGNAL) == sizeof(msg)) ? 0 : -1;
+}
+
+/** Waits for a successor, hands it the listening sockets and calls handoff_done.
+ * Serves a single successor, or none if stop_fd becomes readable first*/
+static void* handoffThread(void *arg){
+	struct pollfd pfds[2] = {
+		{ .fd = unixfd, .events = POLLIN },
+		{ .fd = stop_fd, .events = POLLIN },
+	};
+	while (1){
+		pfds[0].revents = pfds[1].revents = 0;
+		if (poll(pfds, 2, -1) < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			perror("ERROR in poll()");
+			return NULL;
+		}
+		if (pfds[1].revents & POLLIN){
+			return NULL;
+		}
+		if (!(pfds[0].revents & POLLIN)){
+			continue;
+		}
+		int fd = accept4(unixfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0){ //the successor went away meanwhile
+			continue;
+		}
+		if (sendListeners(fd) < 0){
+			perror("ERROR: Failed handing over the listening sockets");
+			close(fd);
+			continue;
+		}
+		successor_fd = fd;
+		close(unixfd); //a later server takes over from the successor
+		unixfd = -1;
+		handoff_done();
+		return NULL;
+	}
+}
+
+int startHandoff(const char *path, const int *fds, int num, int statsfd, int stopfd, void (*onHandoff)(void)){
+	struct sockaddr_un addr;
+	if (unixAddr(path, &addr) < 0){
+		return -1;
+	}
+	if (num + 1 > HANDOFF_MAX_FDS){
+		errno = EMFILE;
+		return -1;
+	}
+	//non blocking, so a successor that goes away between poll and accept cannot block the thread
+	unixfd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+	if (unixfd < 0){
+		return -1;
+	}
+	//the path of the predecessor, or a stale one of a server that crashed
+	unlink(path);
+	if (bind(unixfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(unixfd, 1) < 0){
+		int err = errno;
+		close(unixfd);
+		unixfd = -1;
+		errno = err;
+		return -1;
+	}
+	strcpy(sock_path, path);
+	listen_fds = fds;
+	num_listen_fds = num;
+	stats_fd = statsfd;
+	stop_fd = stopfd;
+	handoff_done = onHandoff;
+	int rc = pthread_create(&handoff_thread, NULL, handoffThread, NULL);
+	if (rc){
+		close(unixfd);
+		unixfd = -1;
+		unlink(path);
+		errno = rc;
+		return -1;
+	}
+	started = 1;
+	return 0;
+}
+
+void closeHandoff(void){
+	if (started){
+		pthread_join(handoff_thread, NULL);
+		started = 0;
+	}
+	if (unixfd >= 0){ //nobody took over, the path is still ours
+		close(unixfd);
+		unixfd = -1;
+		unlink(sock_path);
+	}
+	if (successor_fd >= 0){
+		char done = 1;
+		if (write(successor_fd, &done, sizeof(done)) < 0){
+			//the successor also learns from the connection closing
+		}
+		close(successor_fd);
+		successor_fd = -1;
+	}
+}
@@ -0,0 +1,63 @@
+/*
+ * pcc_handoff.h
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ */
+
+#ifndef PCC_HANDOFF_H_
+#define PCC_HANDOFF_H_
+
+#include <stdint.h>
+
+#define HANDOFF_MAGIC 0x48434350 //"PCCH"
+#define HANDOFF_MAX_FDS 64 //listening sockets handed over at once, the stats socket included
+
+/**The message carrying the listening sockets from a server to its successor.
+ * The sockets themselves travel as SCM_RIGHTS: the numListeners sockets of
+ * the workers, then the stats socket if hasStats*/
+typedef struct handoff_msg_t {
+	uint32_t magic; //HANDOFF_MAGIC
+	uint32_t numListeners; //number of listening sockets of the workers
+	uint32_t hasStats; //is the stats socket handed over too
+} HandoffMsg;
+
+/**Asks the server running on the UNIX socket path, if any, for its listening sockets.
+ * The predecessor stops accepting once it has sent them and drains its connections
+ *
+ * @param path - the UNIX socket path
+ * @param fds - filled with the listening sockets of the workers
+ * @param statsfd - set to the stats socket, or -1 if none was handed over
+ *
+ * @return
+ * the number of listening sockets in fds, 0 if no server runs on path
+ * -1 - on error, errno is set
+ * */
+int takeListeners(const char *path, int *fds, int *statsfd);
+
+/**Waits until the predecessor the listening sockets were taken from has exited,
+ * and with it written its last snapshot. Returns at once without a predecessor*/
+void waitPredecessor(void);
+
+/**Starts the thread handing the listening sockets over to the next server
+ * that connects to the UNIX socket path, and then calling onHandoff.
+ * It stops once stopfd becomes readable
+ *
+ * @param path - the UNIX socket path, replaced if it exists
+ * @param fds - the listening sockets of the workers
+ * @param num - number of sockets in fds
+ * @param statsfd - the stats socket, -1 for none
+ * @param stopfd - readable once the thread should stop
+ * @param onHandoff - called once the sockets have been handed over
+ *
+ * @return
+ * 0 - on success
+ * -1 - on error, errno is set
+ * */
+int startHandoff(const char *path, const int *fds, int num, int statsfd, int stopfd, void (*onHandoff)(void));
+
+/**Waits for the handoff thread and tells the successor, if any, that this
+ * server is done. Removes the UNIX socket path if nobody took over*/
+void closeHandoff(void);
+
+#endif /* PCC_HANDOFF_H_ */
@@ -0,0 +1,400 @@
+/*
+ * pcc_hist.c
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ *
+ * Printable character counting kernels.
+ * All kernels but the naive one count every byte into several interleaved
+ * 32 bit sub-histograms, so consecutive equal bytes do not stall on the same
+ * counter, and fold the printable range into the caller's array at the end.
+ * The vector kernels compute the printable mask of each 64 bytes block with a
+ * vector range check, skip blocks without printable chars and only visit the
+ * printable bytes of sparse blocks. That only pays off on sparse data: on
+ * dense data every block is counted whole anyway, after its mask, so the
+ * default auto kernel samples each span and runs the scalar kernel on dense
+ * spans and the widest vector kernel on sparse ones.
+ *
+ * Other byte classes are counted from a full byte histogram, which is made
+ * in one pass with the same sub-histograms, and folded into any number of
+ * classes through a table mapping each byte value to its classes. The full
+ * histogram has no vector kernel: every byte is counted, so there is no mask
+ * to skip blocks by, and x86 has no scatter-add of bytes into counters. Its
+ * emulation with AVX-512 conflict detection loses to the sub-histograms.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "pcc_hist.h"
+#include "pcc_proto.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PCC_X86
+#include <immintrin.h>
+#endif
+
+#define NUM_SUB_HISTS 4 //number of interleaved sub-histograms
+#define BLOCK_SIZE 64 //number of bytes covered by one printable mask
+#define SPARSE_BLOCK 8 //blocks with at most this many printable chars are counted char by char
+#define FLUSH_SIZE (1UL << 30) //bytes counted before folding, keeps the 32 bit counters from overflowing
+#define AUTO_SPAN (1024*1024) //bytes of each choice of the auto kernel
+#define AUTO_SAMPLE 256 //bytes of each span sampled by the auto kernel
+
+typedef uint32_t SubHists[NUM_SUB_HISTS][NUM_BYTES];
+_Static_assert(FLUSH_SIZE <= UINT32_MAX, "a sub-histogram counter must hold every byte counted before folding");
+
+/** Returns whether the specified char is printable*/
+int isPrintableChar(unsigned char c){
+	return c>=MIN_PCC && c<=MAX_PCC;
+}
+
+/** The original byte by byte kernel, kept as the reference implementation*/
+static void countNaive(const unsigned char *buffer, size_t len, unsigned long *cntArr){
+	for (size_t i=0; i<len; i++){
+		if (isPrintableChar(buffer[i])){ //printable character
+			cntArr[buffer[i]-MIN_PCC]++;
+		}
+	}
+}
+
+/** Counts every byte of the buffer into the sub-histograms, without branches*/
+static inline __attribute__((always_inline)) void countBytes(SubHists h, const unsigned char *p, size_t len){
+	size_t i = 0;
+	for (; i+8<=len; i+=8){
+		uint64_t w;
+		memcpy(&w, p+i, sizeof(w));
+		h[0][w & 0xff]++;
+		h[1][(w >> 8) & 0xff]++;
+		h[2][(w >> 16) & 0xff]++;
+		h[3][(w >> 24) & 0xff]++;
+		h[0][(w >> 32) & 0xff]++;
+		h[1][(w >> 40) & 0xff]++;
+		h[2][(w >> 48) & 0xff]++;
+		h[3][w >> 56]++;
+	}
+	for (; i<len; i++){
+		h[0][p[i]]++;
+	}
+}
+
+/** Counts a block according to its printable mask*/
+static inline __attribute__((always_inline)) void countBlock(SubHists h, const unsigned char *p, uint64_t mask){
+	if (mask == 0){ //no printable chars
+		return;
+	}
+	if (__builtin_popcountll(mask) <= SPARSE_BLOCK){
+		while (mask){
+			h[0][p[__builtin_ctzll(mask)]]++;
+			mask &= mask-1;
+		}
+		return;
+	}
+	countBytes(h, p, BLOCK_SIZE);
+}
+
+/** Adds the printable range of the sub-histograms to cntArr*/
+static void foldSubHists(SubHists h, unsigned long *cntArr){
+	for (int c=MIN_PCC; c<=MAX_PCC; c++){
+		unsigned long sum = 0;
+		for (int j=0; j<NUM_SUB_HISTS; j++){
+			sum += h[j][c];
+		}
+		cntArr[c-MIN_PCC] += sum;
+	}
+}
+
+/** Adds every byte value of the sub-histograms to bins*/
+static void foldAllSubHists(SubHists h, unsigned long *bins){
+	for (int c=0; c<NUM_BYTES; c++){
+		unsigned long sum = 0; //the counters only fit 32 bits one by one
+		for (int j=0; j<NUM_SUB_HISTS; j++){
+			sum += h[j][c];
+		}
+		bins[c] += sum;
+	}
+}
+
+/** Interleaved sub-histograms without a range check*/
+static void countScalar(const unsigned char *buffer, size_t len, unsigned long *cntArr){
+	SubHists h;
+	while (len > 0){
+		size_t n = (len < FLUSH_SIZE) ? len : FLUSH_SIZE;
+		memset(h, 0, sizeof(h));
+		countBytes(h, buffer, n);
+		foldSubHists(h, cntArr);
+		buffer += n;
+		len -= n;
+	}
+}
+
+#ifdef PCC_X86
+
+/** Defines a vector kernel from a function returning the printable mask of a block.
+ * The loop is expanded inside each target so the mask function gets inlined*/
+#define DEFINE_VECTOR_KERNEL(name, isa, maskFn) \
+	__attribute__((target(isa))) \
+	static void name(const unsigned char *buffer, size_t len, unsigned long *cntArr){ \
+		SubHists h; \
+		while (len > 0){ \
+			size_t n = (len < FLUSH_SIZE) ? len : FLUSH_SIZE; \
+			size_t i = 0; \
+			memset(h, 0, sizeof(h)); \
+			for (; i+BLOCK_SIZE<=n; i+=BLOCK_SIZE){ \
+				countBlock(h, buffer+i, maskFn(buffer+i)); \
+			} \
+			countBytes(h, buffer+i, n-i); \
+			foldSubHists(h, cntArr); \
+			buffer += n; \
+			len -= n; \
+		} \
+	}
+
+/* Range check for 32..126 with signed compares only:
+ * c+96 wraps 32..126 onto -128..-34, which is exactly what is below -33 */
+#define RANGE_BIAS (128-MIN_PCC)
+#define RANGE_LIMIT (-128+NUM_PCC)
+
+__attribute__((target("sse2")))
+static inline uint64_t printableMaskSse2(const unsigned char *p){
+	const __m128i bias = _mm_set1_epi8(RANGE_BIAS);
+	const __m128i limit = _mm_set1_epi8(RANGE_LIMIT);
+	uint64_t mask = 0;
+	for (int k=0; k<BLOCK_SIZE/16; k++){
+		__m128i x = _mm_loadu_si128((const __m128i*)(p+16*k));
+		__m128i in = _mm_cmplt_epi8(_mm_add_epi8(x, bias), limit);
+		mask |= (uint64_t)(uint32_t)_mm_movemask_epi8(in) << (16*k);
+	}
+	return mask;
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t printableMaskAvx2(const unsigned char *p){
+	const __m256i bias = _mm256_set1_epi8(RANGE_BIAS);
+	const __m256i limit = _mm256_set1_epi8(RANGE_LIMIT);
+	__m256i lo = _mm256_loadu_si256((const __m256i*)p);
+	__m256i hi = _mm256_loadu_si256((const __m256i*)(p+32));
+	__m256i inLo = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(lo, bias));
+	__m256i inHi = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(hi, bias));
+	return (uint64_t)(uint32_t)_mm256_movemask_epi8(inLo) |
+			(uint64_t)(uint32_t)_mm256_movemask_epi8(inHi) << 32;
+}
+
+__attribute__((target("avx512bw")))
+static inline uint64_t printableMaskAvx512(const unsigned char *p){
+	__m512i x = _mm512_loadu_si512((const void*)p);
+	return _mm512_cmplt_epu8_mask(_mm512_sub_epi8(x, _mm512_set1_epi8(MIN_PCC)), _mm512_set1_epi8(NUM_PCC));
+}
+
+DEFINE_VECTOR_KERNEL(countSse2, "sse2", printableMaskSse2)
+DEFINE_VECTOR_KERNEL(countAvx2, "avx2,popcnt,bmi", printableMaskAvx2)
+DEFINE_VECTOR_KERNEL(countAvx512, "avx512bw,popcnt,bmi", printableMaskAvx512)
+
+static int hasSse2(void){
+	return __builtin_cpu_supports("sse2");
+}
+
+static int hasAvx2(void){
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt") && __builtin_cpu_supports("bmi");
+}
+
+static int hasAvx512(void){
+	return __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt") && __builtin_cpu_supports("bmi");
+}
+
+#endif /* PCC_X86 */
+
+static int always(void){
+	return 1;
+}
+
+static void countAuto(const unsigned char *buffer, size_t len, unsigned long *cntArr);
+
+const PccKernel pcc_kernels[] = {
+	{ "naive", countNaive, always },
+	{ "scalar", countScalar, always },
+#ifdef PCC_X86
+	{ "sse2", countSse2, hasSse2 },
+	{ "avx2", countAvx2, hasAvx2 },
+	{ "avx512bw", countAvx512, hasAvx512 },
+#endif
+	{ "auto", countAuto, always }, //must stay last
+};
+const int num_pcc_kernels = sizeof(pcc_kernels)/sizeof(pcc_kernels[0]);
+
+static const PccKernel *selected = NULL; //the kernel used by pccCount
+static const PccKernel *widest = NULL; //the sparse kernel of countAuto
+
+/** Returns the last kernel of the table the CPU supports, auto aside*/
+static const PccKernel *widestKernel(void){
+	const PccKernel *k = __atomic_load_n(&widest, __ATOMIC_ACQUIRE);
+	if (k == NULL){
+		k = &pcc_kernels[0];
+		for (int i=0; i<num_pcc_kernels-1; i++){
+			if (pcc_kernels[i].supported()){
+				k = &pcc_kernels[i];
+			}
+		}
+		__atomic_store_n(&widest, k, __ATOMIC_RELEASE);
+	}
+	return k;
+}
+
+/** Counts each span with the scalar kernel, or with the widest vector kernel
+ * when a sample of the span is as sparse as the blocks it counts char by char*/
+static void countAuto(const unsigned char *buffer, size_t len, unsigned long *cntArr){
+	pcc_count_fn sparse = widestKernel()->count;
+	while (len > 0){
+		size_t n = (len < AUTO_SPAN) ? len : AUTO_SPAN;
+		size_t stride = (n > AUTO_SAMPLE) ? n / AUTO_SAMPLE : 1;
+		size_t sampled = 0, printable = 0;
+		for (size_t i=0; i<n; i+=stride, sampled++){
+			printable += isPrintableChar(buffer[i]);
+		}
+		if (printable * BLOCK_SIZE <= sampled * SPARSE_BLOCK){
+			sparse(buffer, n, cntArr);
+		}
+		else {
+			countScalar(buffer, n, cntArr);
+		}
+		buffer += n;
+		len -= n;
+	}
+}
+
+/** Picks the kernel named by PCC_KERNEL, or auto*/
+static const PccKernel *selectKernel(void){
+	const PccKernel *best = &pcc_kernels[num_pcc_kernels-1];
+
+	char *name = getenv("PCC_KERNEL");
+	if (name != NULL){
+		for (int i=0; i<num_pcc_kernels; i++){
+			if (strcmp(pcc_kernels[i].name, name) == 0 && pcc_kernels[i].supported()){
+				return &pcc_kernels[i];
+			}
+		}
+		fprintf(stderr, "WARNING: kernel %s is not supported, using %s\n", name, best->name);
+	}
+	return best;
+}
+
+const PccKernel *getPccKernel(void){
+	const PccKernel *k = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+	if (k == NULL){
+		k = selectKernel();
+		__atomic_store_n(&selected, k, __ATOMIC_RELEASE);
+	}
+	return k;
+}
+
+void pccCount(const unsigned char *buffer, size_t len, unsigned long *cntArr){
+	getPccKernel()->count(buffer, len, cntArr);
+}
+
+void byteCount(const unsigned char *buffer, size_t len, unsigned long *bins){
+	SubHists h;
+	while (len > 0){
+		//every byte is counted, so unlike the printable kernels there are no blocks to skip
+		size_t n = (len < FLUSH_SIZE) ? len : FLUSH_SIZE;
+		memset(h, 0, sizeof(h));
+		countBytes(h, buffer, n);
+		foldAllSubHists(h, bins);
+		buffer += n;
+		len -= n;
+	}
+}
+
+void bytesToPcc(const unsigned long *bins, unsigned long *cntArr){
+	for (int c=MIN_PCC; c<=MAX_PCC; c++){
+		cntArr[c-MIN_PCC] += bins[c];
+	}
+}
+
+/**A range of byte values of a built-in class*/
+typedef struct class_range_t {
+	int id; //PCC_CLASS_*
+	unsigned char lo;
+	unsigned char hi;
+} ClassRange;
+
+static const ClassRange builtin_ranges[] = {
+	{ PCC_CLASS_PRINTABLE, MIN_PCC, MAX_PCC },
+	{ PCC_CLASS_DIGIT, '0', '9' },
+	{ PCC_CLASS_ALPHA, 'A', 'Z' },
+	{ PCC_CLASS_ALPHA, 'a', 'z' },
+	{ PCC_CLASS_SPACE, '\t', '\r' },
+	{ PCC_CLASS_SPACE, ' ', ' ' },
+	{ PCC_CLASS_CONTROL, 0, MIN_PCC-1 },
+	{ PCC_CLASS_CONTROL, MAX_PCC+1, MAX_PCC+1 },
+	{ PCC_CLASS_UTF8_LEAD, 0xC2, 0xF4 },
+	{ PCC_CLASS_UTF8_CONT, 0x80, 0xBF },
+	{ PCC_CLASS_HIGH, 0x80, 0xFF },
+};
+
+static uint32_t builtin_class_of[NUM_BYTES]; //bit id set when the byte value is in the built-in class id, read-only once compiled
+
+void initBuiltinClasses(void){
+	memset(builtin_class_of, 0, sizeof(builtin_class_of));
+	for (size_t r=0; r<sizeof(builtin_ranges)/sizeof(builtin_ranges[0]); r++){
+		for (int b=builtin_ranges[r].lo; b<=builtin_ranges[r].hi; b++){
+			builtin_class_of[b] |= 1U << builtin_ranges[r].id;
+		}
+	}
+}
+
+void initByteClasses(ByteClasses *t){
+	t->num = 0;
+	t->numSets = 0;
+}
+
+int addBuiltinClass(ByteClasses *t, int id){
+	if (t->num == MAX_BYTE_CLASSES || id < 0 || id >= PCC_NUM_CLASSES){
+		return -1;
+	}
+	t->builtin[t->num++] = id;
+	return 0;
+}
+
+int addByteSet(ByteClasses *t, const unsigned char *set){
+	if (t->num == MAX_BYTE_CLASSES){
+		return -1;
+	}
+	if (t->numSets == 0){ //the table is only cleared for the requests with byte sets
+		memset(t->classOf, 0, sizeof(t->classOf));
+	}
+	for (int b=0; b<NUM_BYTES; b++){
+		if ((set[b/8] >> (b%8)) & 1){
+			t->classOf[b] |= 1U << t->num;
+		}
+	}
+	t->builtin[t->num++] = -1;
+	t->numSets++;
+	return 0;
+}
+
+/** Adds bins[b] to cnt[k] for every bit k of classOf[b]*/
+static void foldClasses(const uint32_t *classOf, const unsigned long *bins, unsigned long *cnt){
+	for (int b=0; b<NUM_BYTES; b++){
+		uint32_t mask = (bins[b] > 0) ? classOf[b] : 0;
+		while (mask){
+			cnt[__builtin_ctz(mask)] += bins[b];
+			mask &= mask-1;
+		}
+	}
+}
+
+void countByteClasses(const ByteClasses *t, const unsigned long *bins, unsigned long *classCnt){
+	unsigned long builtinCnt[PCC_NUM_CLASSES] = {0};
+	unsigned long setCnt[MAX_BYTE_CLASSES] = {0};
+	if (t->numSets < t->num){
+		foldClasses(builtin_class_of, bins, builtinCnt);
+	}
+	if (t->numSets > 0){
+		foldClasses(t->classOf, bins, setCnt);
+	}
+	for (int k=0; k<t->num; k++){
+		classCnt[k] = (t->builtin[k] >= 0) ? builtinCnt[t->builtin[k]] : setCnt[k];
+	}
+}
@@ -0,0 +1,92 @@
+/*
+ * pcc_hist.h
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ */
+
+#ifndef PCC_HIST_H_
+#define PCC_HIST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define NUM_PCC 95 //number of printable chars
+#define MIN_PCC 32 //minimum value of printable char
+#define MAX_PCC 126 //maximum value of printable char
+#define NUM_BYTES 256 //number of distinct byte values
+#define BYTE_SET_SIZE (NUM_BYTES/8) //bytes of a set of byte values, bit b%8 of byte b/8 for the value b
+#define MAX_BYTE_CLASSES 32 //number of classes one ByteClasses table holds
+
+/**A printable character counting kernel.
+ * Adds the number of times each printable character appears
+ * in the buffer to cntArr[c-MIN_PCC]*/
+typedef void (*pcc_count_fn)(const unsigned char *buffer, size_t len, unsigned long *cntArr);
+
+/**Describes one implementation of the counting kernel*/
+typedef struct pcc_kernel_t {
+	const char *name;
+	pcc_count_fn count;
+	int (*supported)(void); //does the running CPU support the kernel
+} PccKernel;
+
+extern const PccKernel pcc_kernels[]; //all kernels, slowest first, then auto
+extern const int num_pcc_kernels;
+
+/**Returns whether the specified char is printable*/
+int isPrintableChar(unsigned char c);
+
+/**Counts the printable characters in the buffer with the auto kernel, which
+ * counts dense data with the scalar kernel and sparse data with the widest
+ * vector kernel the CPU supports, or the one named by the PCC_KERNEL environment variable*/
+void pccCount(const unsigned char *buffer, size_t len, unsigned long *cntArr);
+
+/**Returns the kernel used by pccCount*/
+const PccKernel *getPccKernel(void);
+
+/**The byte classes of a request, counted in a single pass over a byte
+ * histogram. The built-in classes are only referred to by id: their table is
+ * compiled once by initBuiltinClasses and shared. Bit k of classOf[b] is set
+ * when the byte value b belongs to the byte set of the request that is class k.
+ * Classes may overlap*/
+typedef struct byte_classes_t {
+	int num; //number of classes
+	int numSets; //number of byte sets, classOf is only used when there are some
+	int8_t builtin[MAX_BYTE_CLASSES]; //the PCC_CLASS_* of class k, -1 for a byte set
+	uint32_t classOf[NUM_BYTES];
+} ByteClasses;
+
+/**Compiles the shared table of the built-in classes, once before any
+ * countByteClasses*/
+void initBuiltinClasses(void);
+
+/**Adds the number of times each byte value appears in the buffer to bins,
+ * which has NUM_BYTES entries. Scalar only: see pcc_hist.c*/
+void byteCount(const unsigned char *buffer, size_t len, unsigned long *bins);
+
+/**Adds the printable range of a byte histogram to cntArr*/
+void bytesToPcc(const unsigned long *bins, unsigned long *cntArr);
+
+/**Empties the table*/
+void initByteClasses(ByteClasses *t);
+
+/**Adds a built-in class, one of the PCC_CLASS_* of pcc_proto.h, to the table
+ *
+ * @return
+ * 0 - on success
+ * -1 - the class is unknown or the table is full
+ * */
+int addBuiltinClass(ByteClasses *t, int id);
+
+/**Adds a class holding the byte values of the BYTE_SET_SIZE bytes set to the table
+ *
+ * @return
+ * 0 - on success
+ * -1 - the table is full
+ * */
+int addByteSet(ByteClasses *t, const unsigned char *set);
+
+/**Sets classCnt[k] to the number of bytes of class k in a byte histogram*/
+void countByteClasses(const ByteClasses *t, const unsigned long *bins, unsigned long *classCnt);
+
+#endif /* PCC_HIST_H_ */
@@ -0,0 +1,278 @@
+/*
+ * pcc_keys.c
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ *
+ * Printable character histograms per stream key.
+ * A fixed pool of cache line aligned entries is chained into a power of 2
+ * bucket array. Writers lock one of NUM_STRIPES stripes, picked by the bucket,
+ * so producers of different keys rarely meet. Readers take no lock: every
+ * change of an entry is wrapped in a sequence lock, and entries are only ever
+ * reused, never freed, so a reader racing with an eviction just retries.
+ * When the pool is full a clock hand evicts a key that was not used since it
+ * last passed, an approximation of LRU, preferring expired keys.
+ * Counts are 32 bits per char to keep entries small, and saturate.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pcc_keys.h"
+#include "pcc_count.h"
+#include "pcc_latency.h"
+
+#define NUM_STRIPES 256 //number of writer locks
+#define KEY_WORDS (MAX_KEY_LEN / sizeof(uint64_t))
+
+/**A keyed histogram*/
+typedef struct key_entry_t {
+	uint32_t seq; //odd while a writer changes the entry
+	uint32_t next; //index of the next entry in the bucket, 0 at the end
+	uint32_t bucket; //the bucket holding the entry
+	uint8_t keyLen;
+	uint8_t live; //does the entry hold a key
+	uint8_t used; //was the key used since the clock hand last passed it
+	uint32_t lastUsed; //second of the last update, for the TTL
+	uint64_t key[KEY_WORDS]; //the key, zero padded
+	uint32_t cnt[NUM_PCC];
+} __attribute__((aligned(CACHE_LINE))) KeyEntry;
+
+static KeyEntry *entries = NULL; //the pool, entry 0 is unused so 0 ends a chain
+static uint32_t *buckets = NULL; //index of the first entry of each bucket
+static unsigned long num_buckets = 0; //a power of 2
+static unsigned long max_keys = 0; //number of entries in the pool
+static unsigned long next_free = 1; //pool entries from here on were never used
+static unsigned long hand = 1; //the clock hand
+static unsigned long num_live = 0; //number of keys in the map
+static unsigned int ttl = 0; //seconds before an idle key expires, 0 for never
+static pthread_mutex_t stripes[NUM_STRIPES];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER; //taken to add or evict a key
+
+/** Returns the current time in seconds*/
+static uint32_t nowSecs(void){
+	return (uint32_t)(latNow() / 1000000000ULL);
+}
+
+/** Returns the FNV-1a hash of the key*/
+static uint64_t hashKey(const unsigned char *key, size_t len){
+	uint64_t h = 0xCBF29CE484222325ULL;
+	for (size_t i=0; i<len; i++){
+		h = (h ^ key[i]) * 0x100000001B3ULL;
+	}
+	return h ^ (h >> 32);
+}
+
+/** Returns whether the key of the entry has been idle for too long*/
+static int isExpired(uint32_t lastUsed, uint32_t now){
+	return ttl > 0 && now - lastUsed > ttl;
+}
+
+/** Starts a change of the entry, readers retry until endWrite*/
+static void beginWrite(KeyEntry *e){
+	__atomic_store_n(&e->seq, e->seq+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE); //the odd sequence is visible before any change
+}
+
+static void endWrite(KeyEntry *e){
+	__atomic_store_n(&e->seq, e->seq+1, __ATOMIC_RELEASE);
+}
+
+int initKeys(unsigned long maxKeys, unsigned int ttlSecs){
+	if (maxKeys > UINT32_MAX){ //the entries are linked by 32 bits indices
+		return -1;
+	}
+	max_keys = maxKeys;
+	ttl = ttlSecs;
+	num_buckets = 1;
+	while (num_buckets < maxKeys){
+		num_buckets <<= 1;
+	}
+	//untouched entries are never paged in, so a large pool costs nothing until used
+	if (posix_memalign((void**)&entries, CACHE_LINE, (maxKeys+1)*sizeof(KeyEntry)) != 0){
+		return -1;
+	}
+	memset(entries, 0, (maxKeys+1)*sizeof(KeyEntry));
+	buckets = (uint32_t*)calloc(num_buckets, sizeof(uint32_t));
+	if (buckets == NULL){
+		free(entries);
+		entries = NULL;
+		return -1;
+	}
+	for (int i=0; i<NUM_STRIPES; i++){
+		pthread_mutex_init(&stripes[i], NULL);
+	}
+	return 0;
+}
+
+/** Returns the entry of the key in the bucket, or NULL.
+ * The caller holds the bucket's stripe*/
+static KeyEntry *findLocked(unsigned long b, const uint64_t *key, size_t keyLen){
+	for (uint32_t idx = buckets[b]; idx != 0; idx = entries[idx].next){
+		KeyEntry *e = &entries[idx];
+		if (e->keyLen == keyLen && memcmp(e->key, key, MAX_KEY_LEN) == 0){
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/** Removes the entry from its bucket. The caller holds the bucket's stripe*/
+static void unlinkEntry(KeyEntry *e){
+	uint32_t idx = e - entries;
+	uint32_t *link = &buckets[e->bucket];
+	while (*link != idx){
+		link = &entries[*link].next;
+	}
+	beginWrite(e);
+	__atomic_store_n(link, e->next, __ATOMIC_RELEASE);
+	e->live = 0;
+	endWrite(e);
+	__atomic_fetch_sub(&num_live, 1, __ATOMIC_RELAXED);
+}
+
+/** Adds a new key with empty counts to bucket b, in a never used entry,
+ * or in the first one the clock hand finds expired or not used recently.
+ * The caller holds the stripe of bucket b. The entries only change buckets
+ * under pool_lock, so the bucket of a candidate can be trusted
+ *
+ * @return the entry, or NULL if every candidate's stripe was busy*/
+static KeyEntry *insertKey(unsigned long b, const uint64_t *key, size_t keyLen, uint32_t now){
+	KeyEntry *e = NULL;
+	pthread_mutex_lock(&pool_lock);
+	if (next_free <= max_keys){
+		e = &entries[next_free++];
+	}
+	for (unsigned long i=0; e == NULL && i < 2*max_keys; i++){
+		KeyEntry *cand = &entries[hand];
+		hand = (hand < max_keys) ? hand+1 : 1;
+		if (__atomic_exchange_n(&cand->used, 0, __ATOMIC_RELAXED) &&
+				!isExpired(__atomic_load_n(&cand->lastUsed, __ATOMIC_RELAXED), now)){
+			continue; //second chance
+		}
+		//the candidate is evicted under its own stripe, without waiting for it
+		pthread_mutex_t *own = &stripes[b % NUM_STRIPES];
+		pthread_mutex_t *other = &stripes[cand->bucket % NUM_STRIPES];
+		if (other != own && pthread_mutex_trylock(other) != 0){
+			continue;
+		}
+		if (cand->live){
+			unlinkEntry(cand);
+		}
+		if (other != own){
+			pthread_mutex_unlock(other);
+		}
+		e = cand;
+	}
+
+	if (e != NULL){
+		beginWrite(e);
+		e->bucket = b;
+		e->keyLen = keyLen;
+		for (size_t i=0; i<KEY_WORDS; i++){
+			__atomic_store_n(&e->key[i], key[i], __ATOMIC_RELAXED);
+		}
+		for (int i=0; i<NUM_PCC; i++){
+			__atomic_store_n(&e->cnt[i], 0, __ATOMIC_RELAXED);
+		}
+		e->live = 1;
+		e->used = 1;
+		e->lastUsed = now;
+		e->next = buckets[b];
+		endWrite(e);
+		__atomic_store_n(&buckets[b], (uint32_t)(e - entries), __ATOMIC_RELEASE);
+		__atomic_fetch_add(&num_live, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return e;
+}
+
+void keyedAdd(const void *key, size_t keyLen, const unsigned long *cntArr){
+	if (entries == NULL || keyLen > MAX_KEY_LEN){
+		return;
+	}
+	uint64_t padded[KEY_WORDS] = {0};
+	memcpy(padded, key, keyLen);
+	unsigned long b = hashKey(key, keyLen) & (num_buckets-1);
+	uint32_t now = nowSecs();
+
+	pthread_mutex_lock(&stripes[b % NUM_STRIPES]);
+	KeyEntry *e = findLocked(b, padded, keyLen);
+	if (e == NULL){
+		e = insertKey(b, padded, keyLen, now);
+		if (e == NULL){ //the map is full of keys being written
+			pthread_mutex_unlock(&stripes[b % NUM_STRIPES]);
+			return;
+		}
+	}
+
+	beginWrite(e);
+	int expired = isExpired(e->lastUsed, now); //an expired key starts over
+	for (int i=0; i<NUM_PCC; i++){
+		uint32_t old = expired ? 0 : e->cnt[i];
+		uint32_t cnt = (cntArr[i] > UINT32_MAX - old) ? UINT32_MAX : old + cntArr[i];
+		__atomic_store_n(&e->cnt[i], cnt, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&e->lastUsed, now, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->used, 1, __ATOMIC_RELAXED);
+	endWrite(e);
+	pthread_mutex_unlock(&stripes[b % NUM_STRIPES]);
+}
+
+int keyedLookup(const void *key, size_t keyLen, unsigned long *cntArr){
+	if (entries == NULL || keyLen > MAX_KEY_LEN){
+		return 0;
+	}
+	uint64_t padded[KEY_WORDS] = {0};
+	memcpy(padded, key, keyLen);
+	unsigned long b = hashKey(key, keyLen) & (num_buckets-1);
+
+restart:
+	for (uint32_t idx = __atomic_load_n(&buckets[b], __ATOMIC_ACQUIRE); idx != 0; ){
+		KeyEntry *e = &entries[idx];
+		uint32_t before = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+		if (before & 1){ //a writer is changing the entry
+			goto restart;
+		}
+		int match = __atomic_load_n(&e->live, __ATOMIC_RELAXED) && __atomic_load_n(&e->keyLen, __ATOMIC_RELAXED) == keyLen;
+		for (size_t i=0; match && i<KEY_WORDS; i++){
+			match = __atomic_load_n(&e->key[i], __ATOMIC_RELAXED) == padded[i];
+		}
+		uint32_t bucket = __atomic_load_n(&e->bucket, __ATOMIC_RELAXED);
+		uint32_t lastUsed = 0;
+		if (match){
+			for (int i=0; i<NUM_PCC; i++){
+				cntArr[i] = __atomic_load_n(&e->cnt[i], __ATOMIC_RELAXED);
+			}
+			lastUsed = __atomic_load_n(&e->lastUsed, __ATOMIC_RELAXED);
+		}
+		uint32_t next = __atomic_load_n(&e->next, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE); //the entry is read before the sequence
+		if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != before){ //changed, maybe reused for another key
+			goto restart;
+		}
+		if (bucket != b){ //moved to another bucket since the previous entry linked to it
+			goto restart;
+		}
+		if (match){
+			return !isExpired(lastUsed, nowSecs());
+		}
+		idx = next;
+	}
+	return 0;
+}
+
+unsigned long keyedCount(void){
+	return __atomic_load_n(&num_live, __ATOMIC_RELAXED);
+}
+
+void freeKeys(void){
+	for (int i=0; entries != NULL && i<NUM_STRIPES; i++){
+		pthread_mutex_destroy(&stripes[i]);
+	}
+	free(entries);
+	free(buckets);
+	entries = NULL;
+	buckets = NULL;
+}
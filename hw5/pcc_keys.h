@@ -0,0 +1,46 @@
+/*
+ * pcc_keys.h
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ */
+
+#ifndef PCC_KEYS_H_
+#define PCC_KEYS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pcc_hist.h"
+#include "pcc_proto.h"
+
+#define MAX_KEY_LEN PCC_MAX_KEY_LEN //a multiple of 8
+
+/**Allocates room for maxKeys keyed histograms.
+ * A key idle for more than ttlSecs seconds expires, 0 to never expire.
+ * When the map is full the least recently used keys are evicted first
+ *
+ * @return
+ * 0 - on success
+ * -1 - on error, or maxKeys is 2^32 or more*/
+int initKeys(unsigned long maxKeys, unsigned int ttlSecs);
+
+/**Adds cntArr to the histogram of the key, creating it if needed.
+ * Any thread may call it; writers of keys in the same lock stripe serialize*/
+void keyedAdd(const void *key, size_t keyLen, const unsigned long *cntArr);
+
+/**Copies the histogram of the key to cntArr without taking any lock
+ *
+ * @return
+ * 1 - the key was found
+ * 0 - the key is unknown, expired or was evicted
+ * */
+int keyedLookup(const void *key, size_t keyLen, unsigned long *cntArr);
+
+/**Returns the number of keys in the map*/
+unsigned long keyedCount(void);
+
+/**Frees the keyed histograms*/
+void freeKeys(void);
+
+#endif /* PCC_KEYS_H_ */
@@ -0,0 +1,94 @@
+/*
+ * pcc_latency.c
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ */
+
+#include <string.h>
+#include <time.h>
+
+#include "pcc_latency.h"
+
+/** Returns the bucket of a value: values below LAT_SUB_BUCKETS have their own
+ * bucket, larger ones are split into LAT_SUB_BUCKETS buckets per power of 2*/
+static int bucketOf(uint64_t v){
+	if (v < LAT_SUB_BUCKETS){
+		return v;
+	}
+	int exp = 63 - __builtin_clzll(v);
+	int shift = exp - LAT_SUB_BITS;
+	return (shift + 1) * LAT_SUB_BUCKETS + (int)((v >> shift) - LAT_SUB_BUCKETS);
+}
+
+/** Returns the largest value of a bucket*/
+static uint64_t bucketMax(int b){
+	if (b < LAT_SUB_BUCKETS){
+		return b;
+	}
+	int shift = b / LAT_SUB_BUCKETS - 1;
+	uint64_t low = (uint64_t)(LAT_SUB_BUCKETS + b % LAT_SUB_BUCKETS) << shift;
+	return low + ((uint64_t)1 << shift) - 1;
+}
+
+uint64_t latNow(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void latRecord(LatHist *h, uint64_t ns){
+	//relaxed stores by the single writer let other threads merge the histogram at any time
+	int b = bucketOf(ns);
+	__atomic_store_n(&h->counts[b], h->counts[b]+1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->total, h->total+1, __ATOMIC_RELAXED);
+	if (ns > h->max){
+		__atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+	}
+}
+
+void latMerge(LatHist *dst, const LatHist *src){
+	for (int i=0; i<LAT_NUM_BUCKETS; i++){
+		dst->counts[i] += __atomic_load_n(&src->counts[i], __ATOMIC_RELAXED);
+	}
+	dst->total += __atomic_load_n(&src->total, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	if (max > dst->max){
+		dst->max = max;
+	}
+}
+
+uint64_t latPercentile(const LatHist *h, double fraction){
+	if (h->total == 0){
+		return 0;
+	}
+	unsigned long rank = (unsigned long)(fraction * h->total);
+	if (rank >= h->total){
+		rank = h->total - 1;
+	}
+	unsigned long seen = 0;
+	for (int i=0; i<LAT_NUM_BUCKETS; i++){
+		seen += h->counts[i];
+		if (seen > rank){
+			uint64_t v = bucketMax(i);
+			return (v < h->max) ? v : h->max;
+		}
+	}
+	return h->max;
+}
+
+void latPrint(const LatHist *h, FILE *out){
+	unsigned long perPow[65];
+	memset(perPow, 0, sizeof(perPow));
+	for (int i=0; i<LAT_NUM_BUCKETS; i++){
+		if (h->counts[i] > 0){
+			uint64_t us = bucketMax(i) / 1000;
+			perPow[us == 0 ? 0 : 64 - __builtin_clzll(us)] += h->counts[i];
+		}
+	}
+	for (int p=0; p<65; p++){
+		if (perPow[p] > 0){
+			fprintf(out, "  < %8lu us : %lu\n", 1UL << p, perPow[p]);
+		}
+	}
+}
@@ -0,0 +1,43 @@
+/*
+ * pcc_latency.h
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ */
+
+#ifndef PCC_LATENCY_H_
+#define PCC_LATENCY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define LAT_SUB_BITS 5 //32 linear sub-buckets per power of 2, about 3% precision
+#define LAT_SUB_BUCKETS (1 << LAT_SUB_BITS)
+#define LAT_NUM_BUCKETS ((64 - LAT_SUB_BITS + 1) * LAT_SUB_BUCKETS)
+
+/**A log-linear (HDR style) histogram of latencies in nanoseconds.
+ * Recording is a few instructions and needs no allocation.
+ * Only one thread may record, any thread may merge it concurrently*/
+typedef struct lat_hist_t {
+	unsigned long counts[LAT_NUM_BUCKETS];
+	unsigned long total; //number of recorded values
+	uint64_t max; //largest recorded value
+} LatHist;
+
+/**Returns the current monotonic time in nanoseconds*/
+uint64_t latNow(void);
+
+/**Records a latency*/
+void latRecord(LatHist *h, uint64_t ns);
+
+/**Adds the counts of src to dst. The counts of a histogram being recorded
+ * into may be a few values apart from each other, but never torn*/
+void latMerge(LatHist *dst, const LatHist *src);
+
+/**Returns the latency below which the specified fraction (0..1) of the values fall*/
+uint64_t latPercentile(const LatHist *h, double fraction);
+
+/**Prints the number of values per power of 2 of microseconds*/
+void latPrint(const LatHist *h, FILE *out);
+
+#endif /* PCC_LATENCY_H_ */
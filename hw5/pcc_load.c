@@ -0,0 +1,600 @@
+/*
+ * pcc_load.c
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ *
+ * Load generator for pcc_server.
+ * Every thread drives its connections from a poll loop with non-blocking
+ * sockets. Payloads are sent straight from a pool of random bytes generated
+ * once, so the generator is not limited by /dev/urandom.
+ * In a closed loop each connection keeps depth requests in flight. In an open
+ * loop requests are started on a fixed schedule, and their latency is measured
+ * from the time they were due, so a slow server is not hidden by requests the
+ * generator failed to start on time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "pcc_load.h"
+#include "pcc_proto.h"
+#include "pcc_latency.h"
+
+#define POOL_SIZE (16 << 20) //bytes of random payload shared by all threads
+#define REPLY_BUF_SIZE 256 //large enough for any reply to a request without progress
+#define IDLE_POLL_MS 100 //poll timeout when nothing is scheduled
+#define DRAIN_NS 5000000000ULL //time allowed for the requests in flight once the run is over
+#define RETRY_MS 10 //time before connecting again when the server shed the connection
+
+/**Represents a connection of the load generator*/
+typedef struct load_conn_t {
+	int fd; //-1 while not connected
+	int connecting; //a non-blocking connect is in progress
+	int dead; //the connection failed and is not used any more
+	uint64_t retryAt; //framed, not connected: time to connect again, after the server shed the connection
+	int sending; //a request is being sent
+	unsigned char hdr[PCC_REQ_HDR_SIZE]; //header of the request being sent
+	size_t hdrLen; //length of hdr
+	size_t hdrSent; //number of header bytes sent so far
+	unsigned long payloadLeft; //number of payload bytes left to send
+	size_t poolOff; //offset in the pool of the next payload byte
+	uint64_t start[LOAD_MAX_DEPTH]; //start time of each request in flight, oldest first
+	unsigned long lens[LOAD_MAX_DEPTH]; //payload length of each request in flight
+	int head; //index of the oldest request in flight
+	int inFlight; //number of requests in flight
+	unsigned char rbuf[REPLY_BUF_SIZE]; //received bytes of the next reply
+	size_t rRead; //number of bytes in rbuf
+	unsigned long started; //number of requests started
+	uint32_t nextId; //id of the next request
+} LoadConn;
+
+/**Represents a thread of the load generator*/
+typedef struct load_thread_t {
+	pthread_t thread;
+	LoadConfig *cfg;
+	LoadConn *conns; //the thread's connections
+	uint64_t rng; //state of the thread's random generator
+	uint64_t interval; //open loop: nanoseconds between request starts
+	uint64_t nextDue; //open loop: time the next request is due
+	LatHist lat; //latencies of the completed requests
+	unsigned long requests; //number of completed requests
+	unsigned long bytes; //payload bytes of the completed requests
+	unsigned long errors; //failed requests and connections
+	unsigned long busy; //requests and connections the server shed
+} LoadThread;
+
+static unsigned char *pool; //random payload bytes
+
+/** Returns the next value of a xorshift64* generator*/
+static uint64_t nextRand(uint64_t *state){
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+int parseSizeDist(const char *str, LoadConfig *cfg){
+	char *end;
+	if (strncmp(str, "uniform:", 8) == 0){
+		cfg->sizeDist = SIZE_UNIFORM;
+		cfg->sizeA = strtoul(str+8, &end, 10);
+		if (*end != '-'){
+			return -1;
+		}
+		cfg->sizeB = strtoul(end+1, &end, 10);
+		return (*end == '\0' && cfg->sizeA <= cfg->sizeB) ? 0 : -1;
+	}
+	if (strncmp(str, "exp:", 4) == 0){
+		cfg->sizeDist = SIZE_EXP;
+		cfg->sizeA = strtoul(str+4, &end, 10);
+		return (*end == '\0') ? 0 : -1;
+	}
+	cfg->sizeDist = SIZE_FIXED;
+	cfg->sizeA = strtoul(str, &end, 10);
+	return (*end == '\0') ? 0 : -1;
+}
+
+/** Draws the payload size of the next request*/
+static unsigned long nextSize(LoadThread *t){
+	LoadConfig *cfg = t->cfg;
+	unsigned long size;
+	switch (cfg->sizeDist){
+	case SIZE_UNIFORM:
+		return cfg->sizeA + nextRand(&t->rng) % (cfg->sizeB - cfg->sizeA + 1);
+	case SIZE_EXP:
+		size = (unsigned long)(-log((nextRand(&t->rng) >> 11) * 0x1.0p-53 + 0x1.0p-54) * cfg->sizeA);
+		//the legacy protocol only carries 32 bit lengths
+		return (cfg->legacy && size > 0xFFFFFFFFUL) ? 0xFFFFFFFFUL : size;
+	default:
+		return cfg->sizeA;
+	}
+}
+
+/** Creates a non-blocking socket and starts connecting it to the server
+ *
+ * @return
+ * 0 - on success
+ * -1 - on error*/
+static int startConnect(LoadConfig *cfg, LoadConn *c){
+	c->fd = socket(cfg->addr.ss_family, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (c->fd < 0){
+		return -1;
+	}
+	int one = 1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(c->fd, (struct sockaddr*)&cfg->addr, cfg->addrLen) < 0 && errno != EINPROGRESS){
+		close(c->fd);
+		c->fd = -1;
+		return -1;
+	}
+	c->connecting = 1;
+	return 0;
+}
+
+/** Opens a framed protocol connection: connects and exchanges the hello
+ * with blocking calls, then makes the socket non-blocking
+ *
+ * @return
+ * 0 - on success
+ * -1 - on error*/
+static int openFramed(LoadConfig *cfg, LoadConn *c){
+	c->fd = socket(cfg->addr.ss_family, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (c->fd < 0){
+		return -1;
+	}
+	int one = 1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	uint32_t hello = htonl(PCC_HELLO(PCC_VERSION));
+	if (connect(c->fd, (struct sockaddr*)&cfg->addr, cfg->addrLen) < 0 ||
+			send(c->fd, &hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello) ||
+			recv(c->fd, &hello, sizeof(hello), MSG_WAITALL) != sizeof(hello) ||
+			(ntohl(hello) & PCC_MAGIC_MASK) != PCC_MAGIC){
+		close(c->fd);
+		c->fd = -1;
+		return -1;
+	}
+	if (ntohl(hello) == PCC_BUSY){ //the server shed the connection
+		close(c->fd);
+		c->fd = -1;
+		errno = EBUSY;
+		return -1;
+	}
+	return fcntl(c->fd, F_SETFL, O_NONBLOCK);
+}
+
+/** Records the completion of the oldest request in flight*/
+static void completeRequest(LoadThread *t, LoadConn *c, int status){
+	if (status == PCC_STATUS_OK){
+		latRecord(&t->lat, latNow() - c->start[c->head]);
+		t->requests++;
+		t->bytes += c->lens[c->head];
+	}
+	else if (status == PCC_STATUS_BUSY){
+		t->busy++;
+	}
+	else {
+		t->errors++;
+	}
+	c->head = (c->head + 1) % LOAD_MAX_DEPTH;
+	c->inFlight--;
+}
+
+/** Connects a framed connection again once its retry time has come. A shed
+ * connection is counted as busy and retried later, any other error makes
+ * the connection dead*/
+static void reconnect(LoadThread *t, LoadConn *c, uint64_t now){
+	if (now < c->retryAt || openFramed(t->cfg, c) == 0){
+		return;
+	}
+	if (errno == EBUSY){
+		t->busy++;
+		c->retryAt = now + RETRY_MS * 1000000ULL;
+	}
+	else {
+		t->errors++;
+		c->dead = 1;
+	}
+}
+
+/** Closes the connection and drops its requests in flight as errors.
+ * A legacy connection carries a single request, so the next request just
+ * connects again. The server sheds a legacy connection by sending the busy
+ * word and closing it, which makes the sending fail: that request is busy
+ * if the word arrived before the close*/
+static void failConn(LoadThread *t, LoadConn *c){
+	if (t->cfg->legacy && c->inFlight > 0){
+		if (c->fd >= 0 && c->rRead < sizeof(uint32_t)){
+			ssize_t n = recv(c->fd, c->rbuf+c->rRead, sizeof(uint32_t)-c->rRead, MSG_DONTWAIT);
+			c->rRead += (n > 0) ? n : 0;
+		}
+		uint32_t word = 0;
+		memcpy(&word, c->rbuf, sizeof(word));
+		completeRequest(t, c, (c->rRead >= sizeof(word) && ntohl(word) == PCC_BUSY) ? PCC_STATUS_BUSY : -1);
+		if (c->fd >= 0){
+			close(c->fd);
+		}
+		c->fd = -1;
+		c->connecting = 0;
+		c->sending = 0;
+		c->rRead = 0;
+		return;
+	}
+	if (c->fd >= 0){
+		close(c->fd);
+	}
+	c->fd = -1;
+	c->dead = 1;
+	c->sending = 0;
+	t->errors += c->inFlight + 1;
+	c->inFlight = 0;
+}
+
+/** Starts sending a new request on the connection
+ *
+ * @param t - the thread
+ * @param c - the connection
+ * @param start - the time the request is considered started
+ * */
+static void startRequest(LoadThread *t, LoadConn *c, uint64_t start){
+	unsigned long len = nextSize(t);
+	if (t->cfg->legacy){
+		if (startConnect(t->cfg, c) < 0){
+			failConn(t, c);
+			return;
+		}
+		uint32_t word = htonl(len);
+		memcpy(c->hdr, &word, sizeof(word));
+		c->hdrLen = sizeof(word);
+	}
+	else {
+		PccReqHdr req = { .id = c->nextId++, .type = PCC_REQ_COUNT, .flags = 0, .optLen = 0, .len = len };
+		packReqHdr(&req, c->hdr);
+		c->hdrLen = PCC_REQ_HDR_SIZE;
+	}
+	c->hdrSent = 0;
+	c->payloadLeft = len;
+	c->poolOff = nextRand(&t->rng) % POOL_SIZE;
+	c->sending = 1;
+
+	int slot = (c->head + c->inFlight) % LOAD_MAX_DEPTH;
+	c->start[slot] = start;
+	c->lens[slot] = len;
+	c->inFlight++;
+	c->started++;
+}
+
+/** Sends as much of the current request as the socket accepts*/
+static void sendSome(LoadThread *t, LoadConn *c){
+	if (c->connecting){
+		int err = 0;
+		socklen_t errLen = sizeof(err);
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0 || err != 0){
+			failConn(t, c);
+			return;
+		}
+		c->connecting = 0;
+	}
+	while (c->sending){
+		ssize_t sent;
+		if (c->hdrSent < c->hdrLen){
+			sent = send(c->fd, c->hdr+c->hdrSent, c->hdrLen-c->hdrSent, MSG_NOSIGNAL);
+		}
+		else {
+			size_t n = POOL_SIZE - c->poolOff;
+			n = (c->payloadLeft < n) ? c->payloadLeft : n;
+			sent = send(c->fd, pool+c->poolOff, n, MSG_NOSIGNAL);
+		}
+		if (sent < 0){
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+				return;
+			}
+			failConn(t, c);
+			return;
+		}
+		if (c->hdrSent < c->hdrLen){
+			c->hdrSent += sent;
+		}
+		else {
+			c->payloadLeft -= sent;
+			c->poolOff = (c->poolOff + sent) % POOL_SIZE;
+		}
+		if (c->hdrSent == c->hdrLen && c->payloadLeft == 0){
+			c->sending = 0;
+		}
+	}
+}
+
+/** Reads the replies the socket has ready*/
+static void recvSome(LoadThread *t, LoadConn *c){
+	for (;;){
+		ssize_t n = recv(c->fd, c->rbuf+c->rRead, REPLY_BUF_SIZE-c->rRead, 0);
+		if (n < 0){
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+				return;
+			}
+			failConn(t, c);
+			return;
+		}
+		if (n == 0){ //the server closed the connection
+			failConn(t, c);
+			return;
+		}
+		c->rRead += n;
+
+		if (t->cfg->legacy){
+			if (c->rRead < sizeof(uint32_t)){
+				continue;
+			}
+			uint32_t word;
+			memcpy(&word, c->rbuf, sizeof(word));
+			completeRequest(t, c, (ntohl(word) == PCC_BUSY) ? PCC_STATUS_BUSY : PCC_STATUS_OK);
+			close(c->fd);
+			c->fd = -1;
+			c->rRead = 0;
+			return;
+		}
+
+		//consume every complete reply
+		size_t pos = 0;
+		while (c->rRead - pos >= PCC_REP_HDR_SIZE){
+			PccRepHdr rep;
+			unpackRepHdr(c->rbuf+pos, &rep);
+			if (rep.len > REPLY_BUF_SIZE - PCC_REP_HDR_SIZE){
+				failConn(t, c);
+				return;
+			}
+			if (c->rRead - pos < PCC_REP_HDR_SIZE + rep.len){
+				break;
+			}
+			if (rep.type == PCC_REP_RESULT && c->inFlight > 0){
+				completeRequest(t, c, rep.status);
+			}
+			pos += PCC_REP_HDR_SIZE + rep.len;
+		}
+		memmove(c->rbuf, c->rbuf+pos, c->rRead-pos);
+		c->rRead -= pos;
+	}
+}
+
+/** Returns whether the connection may start another request*/
+static int canStart(LoadConfig *cfg, LoadConn *c){
+	if (c->dead || c->sending || c->inFlight >= cfg->depth){
+		return 0;
+	}
+	if (cfg->legacy && c->fd >= 0){ //still waiting for the previous connection to end
+		return 0;
+	}
+	if (!cfg->legacy && c->fd < 0){ //shed, waiting to connect again
+		return 0;
+	}
+	return cfg->requests == 0 || c->started < cfg->requests;
+}
+
+/** Returns whether a framed connection the server shed is waiting to connect
+ * again, for requests it has left*/
+static int awaitsRetry(LoadConfig *cfg, LoadConn *c){
+	return !cfg->legacy && c->fd < 0 && !c->dead && (cfg->requests == 0 || c->started < cfg->requests);
+}
+
+/** Runs the connections of one thread until the end of the run*/
+static void* loadThread(void *arg){
+	LoadThread *t = (LoadThread*)arg;
+	LoadConfig *cfg = t->cfg;
+	struct pollfd *pfds = (struct pollfd*)calloc(cfg->conns, sizeof(struct pollfd));
+	if (pfds == NULL){
+		printf("ERROR: malloc has failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t begin = latNow();
+	uint64_t deadline = (cfg->duration > 0) ? begin + (uint64_t)(cfg->duration * 1e9) : UINT64_MAX;
+	t->nextDue = begin;
+	int next = 0; //open loop: the connection to try first, round robin
+
+	for (;;){
+		uint64_t now = latNow();
+		int stopping = now >= deadline;
+
+		//connect the shed connections again
+		for (int i=0; !stopping && i<cfg->conns; i++){
+			if (awaitsRetry(cfg, &t->conns[i])){
+				reconnect(t, &t->conns[i], now);
+			}
+		}
+
+		//start new requests
+		if (!stopping && cfg->rate > 0){
+			for (int k=0; k<cfg->conns && t->nextDue <= now; k++){
+				LoadConn *c = &t->conns[(next + k) % cfg->conns];
+				if (canStart(cfg, c)){
+					startRequest(t, c, t->nextDue); //latency counts from the time the request was due
+					t->nextDue += t->interval;
+					next = (next + k + 1) % cfg->conns;
+					k = -1;
+				}
+			}
+		}
+		else if (!stopping){
+			for (int i=0; i<cfg->conns; i++){
+				while (canStart(cfg, &t->conns[i])){
+					startRequest(t, &t->conns[i], now);
+				}
+			}
+		}
+
+		//wait for the sockets
+		int active = 0;
+		int more = 0;
+		int retrying = 0;
+		for (int i=0; i<cfg->conns; i++){
+			LoadConn *c = &t->conns[i];
+			pfds[i].fd = c->fd;
+			pfds[i].events = POLLIN | ((c->sending || c->connecting) ? POLLOUT : 0);
+			pfds[i].revents = 0;
+			if (c->inFlight > 0){
+				active = 1;
+			}
+			if (canStart(cfg, c) || (cfg->legacy && c->fd >= 0)){ //a legacy request ends with its connection
+				more = 1;
+			}
+			if (awaitsRetry(cfg, c)){
+				more = 1;
+				retrying = 1;
+			}
+			if (!cfg->legacy && c->fd >= 0 && cfg->requests > 0 && c->started >= cfg->requests &&
+					c->inFlight == 0 && !c->sending){ //done, make room for the shed connections
+				close(c->fd);
+				c->fd = -1;
+				pfds[i].fd = -1;
+			}
+		}
+		if (!active && (stopping || !more)){ //every request is done
+			break;
+		}
+		if (stopping && now >= deadline + DRAIN_NS){
+			for (int i=0; i<cfg->conns; i++){
+				t->errors += t->conns[i].inFlight;
+			}
+			break;
+		}
+
+		int timeout = IDLE_POLL_MS;
+		if (!stopping && cfg->rate > 0){
+			timeout = (t->nextDue > now) ? (int)((t->nextDue - now) / 1000000) : 0;
+		}
+		if (retrying && timeout > RETRY_MS){
+			timeout = RETRY_MS;
+		}
+		if (poll(pfds, cfg->conns, timeout) < 0 && errno != EINTR){
+			perror("ERROR in poll()");
+			exit(EXIT_FAILURE);
+		}
+
+		for (int i=0; i<cfg->conns; i++){
+			LoadConn *c = &t->conns[i];
+			if (c->fd < 0 || pfds[i].revents == 0){
+				continue;
+			}
+			if (pfds[i].revents & (POLLOUT|POLLERR)){
+				sendSome(t, c);
+			}
+			if (c->fd >= 0 && (pfds[i].revents & (POLLIN|POLLHUP|POLLERR))){
+				recvSome(t, c);
+			}
+		}
+	}
+
+	for (int i=0; i<cfg->conns; i++){
+		if (t->conns[i].fd >= 0){
+			close(t->conns[i].fd);
+		}
+	}
+	free(pfds);
+	return NULL;
+}
+
+int runLoad(LoadConfig *cfg){
+	if (cfg->depth < 1){
+		cfg->depth = 1;
+	}
+	if (cfg->depth > LOAD_MAX_DEPTH){
+		cfg->depth = LOAD_MAX_DEPTH;
+	}
+	if (cfg->legacy){
+		cfg->depth = 1; //one request per connection
+	}
+
+	//generate the payload pool once
+	pool = (unsigned char*)malloc(POOL_SIZE);
+	if (pool == NULL){
+		printf("ERROR: malloc has failed\n");
+		exit(EXIT_FAILURE);
+	}
+	uint64_t rng = (uint64_t)latNow() | 1;
+	for (size_t i=0; i<POOL_SIZE; i+=sizeof(uint64_t)){
+		uint64_t r = nextRand(&rng);
+		memcpy(pool+i, &r, sizeof(r));
+	}
+
+	LoadThread *threads = (LoadThread*)calloc(cfg->threads, sizeof(LoadThread));
+	if (threads == NULL){
+		printf("ERROR: malloc has failed\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i=0; i<cfg->threads; i++){
+		LoadThread *t = &threads[i];
+		t->cfg = cfg;
+		t->rng = nextRand(&rng) | 1;
+		t->interval = (cfg->rate > 0) ? (uint64_t)(1e9 * cfg->threads / cfg->rate) : 0;
+		t->conns = (LoadConn*)calloc(cfg->conns, sizeof(LoadConn));
+		if (t->conns == NULL){
+			printf("ERROR: malloc has failed\n");
+			exit(EXIT_FAILURE);
+		}
+		for (int j=0; j<cfg->conns; j++){
+			LoadConn *c = &t->conns[j];
+			c->fd = -1;
+			if (!cfg->legacy && openFramed(cfg, c) < 0){
+				if (errno != EBUSY){
+					perror("Could not connect");
+					exit(EXIT_FAILURE);
+				}
+				threads[i].busy++; //shed, the thread connects it again
+				c->retryAt = latNow() + RETRY_MS * 1000000ULL;
+			}
+		}
+	}
+
+	uint64_t begin = latNow();
+	for (int i=0; i<cfg->threads; i++){
+		int rc = pthread_create(&threads[i].thread, NULL, loadThread, &threads[i]);
+		if (rc){
+			printf("ERROR in pthread_create(): %s\n", strerror(rc));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	LatHist *lat = (LatHist*)calloc(1, sizeof(LatHist));
+	if (lat == NULL){
+		printf("ERROR: malloc has failed\n");
+		exit(EXIT_FAILURE);
+	}
+	unsigned long requests = 0, bytes = 0, errors = 0, busy = 0;
+	for (int i=0; i<cfg->threads; i++){
+		pthread_join(threads[i].thread, NULL);
+		latMerge(lat, &threads[i].lat);
+		requests += threads[i].requests;
+		bytes += threads[i].bytes;
+		errors += threads[i].errors;
+		busy += threads[i].busy;
+		free(threads[i].conns);
+	}
+	double elapsed = (latNow() - begin) / 1e9;
+
+	printf("%lu requests, %lu busy, %lu errors in %.3f s (%d threads x %d connections, %s)\n",
+			requests, busy, errors, elapsed, cfg->threads, cfg->conns,
+			cfg->rate > 0 ? "open loop" : "closed loop");
+	printf("throughput: %.1f requests/s, %.2f MB/s\n", requests / elapsed, bytes / elapsed / 1e6);
+	printf("latency (us): p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+			latPercentile(lat, 0.5) / 1e3, latPercentile(lat, 0.99) / 1e3,
+			latPercentile(lat, 0.999) / 1e3, lat->max / 1e3);
+	if (cfg->printHist){
+		latPrint(lat, stdout);
+	}
+
+	free(lat);
+	free(threads);
+	free(pool);
+	return (errors == 0) ? 0 : -1;
+}
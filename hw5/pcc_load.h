@@ -0,0 +1,50 @@
+/*
+ * pcc_load.h
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ */
+
+#ifndef PCC_LOAD_H_
+#define PCC_LOAD_H_
+
+#include <sys/socket.h>
+
+#define LOAD_MAX_DEPTH 64 //maximum number of requests in flight per connection
+
+//payload size distributions
+#define SIZE_FIXED 0 //always sizeA bytes
+#define SIZE_UNIFORM 1 //uniform between sizeA and sizeB bytes
+#define SIZE_EXP 2 //exponential with a mean of sizeA bytes
+
+/**Configuration of a load run*/
+typedef struct load_config_t {
+	struct sockaddr_storage addr; //server address
+	socklen_t addrLen;
+	int threads; //number of threads
+	int conns; //number of connections per thread
+	int depth; //requests in flight per connection
+	int legacy; //use the single-shot protocol, a new connection per request
+	double rate; //requests per second over all threads, 0 for a closed loop
+	double duration; //seconds to run, 0 to run until every connection sent its requests
+	unsigned long requests; //requests per connection, 0 for no limit
+	int sizeDist; //SIZE_*
+	unsigned long sizeA, sizeB; //parameters of the size distribution
+	int printHist; //print the latency histogram
+} LoadConfig;
+
+/**Parses a size distribution: N, uniform:MIN-MAX or exp:MEAN
+ *
+ * @return
+ * 0 - on success
+ * -1 - on a malformed distribution*/
+int parseSizeDist(const char *str, LoadConfig *cfg);
+
+/**Runs the load and prints throughput and latency percentiles
+ *
+ * @return
+ * 0 - if every request succeeded
+ * -1 - otherwise*/
+int runLoad(LoadConfig *cfg);
+
+#endif /* PCC_LOAD_H_ */
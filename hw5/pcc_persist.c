@@ -0,0 +1,237 @@
+/*
+ * pcc_persist.c
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ *
+ * Crash safe persistence of pcc_count.
+ * The counter file holds two page sized slots, and each snapshot overwrites the
+ * older one and is msynced before it counts, so a crash in the middle of a
+ * snapshot always leaves the previous one intact. Between snapshots an optional
+ * append-only log records the counts added every PERSIST_LOG_MS, and a torn
+ * record at its end is detected by its checksum and ignored.
+ * All of it is done by a background thread from snapshots of the shards,
+ * so the workers never wait for the disk.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pcc_persist.h"
+#include "pcc_count.h"
+#include "pcc_latency.h"
+
+#define SLOT_SIZE 4096 //each slot on its own page, so it is synced alone
+#define NUM_SLOTS 2
+#define LOG_SUFFIX ".log"
+
+static int filefd = -1; //the counter file
+static int logfd = -1; //the delta log, -1 without one
+static unsigned char *slots = MAP_FAILED; //the mmaped counter file
+static uint64_t seq = 0; //number of the newest snapshot
+static unsigned long logged[NUM_PCC]; //pcc_count as of the last snapshot or log record
+static int stop_fd = -1; //readable once the persistence thread should stop
+static unsigned int interval = 0; //seconds between snapshots
+static pthread_t persist_thread;
+static int started = 0; //has the persistence thread been started
+
+/** Returns the CRC32C of the buffer*/
+static uint32_t crc32c(const void *data, size_t len){
+	const unsigned char *p = (const unsigned char*)data;
+	uint32_t crc = 0xFFFFFFFF;
+	for (size_t i=0; i<len; i++){
+		crc ^= p[i];
+		for (int k=0; k<8; k++){
+			crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+/** Returns the checksum of a record*/
+static uint32_t recordCrc(const PersistRecord *r){
+	return crc32c(&r->seq, sizeof(PersistRecord) - offsetof(PersistRecord, seq));
+}
+
+/** Returns whether a record is complete and intact*/
+static int isValid(const PersistRecord *r){
+	return r->magic == PERSIST_MAGIC && r->crc == recordCrc(r);
+}
+
+/** Fills a record with the specified counts*/
+static void fillRecord(PersistRecord *r, uint64_t recSeq, const unsigned long *cntArr){
+	r->magic = PERSIST_MAGIC;
+	r->seq = recSeq;
+	for (int i=0; i<NUM_PCC; i++){
+		r->cnt[i] = cntArr[i];
+	}
+	r->crc = recordCrc(r);
+}
+
+/** Returns the slot of the specified snapshot*/
+static PersistRecord *slotOf(uint64_t snapshot){
+	return (PersistRecord*)(slots + (snapshot % NUM_SLOTS) * SLOT_SIZE);
+}
+
+/** Replays the log records that follow the current snapshot into cntArr.
+ * Stops at the first invalid record, the end of a torn write*/
+static void replayLog(unsigned long *cntArr){
+	PersistRecord r;
+	while (read(logfd, &r, sizeof(r)) == sizeof(r) && isValid(&r)){
+		if (r.seq != seq){ //left over from before the snapshot
+			continue;
+		}
+		for (int i=0; i<NUM_PCC; i++){
+			cntArr[i] += r.cnt[i];
+		}
+	}
+}
+
+/** Writes the counts as a new snapshot and waits until it is on disk.
+ * The log is emptied after it, its records are part of the snapshot*/
+static int writeSnapshot(const unsigned long *cntArr){
+	PersistRecord *slot = slotOf(seq+1);
+	fillRecord(slot, seq+1, cntArr);
+	if (msync(slot, SLOT_SIZE, MS_SYNC) < 0){
+		return -1;
+	}
+	seq++;
+	memcpy(logged, cntArr, sizeof(logged));
+	if (logfd >= 0 && ftruncate(logfd, 0) < 0){
+		return -1;
+	}
+	return 0;
+}
+
+/** Appends the counts added since the last record to the log and syncs it*/
+static int appendLog(const unsigned long *cntArr){
+	unsigned long delta[NUM_PCC];
+	int changed = 0;
+	for (int i=0; i<NUM_PCC; i++){
+		delta[i] = cntArr[i] - logged[i];
+		changed |= (delta[i] != 0);
+	}
+	if (!changed){
+		return 0;
+	}
+	PersistRecord r;
+	fillRecord(&r, seq, delta);
+	if (write(logfd, &r, sizeof(r)) != sizeof(r) || fdatasync(logfd) < 0){
+		return -1;
+	}
+	memcpy(logged, cntArr, sizeof(logged));
+	return 0;
+}
+
+int openPersist(const char *path, int useLog, unsigned long *cntArr){
+	memset(cntArr, 0, NUM_PCC*sizeof(unsigned long));
+	filefd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+	if (filefd < 0 || ftruncate(filefd, NUM_SLOTS*SLOT_SIZE) < 0){
+		return -1;
+	}
+	slots = (unsigned char*)mmap(NULL, NUM_SLOTS*SLOT_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, filefd, 0);
+	if (slots == MAP_FAILED){
+		return -1;
+	}
+
+	//resume from the newest intact snapshot, a new file has none
+	for (int s=0; s<NUM_SLOTS; s++){
+		PersistRecord *slot = (PersistRecord*)(slots + s*SLOT_SIZE);
+		if (isValid(slot) && slot->seq >= seq){
+			seq = slot->seq;
+			for (int i=0; i<NUM_PCC; i++){
+				cntArr[i] = slot->cnt[i];
+			}
+		}
+	}
+
+	if (useLog){
+		char *logPath = (char*)malloc(strlen(path) + sizeof(LOG_SUFFIX));
+		if (logPath == NULL){
+			errno = ENOMEM;
+			return -1;
+		}
+		strcpy(logPath, path);
+		strcat(logPath, LOG_SUFFIX);
+		logfd = open(logPath, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+		free(logPath);
+		if (logfd < 0){
+			return -1;
+		}
+		replayLog(cntArr);
+	}
+
+	//fold the log into a fresh snapshot, so a crash now loses nothing
+	return writeSnapshot(cntArr);
+}
+
+/** Snapshots pcc_count every interval seconds and logs it every
+ * PERSIST_LOG_MS, until stop_fd becomes readable*/
+static void* persistThread(void *arg){
+	struct pollfd pfd = { .fd = stop_fd, .events = POLLIN };
+	uint64_t period = (uint64_t)interval * 1000000000ULL;
+	uint64_t nextSnapshot = latNow() + period;
+	unsigned long cntArr[NUM_PCC];
+
+	//without a log there is nothing to do between snapshots
+	int timeout = (logfd >= 0 || interval * 1000 < PERSIST_LOG_MS) ? PERSIST_LOG_MS : (int)interval * 1000;
+	while (poll(&pfd, 1, timeout) <= 0){
+		uint64_t now = latNow();
+		snapshotPccCount(cntArr);
+		if (now >= nextSnapshot){
+			if (writeSnapshot(cntArr) < 0){
+				perror("ERROR: Failed writing a pcc_count snapshot");
+			}
+			nextSnapshot = now + period;
+		}
+		else if (logfd >= 0 && appendLog(cntArr) < 0){
+			perror("ERROR: Failed appending to the pcc_count log");
+		}
+	}
+	return NULL;
+}
+
+int startPersist(int stopfd, unsigned int snapshotSecs){
+	stop_fd = stopfd;
+	interval = snapshotSecs;
+	int rc = pthread_create(&persist_thread, NULL, persistThread, NULL);
+	if (rc){
+		errno = rc;
+		return -1;
+	}
+	started = 1;
+	return 0;
+}
+
+void closePersist(void){
+	if (started){
+		pthread_join(persist_thread, NULL);
+		started = 0;
+	}
+	if (slots != MAP_FAILED){
+		unsigned long cntArr[NUM_PCC];
+		snapshotPccCount(cntArr);
+		if (writeSnapshot(cntArr) < 0){
+			perror("ERROR: Failed writing a pcc_count snapshot");
+		}
+		munmap(slots, NUM_SLOTS*SLOT_SIZE);
+		slots = MAP_FAILED;
+	}
+	if (logfd >= 0){
+		close(logfd);
+		logfd = -1;
+	}
+	if (filefd >= 0){
+		close(filefd);
+		filefd = -1;
+	}
+}
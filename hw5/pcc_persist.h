@@ -0,0 +1,49 @@
+/*
+ * pcc_persist.h
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ */
+
+#ifndef PCC_PERSIST_H_
+#define PCC_PERSIST_H_
+
+#include <stdint.h>
+
+#include "pcc_hist.h"
+
+#define PERSIST_MAGIC 0x31434350 //"PCC1"
+#define PERSIST_LOG_MS 100 //time between two records of the delta log
+
+/**A checksummed copy of pcc_count.
+ * In the counter file it is a snapshot and seq is the snapshot's number.
+ * In the delta log it holds the counts added since the previous record,
+ * and seq is the number of the snapshot the log follows*/
+typedef struct persist_record_t {
+	uint32_t magic; //PERSIST_MAGIC
+	uint32_t crc; //CRC32C of seq and cnt
+	uint64_t seq;
+	uint64_t cnt[NUM_PCC];
+} PersistRecord;
+
+/**Opens or creates the counter file, and the delta log next to it if useLog is set.
+ * Fills cntArr with the newest valid snapshot plus the log records that follow it
+ *
+ * @return
+ * 0 - on success
+ * -1 - on error, errno is set*/
+int openPersist(const char *path, int useLog, unsigned long *cntArr);
+
+/**Starts the thread that snapshots pcc_count every snapshotSecs seconds and,
+ * with the delta log, appends the counts added every PERSIST_LOG_MS.
+ * It stops once stopfd becomes readable
+ *
+ * @return
+ * 0 - on success
+ * -1 - on error, errno is set*/
+int startPersist(int stopfd, unsigned int snapshotSecs);
+
+/**Waits for the persistence thread, takes a last snapshot and closes the files*/
+void closePersist(void);
+
+#endif /* PCC_PERSIST_H_ */
@@ -0,0 +1,403 @@
+/*
+ * pcc_pool.c
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ *
+ * Work stealing pool counting the chunks of large payloads.
+ * Every pool thread has its own deque of chunks. The event loop hands the
+ * chunks of a payload to the deques in turn, a thread takes its newest chunk
+ * first, and an idle thread steals the oldest chunk of another one, so a
+ * single huge upload keeps every thread busy. The event loop never waits for
+ * the pool: a job that has too many chunks waiting, or is waiting for its
+ * last ones, has the thread counting the chunk that makes it ready write the
+ * owner's eventfd, with the same flag and fence handshake as pcc_ring.c.
+ * Each chunk is counted into its own histogram and the histograms are only
+ * added up when the job is joined, so the threads never share a counter.
+ * Counted chunks are added to their job's histogram while the job is fed
+ * and kept on a spare list instead of being freed, so a job only holds the
+ * chunks still being counted and a steady stream of large uploads does not
+ * call malloc.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pcc_pool.h"
+
+#define PENDING_PER_THREAD 2 //chunks a job may have waiting per pool thread
+#define SPARE_PER_THREAD 4 //spare chunks kept per pool thread
+
+/**The chunks queued on one pool thread*/
+typedef struct pool_deque_t {
+	pthread_mutex_t lock;
+	unsigned long top; //index of the oldest chunk, where thieves take
+	unsigned long bottom; //index after the newest chunk, where the owner takes
+	PoolChunk *ring[POOL_QUEUE_SIZE];
+} PoolDeque;
+
+static PoolDeque *deques = NULL; //one per pool thread
+static pthread_t *thread_ids = NULL; //the pool threads
+static int num_threads = 0;
+static unsigned long next_deque = 0; //deque the next chunk is handed to
+static int queued = 0; //chunks in all the deques
+static int stopping = 0; //should the pool threads exit
+static pthread_mutex_t wait_lock = PTHREAD_MUTEX_INITIALIZER; //protects the sleeps below
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER; //a chunk was queued
+static pthread_mutex_t spare_lock = PTHREAD_MUTEX_INITIALIZER; //protects the spare chunks and their counters
+static PoolChunk *spare = NULL; //joined chunks kept for reuse
+static int num_spare = 0; //chunks in spare
+static unsigned long num_chunks = 0; //chunks allocated, spare or in use
+static unsigned long high_chunks = 0; //most chunks allocated at once
+
+/** Queues a chunk on a deque
+ *
+ * @return
+ * 0 - on success
+ * -1 - the deque is full
+ * */
+static int pushChunk(PoolDeque *d, PoolChunk *chunk){
+	pthread_mutex_lock(&d->lock);
+	if (d->bottom - d->top == POOL_QUEUE_SIZE){
+		pthread_mutex_unlock(&d->lock);
+		return -1;
+	}
+	d->ring[d->bottom++ % POOL_QUEUE_SIZE] = chunk;
+	pthread_mutex_unlock(&d->lock);
+	return 0;
+}
+
+/** Takes the newest chunk of a deque, as its owner, or the oldest, as a thief
+ *
+ * @return the chunk, or NULL if the deque is empty*/
+static PoolChunk *takeChunk(PoolDeque *d, int steal){
+	PoolChunk *chunk = NULL;
+	pthread_mutex_lock(&d->lock);
+	if (d->bottom != d->top){
+		chunk = steal ? d->ring[d->top++ % POOL_QUEUE_SIZE] : d->ring[--d->bottom % POOL_QUEUE_SIZE];
+	}
+	pthread_mutex_unlock(&d->lock);
+	if (chunk != NULL){
+		__atomic_fetch_sub(&queued, 1, __ATOMIC_RELAXED);
+	}
+	return chunk;
+}
+
+/** Takes a chunk from the deque of the specified thread, or steals one from
+ * the others, starting with the next one. Any thread but a pool thread passes -1
+ *
+ * @return the chunk, or NULL if every deque is empty*/
+static PoolChunk *findChunk(int self){
+	if (self >= 0){
+		PoolChunk *chunk = takeChunk(&deques[self], 0);
+		if (chunk != NULL){
+			return chunk;
+		}
+	}
+	for (int i=1; i<=num_threads; i++){
+		int victim = (self + i + num_threads) % num_threads;
+		if (victim != self && __atomic_load_n(&queued, __ATOMIC_RELAXED) > 0){
+			PoolChunk *chunk = takeChunk(&deques[victim], 1);
+			if (chunk != NULL){
+				return chunk;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void freeJob(PoolJob *j);
+
+/** Counts a chunk into its histogram, tells its owner if it waits for it,
+ * and frees the job if it was dropped and this was its last chunk*/
+static void countChunk(PoolChunk *chunk){
+	if (chunk->job->bytes){
+		byteCount(chunk->data, chunk->len, chunk->cnt);
+	}
+	else {
+		pccCount(chunk->data, chunk->len, chunk->cnt);
+	}
+	PoolJob *j = chunk->job; //the chunk may be recycled as soon as it is marked counted
+	__atomic_store_n(&chunk->counted, 1, __ATOMIC_RELEASE);
+	//waiting is read after pending is published, pairing with waitJob
+	int left = __atomic_sub_fetch(&j->pending, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&j->waiting, __ATOMIC_SEQ_CST) && left <= j->waitFor &&
+			__atomic_exchange_n(&j->waiting, 0, __ATOMIC_ACQ_REL)){
+		uint64_t one = 1;
+		if (write(j->notifyFd, &one, sizeof(one)) < 0){
+			//the counter is already set, the owner is woken anyway
+		}
+	}
+	if (__atomic_sub_fetch(&j->refs, 1, __ATOMIC_ACQ_REL) == 0){
+		freeJob(j);
+	}
+}
+
+/** Counts chunks until the pool is stopped*/
+static void* poolThread(void *arg){
+	int self = (int)(long)arg;
+	while (1){
+		PoolChunk *chunk = findChunk(self);
+		if (chunk != NULL){
+			countChunk(chunk);
+			continue;
+		}
+		pthread_mutex_lock(&wait_lock);
+		while (!stopping && __atomic_load_n(&queued, __ATOMIC_RELAXED) == 0){
+			pthread_cond_wait(&work_cond, &wait_lock);
+		}
+		int stop = stopping && __atomic_load_n(&queued, __ATOMIC_RELAXED) == 0;
+		pthread_mutex_unlock(&wait_lock);
+		if (stop){
+			return NULL;
+		}
+	}
+}
+
+int initPool(int threads){
+	deques = (PoolDeque*)calloc(threads, sizeof(PoolDeque));
+	thread_ids = (pthread_t*)calloc(threads, sizeof(pthread_t));
+	if (deques == NULL || thread_ids == NULL){
+		errno = ENOMEM;
+		return -1;
+	}
+	for (int i=0; i<threads; i++){
+		pthread_mutex_init(&deques[i].lock, NULL);
+	}
+	num_threads = threads;
+	for (int i=0; i<threads; i++){
+		int rc = pthread_create(&thread_ids[i], NULL, poolThread, (void*)(long)i);
+		if (rc){
+			errno = rc;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/** Takes a spare chunk, or allocates one if there is none
+ *
+ * @return the chunk*/
+static PoolChunk *getChunk(void){
+	pthread_mutex_lock(&spare_lock);
+	PoolChunk *chunk = spare;
+	if (chunk != NULL){
+		spare = chunk->next;
+		num_spare--;
+	}
+	else if (++num_chunks > high_chunks){
+		high_chunks = num_chunks;
+	}
+	pthread_mutex_unlock(&spare_lock);
+	if (chunk == NULL){
+		chunk = (PoolChunk*)malloc(sizeof(PoolChunk));
+		if (chunk == NULL){
+			printf("ERROR: malloc has failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return chunk;
+}
+
+/** Keeps a joined chunk for reuse, or frees it if enough are kept already*/
+static void putChunk(PoolChunk *chunk){
+	pthread_mutex_lock(&spare_lock);
+	if (num_spare < SPARE_PER_THREAD * num_threads){
+		chunk->next = spare;
+		spare = chunk;
+		num_spare++;
+		chunk = NULL;
+	}
+	else {
+		num_chunks--;
+	}
+	pthread_mutex_unlock(&spare_lock);
+	free(chunk);
+}
+
+PoolJob *newJob(int notifyFd){
+	PoolJob *j = (PoolJob*)calloc(1, sizeof(PoolJob));
+	if (j == NULL){
+		printf("ERROR: malloc has failed\n");
+		exit(EXIT_FAILURE);
+	}
+	j->refs = 1;
+	j->notifyFd = notifyFd;
+	return j;
+}
+
+void startJob(PoolJob *j, int bytes){
+	if (j->filling != NULL){ //asked for by jobBuffer, nothing was received into it
+		putChunk(j->filling);
+	}
+	j->bytes = bytes;
+	j->chunks = NULL;
+	j->filling = NULL;
+	j->pending = 0;
+	memset(j->cnt, 0, sizeof(j->cnt));
+}
+
+/** Adds the histograms of the job's counted chunks to the job's own and recycles the chunks*/
+static void reapChunks(PoolJob *j){
+	int num = j->bytes ? NUM_BYTES : NUM_PCC;
+	PoolChunk **link = &j->chunks;
+	while (*link != NULL){
+		PoolChunk *chunk = *link;
+		if (!__atomic_load_n(&chunk->counted, __ATOMIC_ACQUIRE)){
+			link = &chunk->next;
+			continue;
+		}
+		for (int i=0; i<num; i++){
+			j->cnt[i] += chunk->cnt[i];
+		}
+		*link = chunk->next;
+		putChunk(chunk);
+	}
+}
+
+/** Recycles every chunk of a job nobody refers to any more, and frees it*/
+static void freeJob(PoolJob *j){
+	while (j->chunks != NULL){
+		PoolChunk *chunk = j->chunks;
+		j->chunks = chunk->next;
+		putChunk(chunk);
+	}
+	if (j->filling != NULL){
+		putChunk(j->filling);
+	}
+	free(j);
+}
+
+/** Hands the chunk being filled to the pool, or counts it if the deques are full*/
+static void submitChunk(PoolJob *j){
+	PoolChunk *chunk = j->filling;
+	j->filling = NULL;
+	chunk->next = j->chunks;
+	j->chunks = chunk;
+	__atomic_fetch_add(&j->refs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&j->pending, 1, __ATOMIC_RELAXED);
+
+	unsigned long d = __atomic_fetch_add(&next_deque, 1, __ATOMIC_RELAXED) % num_threads;
+	__atomic_fetch_add(&queued, 1, __ATOMIC_RELAXED);
+	if (pushChunk(&deques[d], chunk) < 0){
+		__atomic_fetch_sub(&queued, 1, __ATOMIC_RELAXED);
+		countChunk(chunk);
+		return;
+	}
+	pthread_mutex_lock(&wait_lock);
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&wait_lock);
+}
+
+/** Returns whether the job has at most the specified number of pending
+ * chunks. If not, the thread counting the chunk that brings it there writes
+ * notifyFd. The owner may be woken for nothing, when the count gets there
+ * while it checks*/
+static int waitJob(PoolJob *j, int most){
+	if (__atomic_load_n(&j->pending, __ATOMIC_ACQUIRE) <= most){
+		return 1;
+	}
+	j->waitFor = most;
+	__atomic_store_n(&j->waiting, 1, __ATOMIC_SEQ_CST);
+	//pending is read after waiting is published, pairing with countChunk
+	if (__atomic_load_n(&j->pending, __ATOMIC_SEQ_CST) <= most){
+		__atomic_store_n(&j->waiting, 0, __ATOMIC_RELAXED);
+		return 1;
+	}
+	return 0;
+}
+
+unsigned char *jobBuffer(PoolJob *j, size_t *room){
+	if (j->filling == NULL){
+		reapChunks(j);
+		j->filling = getChunk();
+		j->filling->job = j;
+		j->filling->len = 0;
+		j->filling->counted = 0;
+		memset(j->filling->cnt, 0, sizeof(j->filling->cnt));
+	}
+	*room = POOL_CHUNK_SIZE - j->filling->len;
+	return j->filling->data + j->filling->len;
+}
+
+int feedJob(PoolJob *j, const unsigned char *data, size_t len){
+	while (len > 0){
+		size_t n;
+		unsigned char *space = jobBuffer(j, &n);
+		n = (n < len) ? n : len;
+		if (space != data){ //not received in place
+			memcpy(space, data, n);
+		}
+		j->filling->len += n;
+		if (j->filling->len == POOL_CHUNK_SIZE){
+			submitChunk(j);
+		}
+		data += n;
+		len -= n;
+	}
+	return jobHasRoom(j);
+}
+
+int jobHasRoom(PoolJob *j){
+	return waitJob(j, PENDING_PER_THREAD * num_threads);
+}
+
+int sealJob(PoolJob *j){
+	if (j->filling != NULL && j->filling->len > 0){
+		submitChunk(j);
+	}
+	return waitJob(j, 0);
+}
+
+void collectJob(PoolJob *j, unsigned long *cntArr){
+	int num = j->bytes ? NUM_BYTES : NUM_PCC;
+	reapChunks(j);
+	for (int i=0; i<num; i++){
+		cntArr[i] += j->cnt[i];
+	}
+	memset(j->cnt, 0, sizeof(j->cnt));
+}
+
+void dropJob(PoolJob *j){
+	__atomic_store_n(&j->waiting, 0, __ATOMIC_RELAXED);
+	if (__atomic_sub_fetch(&j->refs, 1, __ATOMIC_ACQ_REL) == 0){
+		freeJob(j);
+	}
+}
+
+void poolUsage(unsigned long *chunks, unsigned long *high){
+	pthread_mutex_lock(&spare_lock);
+	*chunks = num_chunks;
+	*high = high_chunks;
+	pthread_mutex_unlock(&spare_lock);
+}
+
+void freePool(void){
+	if (num_threads == 0){
+		return;
+	}
+	pthread_mutex_lock(&wait_lock);
+	stopping = 1;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&wait_lock);
+	for (int i=0; i<num_threads; i++){
+		pthread_join(thread_ids[i], NULL);
+		pthread_mutex_destroy(&deques[i].lock);
+	}
+	while (spare != NULL){
+		PoolChunk *chunk = spare;
+		spare = chunk->next;
+		free(chunk);
+	}
+	num_spare = 0;
+	num_chunks = 0;
+	free(thread_ids);
+	free(deques);
+	thread_ids = NULL;
+	deques = NULL;
+	num_threads = 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * pcc_pool.h
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ */
+
+#ifndef PCC_POOL_H_
+#define PCC_POOL_H_
+
+#include <stddef.h>
+
+#include "pcc_hist.h"
+
+#define POOL_CHUNK_SIZE (1024*1024) //payload bytes counted by one task
+#define POOL_QUEUE_SIZE 256 //tasks each pool thread can queue
+
+typedef struct pool_job_t PoolJob;
+
+/**A chunk of a payload, counted by whichever thread takes it
+ * into its own private histogram*/
+typedef struct pool_chunk_t {
+	struct pool_chunk_t *next; //the next chunk of the job
+	PoolJob *job; //the job the chunk belongs to
+	size_t len; //number of bytes in data
+	int counted; //has cnt been filled, set by the thread that counted the chunk
+	unsigned long cnt[NUM_BYTES]; //the private histogram, NUM_PCC counts or NUM_BYTES with bytes
+	unsigned char data[POOL_CHUNK_SIZE];
+} PoolChunk;
+
+/**The chunks of one payload being counted by the pool.
+ * Only the thread feeding the job may call the job functions. The job never
+ * makes it wait: when the job has too many chunks waiting, or until its last
+ * chunks are counted, the pool writes notifyFd once it is ready instead*/
+struct pool_job_t {
+	int bytes; //count every byte value instead of the printable chars
+	PoolChunk *chunks; //the chunks handed to the pool
+	PoolChunk *filling; //the chunk being filled, not handed yet
+	int pending; //chunks handed to the pool and not counted yet
+	int refs; //the owner's reference and one per pending chunk, the last one frees a dropped job
+	int notifyFd; //an eventfd of the owner
+	int waitFor; //the owner is told once pending falls to this
+	int waiting; //the owner waits to be told
+	unsigned long cnt[NUM_BYTES]; //the histograms of the counted chunks already recycled
+};
+
+/**Starts the specified number of counting threads
+ *
+ * @return
+ * 0 - on success
+ * -1 - on error, errno is set
+ * */
+int initPool(int threads);
+
+/**Allocates a job, owned by the caller until dropJob
+ *
+ * @param notifyFd - the eventfd the pool writes when the job gets ready
+ * */
+PoolJob *newJob(int notifyFd);
+
+/**Empties the job, before it is fed a new payload
+ *
+ * @param j - the job
+ * @param bytes - count every byte value instead of the printable chars
+ * */
+void startJob(PoolJob *j, int bytes);
+
+/**Returns where the next bytes of the job go, in the chunk being filled,
+ * and sets room to the bytes left there. Bytes received right there are
+ * counted in place by feedJob instead of being copied*/
+unsigned char *jobBuffer(PoolJob *j, size_t *room);
+
+/**Adds the bytes to the job's chunks, unless they are already where
+ * jobBuffer said, and hands every full chunk to the pool
+ *
+ * @return
+ * 1 - the job may be fed more
+ * 0 - the job has too many chunks waiting: the caller stops feeding it until
+ * the pool writes notifyFd and jobHasRoom, so a fast client cannot make it grow without limit
+ * */
+int feedJob(PoolJob *j, const unsigned char *data, size_t len);
+
+/**Returns whether the job may be fed more, or arranges for notifyFd to be
+ * written once it may*/
+int jobHasRoom(PoolJob *j);
+
+/**Hands the last chunk of the job to the pool, may be called again
+ *
+ * @return
+ * 1 - every chunk is counted, collectJob then gets the whole payload
+ * 0 - chunks are being counted, the pool writes notifyFd once they are
+ * */
+int sealJob(PoolJob *j);
+
+/**Adds the histograms of the chunks counted so far to cntArr: NUM_PCC
+ * counts, or NUM_BYTES with bytes. Once sealJob returned 1 the job is
+ * then empty and may be started again*/
+void collectJob(PoolJob *j, unsigned long *cntArr);
+
+/**Gives up the job, with the chunks still being counted: the pool frees
+ * it once they are*/
+void dropJob(PoolJob *j);
+
+/**Reports the chunks allocated, in use or kept for reuse, and the most
+ * ever allocated at once. Any thread may call it*/
+void poolUsage(unsigned long *chunks, unsigned long *high);
+
+/**Stops the counting threads once the queued chunks are counted, which frees
+ * the jobs dropped with chunks pending, and frees the spare chunks*/
+void freePool(void);
+
+#endif /* PCC_POOL_H_ */
@@ -0,0 +1,153 @@
+/*
+ * pcc_proto.c
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "pcc_proto.h"
+
+static void packU32(unsigned char *buf, uint32_t num){
+	num = htonl(num);
+	memcpy(buf, &num, sizeof(num));
+}
+
+static uint32_t unpackU32(const unsigned char *buf){
+	uint32_t num;
+	memcpy(&num, buf, sizeof(num));
+	return ntohl(num);
+}
+
+static void packU16(unsigned char *buf, uint16_t num){
+	num = htons(num);
+	memcpy(buf, &num, sizeof(num));
+}
+
+static uint16_t unpackU16(const unsigned char *buf){
+	uint16_t num;
+	memcpy(&num, buf, sizeof(num));
+	return ntohs(num);
+}
+
+void packU64(unsigned char *buf, uint64_t num){
+	packU32(buf, num >> 32);
+	packU32(buf+4, num & 0xFFFFFFFF);
+}
+
+uint64_t unpackU64(const unsigned char *buf){
+	return (uint64_t)unpackU32(buf) << 32 | unpackU32(buf+4);
+}
+
+void packReqHdr(const PccReqHdr *h, unsigned char *buf){
+	packU32(buf, h->id);
+	buf[4] = h->type;
+	buf[5] = h->flags;
+	packU16(buf+6, h->optLen);
+	packU64(buf+8, h->len);
+}
+
+void unpackReqHdr(const unsigned char *buf, PccReqHdr *h){
+	h->id = unpackU32(buf);
+	h->type = buf[4];
+	h->flags = buf[5];
+	h->optLen = unpackU16(buf+6);
+	h->len = unpackU64(buf+8);
+}
+
+void packRepHdr(const PccRepHdr *h, unsigned char *buf){
+	packU32(buf, h->id);
+	buf[4] = h->type;
+	buf[5] = h->status;
+	packU16(buf+6, 0);
+	packU32(buf+8, h->len);
+}
+
+void unpackRepHdr(const unsigned char *buf, PccRepHdr *h){
+	h->id = unpackU32(buf);
+	h->type = buf[4];
+	h->status = buf[5];
+	h->len = unpackU32(buf+8);
+}
+
+size_t packOption(unsigned char *buf, uint16_t type, const void *val, uint16_t len){
+	packU16(buf, type);
+	packU16(buf+2, len);
+	memcpy(buf+PCC_OPT_HDR_SIZE, val, len);
+	return PCC_OPT_HDR_SIZE + len;
+}
+
+int nextOption(const unsigned char *opts, size_t optLen, size_t *pos, uint16_t *type, const unsigned char **val, uint16_t *len){
+	if (*pos == optLen){
+		return 0;
+	}
+	if (optLen - *pos < PCC_OPT_HDR_SIZE){
+		return -1;
+	}
+	*type = unpackU16(opts + *pos);
+	*len = unpackU16(opts + *pos + 2);
+	if (optLen - *pos - PCC_OPT_HDR_SIZE < *len){
+		return -1;
+	}
+	*val = opts + *pos + PCC_OPT_HDR_SIZE;
+	*pos += PCC_OPT_HDR_SIZE + *len;
+	return 1;
+}
+
+size_t packVarint(unsigned char *buf, uint64_t num){
+	size_t n = 0;
+	while (num >= 0x80){
+		buf[n++] = (num & 0x7F) | 0x80;
+		num >>= 7;
+	}
+	buf[n++] = num;
+	return n;
+}
+
+int unpackVarint(const unsigned char *buf, size_t len, size_t *pos, uint64_t *num){
+	*num = 0;
+	for (int shift=0; *pos < len && shift < 64; shift += 7){
+		unsigned char b = buf[(*pos)++];
+		*num |= (uint64_t)(b & 0x7F) << shift;
+		if (!(b & 0x80)){
+			return 0;
+		}
+	}
+	return -1;
+}
+
+size_t packHistogram(unsigned char *buf, const unsigned long *cnt, int num){
+	size_t n = 0;
+	int last = -1;
+	uint64_t prev = 0;
+	for (int i=0; i<num; i++){
+		if (cnt[i] == 0){
+			continue;
+		}
+		//zigzag, so a count a little below the previous one is small too
+		int64_t delta = (int64_t)(cnt[i] - prev);
+		n += packVarint(buf+n, i - last - 1);
+		n += packVarint(buf+n, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+		last = i;
+		prev = cnt[i];
+	}
+	return n;
+}
+
+int unpackHistogram(const unsigned char *buf, size_t len, size_t *pos, unsigned long *cnt, int num){
+	memset(cnt, 0, num*sizeof(unsigned long));
+	int i = -1;
+	uint64_t prev = 0;
+	while (*pos < len){
+		uint64_t gap, zigzag;
+		if (unpackVarint(buf, len, pos, &gap) < 0 || unpackVarint(buf, len, pos, &zigzag) < 0 || gap >= (uint64_t)(num - i - 1)){
+			return -1;
+		}
+		i += gap + 1;
+		prev += (zigzag >> 1) ^ -(zigzag & 1);
+		cnt[i] = prev;
+	}
+	return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * pcc_proto.h
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ *
+ * The framed pcc protocol.
+ * A legacy client sends a 4 bytes length, the payload, and reads back a 4 bytes count.
+ * A framed client starts with the PCC_HELLO word instead, which the server answers
+ * with the version it speaks, and then sends any number of requests on the same
+ * connection without waiting for the replies. Each request is a header, optional
+ * TLV options and a payload. Replies carry the id of their request and are sent in
+ * request order. All integers are in network order.
+ *
+ * A request can ask for progress replies every few MiB of payload, so a client
+ * uploading a large payload gets partial counts before the final reply. A chunked
+ * payload is a sequence of 4 bytes chunk lengths, each followed by the chunk,
+ * ending with a 0 length, or with PCC_CHUNK_CANCEL to abort the request and keep
+ * using the connection.
+ *
+ * A count request with the PCC_OPT_KEY option is also added to the histogram
+ * of that key, which a PCC_REQ_QUERY request with the same option reads back.
+ *
+ * A count request may also ask for byte classes besides the printable chars:
+ * built-in ones by id with PCC_OPT_CLASSES, its own as sets of byte values with
+ * PCC_OPT_BYTE_SET, and all 256 byte values with PCC_FLAG_BYTES. The payload is
+ * still read once, and the final reply carries a count per class in the order
+ * of the options.
+ *
+ * With PCC_FLAG_COMPACT the final reply, and the reply to a query, carry the
+ * whole histogram in a compact form: LEB128 varints for the numbers, and only
+ * the non zero counts, each as the number of zero counts skipped before it and
+ * its zigzag encoded difference from the previous non zero count. Sparse text
+ * and evenly spread binary data both make a reply of a few hundred bytes.
+ * A compact final reply is the count, the class counts, then the histogram of
+ * the printable chars, or of the 256 byte values with PCC_FLAG_BYTES. A compact
+ * query reply is the count and the histogram of the key.
+ *
+ * A client connected over the server's UNIX socket may send a PCC_REQ_ATTACH
+ * request with a shared memory ring as SCM_RIGHTS (see pcc_ring.h). Once the
+ * reply arrives it writes its next requests into the ring instead of the
+ * socket, and still reads the replies from the socket.
+ *
+ * An overloaded server answers a request with PCC_STATUS_BUSY as soon as its
+ * header arrives, and skips its payload. It may also answer a new connection
+ * with the PCC_BUSY word and close it.
+ */
+
+#ifndef PCC_PROTO_H_
+#define PCC_PROTO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PCC_MAGIC 0xFF504300 //"\xffPC" followed by the version; a legacy length of this value is reserved
+#define PCC_MAGIC_MASK 0xFFFFFF00
+#define PCC_VERSION 1 //latest protocol version
+#define PCC_HELLO(version) (PCC_MAGIC | (version))
+#define PCC_BUSY PCC_HELLO(0) //sent instead of the hello reply when the server sheds the connection
+
+#define PCC_REQ_HDR_SIZE 16
+#define PCC_REP_HDR_SIZE 12
+#define PCC_OPT_HDR_SIZE 4
+#define PCC_MAX_OPT_LEN 1024 //maximum total length of the options of a request
+#define PCC_MAX_KEY_LEN 32 //maximum length of a stream key
+#define PCC_MAX_CLASSES 32 //maximum number of byte classes of a request
+#define PCC_BYTE_SET_SIZE 32 //a set of byte values, bit b%8 of byte b/8 for the value b
+#define PCC_MAX_VARINT_LEN 10 //bytes of the longest varint
+#define PCC_MAX_COMPACT_LEN ((1+PCC_MAX_CLASSES)*PCC_MAX_VARINT_LEN + 256*(2+PCC_MAX_VARINT_LEN)) //longest compact reply body
+
+//request types
+#define PCC_REQ_COUNT 1 //count the printable chars of the payload
+#define PCC_REQ_QUERY 2 //read the histogram of the key, without a payload
+#define PCC_REQ_ATTACH 3 //switch the requests to the shared memory ring passed with the header, without a payload
+
+//request flags
+#define PCC_FLAG_CHUNKED 0x01 //the payload is chunked, the len field of the header is ignored
+#define PCC_FLAG_HISTOGRAM 0x02 //progress replies include the histogram of the printable chars
+#define PCC_FLAG_BYTES 0x04 //the final reply includes the count of each of the 256 byte values
+#define PCC_FLAG_COMPACT 0x08 //the final reply is compact and includes the histogram
+
+//request options
+#define PCC_OPT_PROGRESS 1 //uint32: send a progress reply every this many MiB of payload
+#define PCC_OPT_KEY 2 //1 to PCC_MAX_KEY_LEN bytes: the stream key of the request
+#define PCC_OPT_CLASSES 3 //uint8 each: ids of built-in byte classes to count
+#define PCC_OPT_BYTE_SET 4 //PCC_BYTE_SET_SIZE bytes: a byte class of the client's own to count
+
+//built-in byte classes
+#define PCC_CLASS_PRINTABLE 0 //32 to 126
+#define PCC_CLASS_DIGIT 1 //'0' to '9'
+#define PCC_CLASS_ALPHA 2 //ASCII letters
+#define PCC_CLASS_SPACE 3 //' ' and '\t' to '\r'
+#define PCC_CLASS_CONTROL 4 //0 to 31 and 127
+#define PCC_CLASS_UTF8_LEAD 5 //0xC2 to 0xF4, first byte of a multibyte UTF-8 char
+#define PCC_CLASS_UTF8_CONT 6 //0x80 to 0xBF, following bytes of a multibyte UTF-8 char
+#define PCC_CLASS_HIGH 7 //128 to 255, any non ASCII byte
+#define PCC_NUM_CLASSES 8
+
+//chunked payload
+#define PCC_CHUNK_HDR_SIZE 4
+#define PCC_CHUNK_CANCEL 0xFFFFFFFF //chunk length that aborts the request
+
+//reply types
+#define PCC_REP_RESULT 1 //final reply: count(8), class counts(8), 256 byte counts(8) with PCC_FLAG_BYTES; a query gets count(8) and NUM_PCC counts(8)
+#define PCC_REP_PROGRESS 2 //partial result: bytes(8) count(8), then NUM_PCC counts(8) with PCC_FLAG_HISTOGRAM
+
+//reply statuses
+#define PCC_STATUS_OK 0
+#define PCC_STATUS_BAD_REQUEST 1 //unknown request type or malformed options, the payload was skipped
+#define PCC_STATUS_CANCELLED 2 //the client cancelled the request, the count of the bytes received is not kept
+#define PCC_STATUS_BUSY 3 //the server is overloaded and shed the request, the payload was skipped
+#define PCC_STATUS_NOT_FOUND 4 //the queried key is unknown, expired or was evicted
+
+/**Header of a request: id(4) type(1) flags(1) optLen(2) len(8)*/
+typedef struct pcc_req_hdr_t {
+	uint32_t id; //chosen by the client, echoed in the replies
+	uint8_t type; //PCC_REQ_*
+	uint8_t flags; //PCC_FLAG_*
+	uint16_t optLen; //number of option bytes following the header
+	uint64_t len; //number of payload bytes following the options
+} PccReqHdr;
+
+/**Header of a reply: id(4) type(1) status(1) reserved(2) len(4)*/
+typedef struct pcc_rep_hdr_t {
+	uint32_t id; //the id of the request
+	uint8_t type; //PCC_REP_*
+	uint8_t status; //PCC_STATUS_*
+	uint32_t len; //number of body bytes following the header
+} PccRepHdr;
+
+/**Serializes the request header into PCC_REQ_HDR_SIZE bytes*/
+void packReqHdr(const PccReqHdr *h, unsigned char *buf);
+
+/**Parses PCC_REQ_HDR_SIZE bytes into the request header*/
+void unpackReqHdr(const unsigned char *buf, PccReqHdr *h);
+
+/**Serializes the reply header into PCC_REP_HDR_SIZE bytes*/
+void packRepHdr(const PccRepHdr *h, unsigned char *buf);
+
+/**Parses PCC_REP_HDR_SIZE bytes into the reply header*/
+void unpackRepHdr(const unsigned char *buf, PccRepHdr *h);
+
+/**Serializes an option: type(2) len(2) value
+ *
+ * @return the number of bytes written*/
+size_t packOption(unsigned char *buf, uint16_t type, const void *val, uint16_t len);
+
+/**Iterates over the options of a request
+ *
+ * @param opts - the options
+ * @param optLen - total length of the options
+ * @param pos - offset of the next option, start with 0
+ *
+ * @return
+ * 1 - an option was returned in type, val and len
+ * 0 - no more options
+ * -1 - the options are malformed
+ * */
+int nextOption(const unsigned char *opts, size_t optLen, size_t *pos, uint16_t *type, const unsigned char **val, uint16_t *len);
+
+/**Writes an unsigned LEB128 varint, at most PCC_MAX_VARINT_LEN bytes
+ *
+ * @return the number of bytes written*/
+size_t packVarint(unsigned char *buf, uint64_t num);
+
+/**Reads a varint at *pos of the buffer and advances *pos past it
+ *
+ * @return
+ * 0 - on success
+ * -1 - the varint is cut or too long
+ * */
+int unpackVarint(const unsigned char *buf, size_t len, size_t *pos, uint64_t *num);
+
+/**Writes the compact form of a histogram of num counts
+ *
+ * @return the number of bytes written*/
+size_t packHistogram(unsigned char *buf, const unsigned long *cnt, int num);
+
+/**Reads the compact form of a histogram of num counts, from *pos to the end of the buffer
+ *
+ * @return
+ * 0 - on success
+ * -1 - the histogram is malformed
+ * */
+int unpackHistogram(const unsigned char *buf, size_t len, size_t *pos, unsigned long *cnt, int num);
+
+/**Writes a 64 bits number in network order*/
+void packU64(unsigned char *buf, uint64_t num);
+
+/**Reads a 64 bits number in network order*/
+uint64_t unpackU64(const unsigned char *buf);
+
+#endif /* PCC_PROTO_H_ */
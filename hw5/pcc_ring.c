@@ -0,0 +1,222 @@
+/*
+ * pcc_ring.c
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ *
+ * Shared memory transport for clients running on the same host as pcc_server.
+ * The client creates the ring in a memfd and passes it, with two eventfds,
+ * over its UNIX socket connection. From then on it writes its requests into
+ * the ring instead of the socket, and the server counts the payload in place.
+ * Neither side makes a system call while the other keeps up: the eventfds
+ * are only written for a side that found the ring empty, or full, and said
+ * so in the shared header before sleeping.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "pcc_ring.h"
+
+/** Maps the header and data of the ring's memfd
+ *
+ * @return
+ * 0 - on success
+ * -1 - on error, errno is set
+ * */
+static int mapRing(PccRing *r, size_t size){
+	void *mem = mmap(NULL, PCC_RING_HDR_SIZE + size, PROT_READ|PROT_WRITE, MAP_SHARED, r->memfd, 0);
+	if (mem == MAP_FAILED){
+		return -1;
+	}
+	r->hdr = (PccRingHdr*)mem;
+	r->data = (unsigned char*)mem + PCC_RING_HDR_SIZE;
+	r->size = size;
+	return 0;
+}
+
+/** Returns whether size is a valid ring size*/
+static int validSize(size_t size){
+	return size >= PCC_RING_MIN_SIZE && size <= PCC_RING_MAX_SIZE && (size & (size - 1)) == 0;
+}
+
+/** Returns whether fd is an eventfd, as its /proc link tells*/
+static int isEventfd(int fd){
+	static const char eventfdLink[] = "anon_inode:[eventfd]";
+	char path[64], link[sizeof(eventfdLink)];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	ssize_t n = readlink(path, link, sizeof(link));
+	return n == (ssize_t)sizeof(eventfdLink) - 1 && memcmp(link, eventfdLink, n) == 0;
+}
+
+/** Makes the descriptor non blocking
+ *
+ * @return
+ * 0 - on success
+ * -1 - on error, errno is set
+ * */
+static int setNonBlocking(int fd){
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0){
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int createRing(PccRing *r, size_t size){
+	memset(r, 0, sizeof(*r));
+	r->memfd = r->dataFd = r->spaceFd = -1;
+	if (!validSize(size)){
+		errno = EINVAL;
+		return -1;
+	}
+	r->memfd = memfd_create("pcc_ring", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+	if (r->memfd < 0 || ftruncate(r->memfd, PCC_RING_HDR_SIZE + size) < 0 ||
+			fcntl(r->memfd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_SEAL) < 0){
+		int err = errno;
+		freeRing(r);
+		errno = err;
+		return -1;
+	}
+	//both sides only read their eventfd once poll says it is ready
+	r->dataFd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	r->spaceFd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (r->dataFd < 0 || r->spaceFd < 0 || mapRing(r, size) < 0){
+		int err = errno;
+		freeRing(r);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+int attachRing(PccRing *r, int memfd, int dataFd, int spaceFd){
+	memset(r, 0, sizeof(*r));
+	r->memfd = memfd;
+	r->dataFd = dataFd;
+	r->spaceFd = spaceFd;
+	struct stat st;
+	int seals = fcntl(memfd, F_GET_SEALS);
+	if (fstat(memfd, &st) < 0 || seals < 0){
+		int err = errno;
+		freeRing(r);
+		errno = err;
+		return -1;
+	}
+	if (!(seals & F_SEAL_SHRINK) || st.st_size <= PCC_RING_HDR_SIZE || !validSize(st.st_size - PCC_RING_HDR_SIZE) ||
+			!isEventfd(dataFd) || !isEventfd(spaceFd)){
+		freeRing(r);
+		errno = EINVAL;
+		return -1;
+	}
+	//a pipe, or an eventfd the producer keeps near its maximum, would block the consumer's writes
+	if (setNonBlocking(dataFd) < 0 || setNonBlocking(spaceFd) < 0){
+		int err = errno;
+		freeRing(r);
+		errno = err;
+		return -1;
+	}
+	if (mapRing(r, st.st_size - PCC_RING_HDR_SIZE) < 0){
+		int err = errno;
+		freeRing(r);
+		errno = err;
+		return -1;
+	}
+	r->pos = __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE);
+	return 0;
+}
+
+void freeRing(PccRing *r){
+	if (r->hdr != NULL){
+		munmap(r->hdr, PCC_RING_HDR_SIZE + r->size);
+	}
+	if (r->memfd >= 0){
+		close(r->memfd);
+	}
+	if (r->dataFd >= 0){
+		close(r->dataFd);
+	}
+	if (r->spaceFd >= 0){
+		close(r->spaceFd);
+	}
+	memset(r, 0, sizeof(*r));
+	r->memfd = r->dataFd = r->spaceFd = -1;
+}
+
+/** Writes an eventfd to wake the other side*/
+static void wake(int fd){
+	uint64_t one = 1;
+	if (write(fd, &one, sizeof(one)) < 0){
+		//the counter is already set, the other side is awake anyway
+	}
+}
+
+ssize_t ringReadable(PccRing *r, unsigned char **data){
+	uint64_t head = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+	uint64_t avail = head - r->pos;
+	if (avail > r->size){
+		return -1;
+	}
+	size_t off = r->pos & (r->size - 1);
+	*data = r->data + off;
+	return (avail < r->size - off) ? avail : r->size - off;
+}
+
+void ringConsume(PccRing *r, size_t n){
+	r->pos += n;
+	__atomic_store_n(&r->hdr->tail, r->pos, __ATOMIC_RELEASE);
+	//the flag is read after tail is published, pairing with ringProducerSleep
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->hdr->producerWaiting, __ATOMIC_RELAXED) &&
+			__atomic_exchange_n(&r->hdr->producerWaiting, 0, __ATOMIC_RELAXED)){
+		wake(r->spaceFd);
+	}
+}
+
+size_t ringWritable(PccRing *r, unsigned char **space){
+	uint64_t tail = __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE);
+	size_t room = r->size - (r->pos - tail);
+	size_t off = r->pos & (r->size - 1);
+	*space = r->data + off;
+	return (room < r->size - off) ? room : r->size - off;
+}
+
+void ringCommit(PccRing *r, size_t n){
+	r->pos += n;
+	__atomic_store_n(&r->hdr->head, r->pos, __ATOMIC_RELEASE);
+	//the flag is read after head is published, pairing with ringConsumerSleep
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->hdr->consumerWaiting, __ATOMIC_RELAXED) &&
+			__atomic_exchange_n(&r->hdr->consumerWaiting, 0, __ATOMIC_RELAXED)){
+		wake(r->dataFd);
+	}
+}
+
+int ringConsumerSleep(PccRing *r){
+	__atomic_store_n(&r->hdr->consumerWaiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE) != r->pos){
+		__atomic_store_n(&r->hdr->consumerWaiting, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return 1;
+}
+
+int ringProducerSleep(PccRing *r){
+	__atomic_store_n(&r->hdr->producerWaiting, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (r->pos - __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE) < r->size){
+		__atomic_store_n(&r->hdr->producerWaiting, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return 1;
+}
@@ -0,0 +1,98 @@
+/*
+ * pcc_ring.h
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ */
+
+#ifndef PCC_RING_H_
+#define PCC_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PCC_RING_HDR_SIZE 4096 //the shared header, a page so the data is page aligned
+#define PCC_RING_MIN_SIZE (64*1024) //smallest ring
+#define PCC_RING_MAX_SIZE (1024*1024*1024) //largest ring
+#define PCC_RING_FDS 3 //descriptors passed to attach a ring: the memfd, dataFd and spaceFd
+
+/**The header at the start of the shared memory, followed by the data.
+ * head and tail only grow, the bytes between them are written and not
+ * consumed yet. Each side owns one cache line and only reads the other*/
+typedef struct pcc_ring_hdr_t {
+	uint64_t head __attribute__((aligned(64))); //bytes written by the producer
+	uint32_t consumerWaiting; //the consumer sleeps on dataFd until the producer writes
+	uint64_t tail __attribute__((aligned(64))); //bytes consumed by the consumer
+	uint32_t producerWaiting; //the producer sleeps on spaceFd until the consumer frees room
+} PccRingHdr;
+
+/**One side of a single producer, single consumer byte ring in shared memory.
+ * The local client is the producer: it writes the bytes it would have sent on
+ * its socket, and the server consumes them where they are. A side that finds
+ * the ring empty, or full, sets its waiting flag and sleeps on an eventfd,
+ * which the other side only writes when it sees the flag*/
+typedef struct pcc_ring_t {
+	PccRingHdr *hdr; //the shared header
+	unsigned char *data; //the shared data, size bytes
+	size_t size; //a power of two
+	uint64_t pos; //this side's copy of head, for the producer, or tail, for the consumer
+	int memfd; //the shared memory
+	int dataFd; //eventfd written by the producer for a waiting consumer, non blocking
+	int spaceFd; //eventfd written by the consumer for a waiting producer, non blocking
+} PccRing;
+
+/**Creates a sealed shared memory ring of size bytes, a power of two, as its producer
+ *
+ * @return
+ * 0 - on success
+ * -1 - on error, errno is set*/
+int createRing(PccRing *r, size_t size);
+
+/**Maps the ring the producer passed as its consumer, which then owns the descriptors.
+ * The memory must be sealed against shrinking, so the producer cannot make
+ * the consumer fault on it, and dataFd and spaceFd must be eventfds, which
+ * are made non blocking so the producer cannot make the consumer wait on them
+ *
+ * @return
+ * 0 - on success
+ * -1 - the descriptors are not a valid ring, errno is set*/
+int attachRing(PccRing *r, int memfd, int dataFd, int spaceFd);
+
+/**Unmaps the ring and closes its descriptors*/
+void freeRing(PccRing *r);
+
+/**Returns the number of written bytes the consumer can read at once, from *data
+ *
+ * @return
+ * the number of bytes, 0 if the ring is empty
+ * -1 - the producer corrupted the ring
+ * */
+ssize_t ringReadable(PccRing *r, unsigned char **data);
+
+/**Consumes n bytes and wakes the producer if it waits for room*/
+void ringConsume(PccRing *r, size_t n);
+
+/**Returns the number of bytes the producer can write at once, to *space*/
+size_t ringWritable(PccRing *r, unsigned char **space);
+
+/**Publishes n written bytes and wakes the consumer if it waits for them*/
+void ringCommit(PccRing *r, size_t n);
+
+/**Tells the producer to write dataFd once it commits, unless bytes arrived meanwhile
+ *
+ * @return
+ * 1 - the ring is empty, the consumer should wait for dataFd
+ * 0 - bytes arrived, the consumer should read them
+ * */
+int ringConsumerSleep(PccRing *r);
+
+/**Tells the consumer to write spaceFd once it consumes, unless room was freed meanwhile
+ *
+ * @return
+ * 1 - the ring is full, the producer should wait for spaceFd
+ * 0 - room was freed, the producer should write
+ * */
+int ringProducerSleep(PccRing *r);
+
+#endif /* PCC_RING_H_ */
@@ -5,6 +5,8 @@
  *      Author: lital
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,210 +17,1699 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <signal.h>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <sched.h>
+#include <linux/filter.h>
+
+#include "pcc_hist.h"
+#include "pcc_count.h"
+#include "pcc_uring.h"
+#include "pcc_proto.h"
+#include "pcc_stats.h"
+#include "pcc_persist.h"
+#include "pcc_keys.h"
+#include "pcc_pool.h"
+#include "pcc_handoff.h"
+#include "pcc_ring.h"
+
+#define DEFAULT_READ_SIZE (256*1024) //default number of bytes requested by each read
+#define CONNECTION_QUEUE_SIZE 100
+#define MAX_EVENTS 256 //maximum number of events handled by one epoll_wait call
+#define MAX_READS_PER_EVENT 16 //read calls per readiness event before yielding to other connections
+#define URING_ENTRIES 256 //submission queue size of each worker's io_uring
+#define URING_BUFS 64 //number of receive buffers provided to each worker's io_uring
+#define OUT_HIGH_WATER (64*1024) //pending reply bytes above which a connection stops reading
+#define OUT_INIT_SIZE 64 //initial size of a connection's reply buffer
+#define OUT_KEEP_SIZE (16*1024) //largest reply buffer kept by a recycled connection object
+#define CONN_SLAB_SIZE 64 //connection objects allocated at once
+#define RING_EVENT 1UL //set in the epoll data of a connection's ring, connections are aligned
+#define DEFAULT_SNAPSHOT_SECS 10 //default time between snapshots of pcc_count
+#define DEFAULT_DRAIN_SECS 30 //default time the connections are given to finish on SIGINT
+#define DEFAULT_MAX_KEYS 65536 //default number of keyed histograms
+#define POOL_MIN_LEN (8*1024*1024) //payload bytes of a request counted by the worker before the rest is received into the counting pool's chunks
+
+/**The states of a connection*/
+enum conn_state_t {
+	STATE_READ_LEN, //reading the first word: a legacy length header or the framed protocol hello
+	STATE_READ_DATA, //streaming the payload into the counter
+	STATE_READ_HDR, //reading the header of a framed request
+	STATE_READ_OPTS, //reading the options of a framed request
+	STATE_READ_CHUNK, //reading the length of the next chunk of a chunked payload
+	STATE_JOINING, //the payload has been read, the pool is counting its last chunks
+	STATE_DONE //the legacy request has been answered, only writing the reply
+};
+
+/**Byte class counting state of a connection,
+ * allocated by the first request of the connection asking for classes*/
+typedef struct class_state_t {
+	int active; //is the current request counted into bins
+	ByteClasses classes; //the classes of the current request
+	unsigned long bins[NUM_BYTES]; //count of each byte value of the payload read so far
+} ClassState;
+
+/**Represents a client connection owned by a worker*/
+typedef struct conn_t {
+	int fd; //connection file descriptor
+	enum conn_state_t state;
+	int framed; //does the client speak the framed protocol
+	unsigned char hdr[PCC_REQ_HDR_SIZE]; //the header being read
+	size_t hdrRead; //number of header bytes read so far
+	PccReqHdr req; //the framed request being read
+	unsigned char opts[PCC_MAX_OPT_LEN]; //the options of the framed request being read
+	size_t optsRead; //number of option bytes read so far
+	unsigned char key[PCC_MAX_KEY_LEN]; //the stream key of the framed request
+	size_t keyLen; //length of key, 0 for none
+	int badRequest; //the request is skipped and answered with PCC_STATUS_BAD_REQUEST
+	int cancelled; //the client cancelled the request
+	int shed; //the request was answered with PCC_STATUS_BUSY, its payload is skipped
+	unsigned long admitted; //payload bytes of the request counted in the worker's in-flight bytes
+	double tokens; //requests the connection may start before hitting max_rate
+	uint64_t refilled; //time tokens was last refilled
+	unsigned long toRead; //number of payload bytes left to read, of the current chunk if chunked
+	unsigned long consumed; //number of payload bytes read so far
+	unsigned long progressEvery; //payload bytes between progress replies, 0 for none
+	unsigned long nextProgress; //value of consumed at which the next progress reply is sent
+	unsigned long cntArr[NUM_PCC]; //printable char count of the payload read so far
+	ClassState *cls; //byte class counting state, NULL until a request asks for classes
+	PoolJob *job; //the chunks of a large payload counted by the pool, NULL until needed
+	int pooled; //is the rest of the current payload counted by the pool
+	int poolFull; //the job has too many chunks waiting, not read until the pool catches up
+	unsigned char *held; //bytes received on the socket after the payload while joining, fed once joined
+	size_t heldLen; //number of bytes in held
+	uint64_t start; //time the first byte of the current request arrived
+	unsigned char *out; //replies waiting to be written
+	size_t outLen; //number of bytes in out
+	size_t outSent; //number of bytes of out written so far
+	size_t outCap; //size of out
+	size_t reported; //pending reply bytes included in the worker's stats
+	unsigned events; //the events the connection is registered for in epoll
+	int eof; //the client closed its side between requests
+	int armed; //is a multishot recv pending for the connection
+	int cancelling; //has the pending recv been cancelled
+	int closing; //closed, waiting for the pending recv to be cancelled
+	struct conn_t *prev; //the previous connection of the worker
+	struct conn_t *next; //the next connection of the worker
+	int local; //did the client connect over the UNIX socket
+	int uring; //does the connection receive through the worker's io_uring
+	int passed[PCC_RING_FDS]; //descriptors the client passed for PCC_REQ_ATTACH
+	int numPassed; //number of descriptors in passed
+	int attached; //do the requests arrive in ring instead of the socket
+	int ringPaused; //ring is not read until the connection reads again
+	PccRing ring; //the client's shared memory ring, once attached
+} Conn;
+
+/**A block of connection objects allocated at once. Closed connections go back
+ * to the worker's spare list with their reply buffer and class state, so in
+ * steady state accepting and serving a connection allocates nothing.
+ * The slabs are only freed when the worker exits*/
+typedef struct conn_slab_t {
+	struct conn_slab_t *next; //the next slab of the worker
+	Conn conns[CONN_SLAB_SIZE];
+} ConnSlab;
+
+/**Represents a worker thread running its own epoll event loop.
+ * The workers either share one listening socket, woken one at a time by
+ * EPOLLEXCLUSIVE, or each accepts from its own SO_REUSEPORT socket*/
+typedef struct worker_t {
+	pthread_t thread;
+	int id;
+	int epfd; //epoll instance of the worker
+	int listenfd; //the listening socket the worker accepts from, its own with reuse_port
+	int accepting; //is the worker accepting connections, until SIGINT
+	int paused; //is the listening socket removed from the epoll instance because the worker is full
+	int numConns; //number of connections owned by the worker
+	Conn *conns; //the connections owned by the worker
+	Conn *spare; //closed connection objects ready for reuse
+	ConnSlab *slabs; //the blocks the worker's connection objects come from
+	uint64_t deadline; //time the connections left are closed at, once draining
+	unsigned long drained; //connections closed while draining
+	unsigned long dropped; //connections closed at the drain deadline
+	unsigned long inflight; //payload bytes announced by the requests being read
+	PccShard *shard; //the worker's shard of pcc_count
+	WorkerStats *stats; //the worker's live statistics
+	unsigned char *buff; //receive buffer shared by all connections of the worker
+	int poolfd; //eventfd the counting pool writes when a job of the worker gets ready, -1 without a pool
+	int useUring; //does the worker receive through io_uring
+	PccUring uring; //the worker's io_uring, when used
+} Worker;
+
+Worker *workers; //workers array
+int num_workers; //total number of workers
+int listenfd = -1; //listening socket shared by the workers, -1 with reuse_port
+int wakefd; //eventfd used to wake up the workers on SIGINT
+int donefd; //eventfd stopping the helper threads once the workers are done
+size_t read_size = DEFAULT_READ_SIZE; //bytes requested by each read
+int rcvbuf_size = 0; //SO_RCVBUF of the connections, 0 keeps the kernel's auto tuning
+int use_uring = 0; //receive with io_uring multishot recv instead of read
+unsigned int stats_port = 0; //port of the stats endpoint, 0 for none
+char *local_path = NULL; //UNIX socket local clients connect to, NULL for none
+int localfd = -1; //its listening socket, shared by the workers
+int conn_budget = 0; //connections per worker, 0 for no limit
+unsigned long inflight_budget = 0; //in-flight payload bytes per worker, 0 for no limit
+double max_rate = 0; //requests per second per connection, 0 for no limit
+int shed_conns = 0; //shed connections over conn_budget instead of pausing accept
+int reuse_port = 0; //give each worker its own SO_REUSEPORT listening socket and core
+char *persist_path = NULL; //counter file pcc_count is persisted to, NULL for none
+unsigned int snapshot_secs = DEFAULT_SNAPSHOT_SECS; //seconds between snapshots of pcc_count
+int use_log = 0; //log the counts added between snapshots
+unsigned long max_keys = DEFAULT_MAX_KEYS; //number of keyed histograms kept, 0 for none
+unsigned int key_ttl = 0; //seconds before an idle key expires, 0 for never
+int pool_threads = 0; //threads counting the chunks of large payloads, 0 for none
+unsigned int drain_secs = DEFAULT_DRAIN_SECS; //seconds the connections are given to finish on SIGINT
+char *handoff_path = NULL; //UNIX socket the listening sockets are handed over on, NULL for none
+volatile sig_atomic_t isTerm = 0; //has SIGINT been received
+
+/** Updates the number of times each printable character
+ * has been appeared in the buffer,
+ * using the fastest counting kernel the CPU supports
+ *
+ * @param buffer - array of characters
+ * @param len - the lrngth of the buffer array
+ * @param cntArr - array contains the number of times
+ * 				   each printable characters appears
+ * */
+void updateLocalCounter(unsigned char *buffer, size_t len, unsigned long *cntArr){
+	pccCount(buffer, len, cntArr);
+}
+
+/** Returns the sum of all values in the array*/
+unsigned long sumArr(unsigned long *arr, int len){
+	unsigned long sum = 0;
+	for (int i=0; i<len; i++){
+		sum+=arr[i];
+	}
+	return sum;
+}
+
+/** Takes a zeroed connection object from the worker's spare list,
+ * allocating a slab of them when the list is empty.
+ * The object keeps the reply buffer, pool job and class state
+ * it had when it was recycled
+ *
+ * @param w - the worker
+ * */
+Conn *newConn(Worker *w){
+	if (w->spare == NULL){
+		ConnSlab *slab = (ConnSlab*)calloc(1, sizeof(ConnSlab));
+		if (slab == NULL){
+			printf("ERROR: malloc has failed\n");
+			exit(EXIT_FAILURE);
+		}
+		slab->next = w->slabs;
+		w->slabs = slab;
+		for (int i=CONN_SLAB_SIZE-1; i>=0; i--){
+			slab->conns[i].next = w->spare;
+			w->spare = &slab->conns[i];
+		}
+		statAdd(&w->stats->connObjs, CONN_SLAB_SIZE);
+	}
+	Conn *c = w->spare;
+	w->spare = c->next;
+
+	unsigned char *out = c->out;
+	size_t outCap = c->outCap;
+	PoolJob *job = c->job;
+	ClassState *cls = c->cls;
+	memset(c, 0, sizeof(Conn));
+	c->out = out;
+	c->outCap = outCap;
+	c->job = job;
+	c->cls = cls;
+	return c;
+}
+
+/** Returns a closed connection object to the worker's spare list.
+ * A reply buffer grown past OUT_KEEP_SIZE by a single client is freed,
+ * so the memory kept stays bounded by the high-water mark of connections
+ *
+ * @param w - the worker
+ * @param c - the connection
+ * */
+void recycleConn(Worker *w, Conn *c){
+	if (c->cls != NULL && c->cls->active){ //closed in the middle of a request
+		memset(c->cls->bins, 0, sizeof(c->cls->bins));
+		c->cls->active = 0;
+	}
+	free(c->held);
+	c->held = NULL;
+	if (c->outCap > OUT_KEEP_SIZE){
+		free(c->out);
+		c->out = NULL;
+		c->outCap = 0;
+	}
+	c->next = w->spare;
+	w->spare = c;
+	w->numConns--;
+}
+
+/** Frees the worker's connection objects and their buffers, once it has no connections*/
+void freeConns(Worker *w){
+	for (Conn *c = w->spare; c != NULL; c = c->next){
+		free(c->out);
+		if (c->job != NULL){
+			dropJob(c->job);
+		}
+		free(c->cls);
+	}
+	while (w->slabs != NULL){
+		ConnSlab *slab = w->slabs;
+		w->slabs = slab->next;
+		free(slab);
+	}
+	w->spare = NULL;
+}
+
+/** Closes the connection and releases its memory.
+ * If a multishot recv is still pending the memory is released
+ * only once its cancellation completes
+ *
+ * @param w - the worker owning the connection
+ * @param c - the connection
+ * */
+void closeConn(Worker *w, Conn *c){
+	if (c->prev != NULL){
+		c->prev->next = c->next;
+	}
+	else {
+		w->conns = c->next;
+	}
+	if (c->next != NULL){
+		c->next->prev = c->prev;
+	}
+	c->prev = c->next = NULL;
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	statAdd(&w->stats->syscalls, 2);
+	statAdd(&w->stats->closed, 1);
+	statAdd(&w->stats->pending, -c->reported);
+	w->inflight -= c->admitted;
+	statSet(&w->stats->inflight, w->inflight);
+	if (c->pooled){ //the pool may still be counting its chunks, it frees the job once done
+		dropJob(c->job);
+		c->job = NULL;
+		c->pooled = 0;
+	}
+	if (c->attached){
+		epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->ring.dataFd, NULL);
+		freeRing(&c->ring);
+		c->attached = 0;
+	}
+	while (c->numPassed > 0){
+		close(c->passed[--c->numPassed]);
+	}
+	if (c->armed){
+		if (!c->cancelling && uringCancel(&w->uring, c) < 0){
+			perror("ERROR: Failed cancelling recv");
+			exit(EXIT_FAILURE);
+		}
+		c->fd = -1;
+		c->closing = 1;
+		return;
+	}
+	recycleConn(w, c);
+}
+
+/** Appends bytes to the replies waiting to be written
+ *
+ * @param c - the connection
+ * @param data - the bytes
+ * @param len - number of bytes
+ * */
+void appendOut(Conn *c, const void *data, size_t len){
+	if (c->outLen + len > c->outCap){
+		size_t cap = (c->outCap > 0) ? c->outCap : OUT_INIT_SIZE;
+		while (cap < c->outLen + len){
+			cap *= 2;
+		}
+		c->out = (unsigned char*)realloc(c->out, cap);
+		if (c->out == NULL){
+			printf("ERROR: realloc has failed\n");
+			exit(EXIT_FAILURE);
+		}
+		c->outCap = cap;
+	}
+	memcpy(c->out + c->outLen, data, len);
+	c->outLen += len;
+}
+
+/** Appends a framed reply to the current request
+ *
+ * @param c - the connection
+ * @param type - the reply type
+ * @param status - the reply status
+ * @param body - the reply body
+ * @param len - length of the body
+ * */
+void appendReply(Conn *c, uint8_t type, uint8_t status, const void *body, uint32_t len){
+	unsigned char hdr[PCC_REP_HDR_SIZE];
+	PccRepHdr rep = { .id = c->req.id, .type = type, .status = status, .len = len };
+	packRepHdr(&rep, hdr);
+	appendOut(c, hdr, sizeof(hdr));
+	appendOut(c, body, len);
+}
+
+/** Queues the reply to a query: the total and the histogram of the key*/
+void appendQuery(Conn *c){
+	unsigned long cntArr[NUM_PCC];
+	if (!keyedLookup(c->key, c->keyLen, cntArr)){
+		appendReply(c, PCC_REP_RESULT, PCC_STATUS_NOT_FOUND, NULL, 0);
+		return;
+	}
+	if (c->req.flags & PCC_FLAG_COMPACT){
+		unsigned char body[PCC_MAX_COMPACT_LEN];
+		size_t len = packVarint(body, sumArr(cntArr, NUM_PCC));
+		len += packHistogram(body+len, cntArr, NUM_PCC);
+		appendReply(c, PCC_REP_RESULT, PCC_STATUS_OK, body, len);
+		return;
+	}
+	unsigned char body[(1+NUM_PCC)*sizeof(uint64_t)];
+	packU64(body, sumArr(cntArr, NUM_PCC));
+	for (int i=0; i<NUM_PCC; i++){
+		packU64(body+(1+i)*sizeof(uint64_t), cntArr[i]);
+	}
+	appendReply(c, PCC_REP_RESULT, PCC_STATUS_OK, body, sizeof(body));
+}
+
+/** Returns whether the current request counts its payload into a byte histogram*/
+int countsBytes(Conn *c){
+	return c->cls != NULL && c->cls->active;
+}
+
+/** Counts received payload bytes of the current request. Past POOL_MIN_LEN
+ * bytes the rest of the payload is handed to the counting pool in chunks,
+ * so a single huge upload is counted by every pool thread. The connection
+ * stops reading while the pool has too many of its chunks waiting*/
+void countPayload(Worker *w, Conn *c, unsigned char *data, size_t len){
+	if (pool_threads > 0 && (c->pooled || c->consumed >= POOL_MIN_LEN)){
+		if (c->job == NULL){
+			c->job = newJob(w->poolfd);
+		}
+		if (!c->pooled){
+			startJob(c->job, countsBytes(c));
+			c->pooled = 1;
+		}
+		c->poolFull = !feedJob(c->job, data, len);
+	}
+	else if (countsBytes(c)){
+		byteCount(data, len, c->cls->bins); //one pass for every class
+	}
+	else {
+		updateLocalCounter(data, len, c->cntArr);
+	}
+}
+
+/** Adds the counts of the chunks the pool has counted so far to the
+ * request's counts, before they are used: all of them once the job is sealed*/
+void joinPayload(Conn *c){
+	if (c->pooled){
+		collectJob(c->job, countsBytes(c) ? c->cls->bins : c->cntArr);
+	}
+}
+
+/** Completes the counts of the current request before they are used: adds
+ * the counted pooled chunks and, for byte classes, sets the printable char
+ * counts from the byte histogram*/
+void syncClasses(Conn *c){
+	joinPayload(c);
+	if (countsBytes(c)){
+		memset(c->cntArr, 0, sizeof(c->cntArr));
+		bytesToPcc(c->cls->bins, c->cntArr);
+	}
+}
+
+/** Stops counting byte classes, once the request is done*/
+void resetClasses(Conn *c){
+	if (countsBytes(c)){
+		memset(c->cls->bins, 0, sizeof(c->cls->bins));
+		c->cls->active = 0;
+	}
+}
+
+/** Queues the compact reply to a count request: the count, the count of each
+ * byte class, and the histogram of the printable chars or of the byte values*/
+void appendCompactCount(Conn *c, unsigned long cnt){
+	unsigned char body[PCC_MAX_COMPACT_LEN];
+	size_t len = packVarint(body, cnt);
+	if (countsBytes(c)){
+		unsigned long classCnt[MAX_BYTE_CLASSES];
+		countByteClasses(&c->cls->classes, c->cls->bins, classCnt);
+		for (int i=0; i<c->cls->classes.num; i++){
+			len += packVarint(body+len, classCnt[i]);
+		}
+	}
+	if (c->req.flags & PCC_FLAG_BYTES){
+		len += packHistogram(body+len, c->cls->bins, NUM_BYTES);
+	}
+	else {
+		len += packHistogram(body+len, c->cntArr, NUM_PCC);
+	}
+	appendReply(c, PCC_REP_RESULT, PCC_STATUS_OK, body, len);
+}
+
+/** Queues the successful reply to a count request: the count, then the count
+ * of each byte class and, with PCC_FLAG_BYTES, of each byte value*/
+void appendCount(Conn *c, unsigned long cnt){
+	if (c->req.flags & PCC_FLAG_COMPACT){
+		appendCompactCount(c, cnt);
+		return;
+	}
+	unsigned char body[(1+MAX_BYTE_CLASSES+NUM_BYTES)*sizeof(uint64_t)];
+	size_t len = sizeof(uint64_t);
+	packU64(body, cnt);
+	if (countsBytes(c)){
+		unsigned long classCnt[MAX_BYTE_CLASSES];
+		countByteClasses(&c->cls->classes, c->cls->bins, classCnt);
+		for (int i=0; i<c->cls->classes.num; i++, len += sizeof(uint64_t)){
+			packU64(body+len, classCnt[i]);
+		}
+		for (int b=0; (c->req.flags & PCC_FLAG_BYTES) && b<NUM_BYTES; b++, len += sizeof(uint64_t)){
+			packU64(body+len, c->cls->bins[b]);
+		}
+	}
+	appendReply(c, PCC_REP_RESULT, PCC_STATUS_OK, body, len);
+}
+
+/** Makes the worker read the connection's ring on its next iteration*/
+void wakeRing(Conn *c){
+	uint64_t one = 1;
+	if (write(c->ring.dataFd, &one, sizeof(one)) < 0){
+		//the eventfd is already readable
+	}
+}
+
+/** Maps the shared memory ring the client passed with its PCC_REQ_ATTACH
+ * request and queues the reply. The following requests are read from the ring
+ *
+ * @param w - the worker owning the connection
+ * @param c - the connection
+ * */
+void attachConn(Worker *w, Conn *c){
+	if (c->attached || c->numPassed != PCC_RING_FDS){
+		appendReply(c, PCC_REP_RESULT, PCC_STATUS_BAD_REQUEST, NULL, 0);
+		statAdd(&w->stats->errors, 1);
+		return;
+	}
+	c->numPassed = 0; //the ring owns them from now on
+	if (attachRing(&c->ring, c->passed[0], c->passed[1], c->passed[2]) < 0){
+		appendReply(c, PCC_REP_RESULT, PCC_STATUS_BAD_REQUEST, NULL, 0);
+		statAdd(&w->stats->errors, 1);
+		return;
+	}
+	struct epoll_event ev = { .events = EPOLLIN, .data.u64 = (uintptr_t)c | RING_EVENT };
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->ring.dataFd, &ev) < 0){
+		perror("ERROR in epoll_ctl()");
+		exit(EXIT_FAILURE);
+	}
+	statAdd(&w->stats->syscalls, 1);
+	c->attached = 1;
+	if (!ringConsumerSleep(&c->ring)){ //the client did not wait for the reply
+		wakeRing(c);
+	}
+	appendReply(c, PCC_REP_RESULT, PCC_STATUS_OK, NULL, 0);
+}
+
+/** Clears the state of the current request, once it is done or shed, and
+ * waits for the header of the next one*/
+void resetRequest(Conn *c){
+	memset(c->cntArr, 0, sizeof(c->cntArr));
+	resetClasses(c);
+	c->keyLen = 0;
+	c->badRequest = 0;
+	c->cancelled = 0;
+	c->consumed = 0;
+	c->progressEvery = 0;
+	c->hdrRead = 0;
+	c->state = STATE_READ_HDR;
+}
+
+/** Folds the request's count into the worker's shard of pcc_count,
+ * and into the histogram of its key,
+ * queues its reply and gets ready for the next request
+ *
+ * @param w - the worker owning the connection
+ * @param c - the connection
+ * */
+void finishRequest(Worker *w, Conn *c){
+	if (c->pooled && !sealJob(c->job)){ //finished again once the pool tells the worker
+		c->state = STATE_JOINING;
+		return;
+	}
+	w->inflight -= c->admitted;
+	statSet(&w->stats->inflight, w->inflight);
+	c->admitted = 0;
+	if (c->shed){ //already answered
+		c->shed = 0;
+		resetRequest(c);
+		return;
+	}
+
+	syncClasses(c);
+	c->pooled = 0;
+	c->poolFull = 0;
+	if (!c->badRequest && !c->cancelled && c->req.type != PCC_REQ_QUERY && c->req.type != PCC_REQ_ATTACH){
+		//update the global pcc_count
+		updateGlobalCounter(w->shard, c->cntArr);
+		if (c->keyLen > 0){
+			keyedAdd(c->key, c->keyLen, c->cntArr);
+		}
+	}
+	statAdd(&w->stats->requests, 1);
+	statAdd(&w->stats->bytes, c->consumed);
+	if (c->badRequest){
+		statAdd(&w->stats->errors, 1);
+	}
+	latRecord(&w->stats->lat, latNow() - c->start);
+
+	unsigned long cnt = sumArr(c->cntArr, NUM_PCC); //total number of printable characters
+	if (!c->framed){ //legacy client: a 4 bytes count, then close
+		uint32_t reply = htonl(cnt);
+		appendOut(c, &reply, sizeof(reply));
+		c->state = STATE_DONE;
+		return;
+	}
+
+	if (c->badRequest){
+		appendReply(c, PCC_REP_RESULT, PCC_STATUS_BAD_REQUEST, NULL, 0);
+	}
+	else if (c->req.type == PCC_REQ_QUERY){
+		appendQuery(c);
+	}
+	else if (c->req.type == PCC_REQ_ATTACH){
+		attachConn(w, c);
+	}
+	else if (c->cancelled){
+		unsigned char body[sizeof(uint64_t)];
+		packU64(body, cnt);
+		appendReply(c, PCC_REP_RESULT, PCC_STATUS_CANCELLED, body, sizeof(body));
+	}
+	else {
+		appendCount(c, cnt);
+	}
+	resetRequest(c);
+}
+
+/** Queues a progress reply with the partial result of the current request.
+ * Progress replies are advisory: one is skipped rather than
+ * letting it make the connection stop reading
+ *
+ * @param c - the connection
+ * */
+void appendProgress(Conn *c){
+	unsigned char body[(2+NUM_PCC)*sizeof(uint64_t)];
+	size_t len = 2*sizeof(uint64_t);
+	if (c->req.flags & PCC_FLAG_HISTOGRAM){
+		len += NUM_PCC*sizeof(uint64_t);
+	}
+	if (c->outLen - c->outSent + PCC_REP_HDR_SIZE + len > OUT_HIGH_WATER){
+		return;
+	}
+
+	syncClasses(c);
+	packU64(body, c->consumed);
+	packU64(body+sizeof(uint64_t), sumArr(c->cntArr, NUM_PCC));
+	if (c->req.flags & PCC_FLAG_HISTOGRAM){
+		for (int i=0; i<NUM_PCC; i++){
+			packU64(body+(2+i)*sizeof(uint64_t), c->cntArr[i]);
+		}
+	}
+	appendReply(c, PCC_REP_PROGRESS, PCC_STATUS_OK, body, len);
+}
+
+/** Decides whether the worker takes the current request: it must fit in the
+ * in-flight bytes budget, unless it is the only request in flight, and in
+ * the connection's request rate
+ *
+ * @param w - the worker owning the connection
+ * @param c - the connection
+ * @param len - announced payload length of the request
+ *
+ * @return
+ * 1 - the request is admitted, and counted in the worker's in-flight bytes
+ * 0 - the request should be shed
+ * */
+int admitRequest(Worker *w, Conn *c, unsigned long len){
+	if (inflight_budget > 0 && w->inflight > 0 && w->inflight + len > inflight_budget){
+		return 0;
+	}
+	if (max_rate > 0){
+		//token bucket holding at most one second of requests
+		c->tokens += (c->start - c->refilled) / 1e9 * max_rate;
+		c->tokens = (c->tokens < max_rate) ? c->tokens : max_rate;
+		c->refilled = c->start;
+		if (c->tokens < 1){
+			return 0;
+		}
+		c->tokens--;
+	}
+	c->admitted = len;
+	w->inflight += len;
+	statSet(&w->stats->inflight, w->inflight);
+	return 1;
+}
+
+/** Starts reading the payload of the current request*/
+void startPayload(Worker *w, Conn *c, unsigned long len){
+	if (!c->badRequest && !admitRequest(w, c, len)){
+		statAdd(&w->stats->shed, 1);
+		if (!c->framed){ //a legacy client gets the busy word instead of a count
+			uint32_t busy = htonl(PCC_BUSY);
+			appendOut(c, &busy, sizeof(busy));
+			c->shed = 1;
+			c->state = STATE_DONE;
+			return;
+		}
+		appendReply(c, PCC_REP_RESULT, PCC_STATUS_BUSY, NULL, 0);
+		c->shed = 1;
+	}
+	c->nextProgress = c->progressEvery;
+	if (c->framed && (c->req.flags & PCC_FLAG_CHUNKED)){
+		c->hdrRead = 0;
+		c->state = STATE_READ_CHUNK;
+		return;
+	}
+	c->toRead = len;
+	c->state = STATE_READ_DATA;
+	if (c->toRead == 0){
+		finishRequest(w, c);
+	}
+}
+
+/** Compiles the class options of spec into the connection's class table.
+ * Built-in classes are only recorded by id, their shared table is compiled
+ * at startup, so only the byte sets of the client are built per request
+ *
+ * @return
+ * 0 - on success
+ * -1 - the class options are malformed
+ * */
+int compileClasses(Conn *c, const unsigned char *spec, size_t specLen){
+	if (c->cls == NULL){
+		c->cls = (ClassState*)calloc(1, sizeof(ClassState));
+		if (c->cls == NULL){
+			printf("ERROR: malloc has failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	ClassState *cls = c->cls;
+	size_t pos = 0;
+	uint16_t type, len;
+	const unsigned char *val;
+	int rc = 0;
+	initByteClasses(&cls->classes);
+	while (rc == 0 && nextOption(spec, specLen, &pos, &type, &val, &len) > 0){
+		if (type == PCC_OPT_BYTE_SET){
+			rc = (len == PCC_BYTE_SET_SIZE) ? addByteSet(&cls->classes, val) : -1;
+		}
+		for (int i=0; type == PCC_OPT_CLASSES && rc == 0 && i<len; i++){
+			rc = addBuiltinClass(&cls->classes, val[i]);
+		}
+	}
+	return rc;
+}
+
+/** Applies the options and flags of the current framed request.
+ * Unknown options are ignored, malformed ones make it a bad request*/
+void parseOptions(Conn *c){
+	size_t pos = 0;
+	uint16_t type, len;
+	const unsigned char *val;
+	unsigned char spec[PCC_MAX_OPT_LEN]; //the class options, in order
+	size_t specLen = 0;
+	int rc;
+	while ((rc = nextOption(c->opts, c->req.optLen, &pos, &type, &val, &len)) > 0){
+		if (type == PCC_OPT_PROGRESS){
+			uint32_t mib;
+			if (len != sizeof(mib)){
+				c->badRequest = 1;
+				continue;
+			}
+			memcpy(&mib, val, sizeof(mib));
+			c->progressEvery = (unsigned long)ntohl(mib) << 20;
+		}
+		else if (type == PCC_OPT_KEY){
+			if (len == 0 || len > PCC_MAX_KEY_LEN){
+				c->badRequest = 1;
+				continue;
+			}
+			memcpy(c->key, val, len);
+			c->keyLen = len;
+		}
+		else if (type == PCC_OPT_CLASSES || type == PCC_OPT_BYTE_SET){
+			specLen += packOption(spec+specLen, type, val, len);
+		}
+	}
+	if (rc < 0){
+		c->badRequest = 1;
+	}
+	if (c->badRequest || (specLen == 0 && !(c->req.flags & PCC_FLAG_BYTES))){
+		return;
+	}
+	if (c->req.type == PCC_REQ_QUERY){ //a key's histogram has no byte classes
+		c->badRequest = 1;
+		return;
+	}
+	if (compileClasses(c, spec, specLen) < 0){
+		c->badRequest = 1;
+		return;
+	}
+	c->cls->active = 1;
+}
+
+/** Handles a completely read header: the first word of the connection,
+ * the header of a framed request, or the length of a chunk
+ *
+ * @return
+ * 0 - on success
+ * -1 - on a protocol error, the connection should be closed
+ * */
+int headerDone(Worker *w, Conn *c){
+	if (c->state == STATE_READ_LEN){
+		uint32_t word;
+		memcpy(&word, c->hdr, sizeof(word));
+		word = ntohl(word);
+		if ((word & PCC_MAGIC_MASK) == PCC_MAGIC){ //the framed protocol hello
+			uint32_t version = word & ~PCC_MAGIC_MASK;
+			if (version == 0){
+				return -1;
+			}
+			uint32_t hello = htonl(PCC_HELLO(version < PCC_VERSION ? version : PCC_VERSION));
+			appendOut(c, &hello, sizeof(hello));
+			c->framed = 1;
+			c->hdrRead = 0;
+			c->state = STATE_READ_HDR;
+			return 0;
+		}
+		startPayload(w, c, word);
+		return 0;
+	}
+
+	if (c->state == STATE_READ_CHUNK){
+		uint32_t chunk;
+		memcpy(&chunk, c->hdr, sizeof(chunk));
+		chunk = ntohl(chunk);
+		if (chunk == 0 || chunk == PCC_CHUNK_CANCEL){ //end of the payload
+			c->cancelled = (chunk == PCC_CHUNK_CANCEL);
+			finishRequest(w, c);
+			return 0;
+		}
+		c->toRead = chunk;
+		c->state = STATE_READ_DATA;
+		return 0;
+	}
+
+	unpackReqHdr(c->hdr, &c->req);
+	if (c->req.optLen > PCC_MAX_OPT_LEN){
+		return -1;
+	}
+	if (c->req.type != PCC_REQ_COUNT && c->req.type != PCC_REQ_QUERY && c->req.type != PCC_REQ_ATTACH){
+		c->badRequest = 1;
+	}
+	if (c->req.type == PCC_REQ_ATTACH && (c->req.len > 0 || (c->req.flags & PCC_FLAG_CHUNKED))){
+		c->badRequest = 1; //the ring comes with the header, there is no payload
+	}
+	if (c->req.type == PCC_REQ_QUERY && (c->req.len > 0 || (c->req.flags & (PCC_FLAG_CHUNKED|PCC_FLAG_BYTES)) || c->req.optLen == 0)){
+		c->badRequest = 1; //a query has a key and no payload
+	}
+	if (c->req.optLen > 0){
+		c->optsRead = 0;
+		c->state = STATE_READ_OPTS;
+		return 0;
+	}
+	parseOptions(c); //the flags alone may ask for the byte values
+	startPayload(w, c, c->req.len);
+	return 0;
+}
+
+/** Keeps bytes received while the current request waits for the pool,
+ * they are fed once it is finished
+ *
+ * @param c - the connection
+ * @param data - the bytes
+ * @param len - number of bytes
+ * */
+void holdBytes(Conn *c, unsigned char *data, size_t len){
+	unsigned char *held = (unsigned char*)realloc(c->held, c->heldLen + len);
+	if (held == NULL){
+		printf("ERROR: malloc has failed\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(held + c->heldLen, data, len);
+	c->held = held;
+	c->heldLen += len;
+}
+
+/** Advances the connection through its states with the received bytes.
+ * Queues a reply for every request completed
+ *
+ * @param w - the worker owning the connection
+ * @param c - the connection
+ * @param data - the received bytes
+ * @param len - number of received bytes
+ *
+ * @return
+ * the number of bytes consumed - all of them, unless the connection reads
+ * from its ring and waits for the pool, the rest is then left in the ring
+ * -1 - on a protocol error, the connection should be closed
+ * */
+ssize_t feedConn(Worker *w, Conn *c, unsigned char *data, size_t len){
+	size_t fed = 0;
+	while (len > 0 && c->state != STATE_DONE){
+		size_t n;
+		if (c->attached && (data < c->ring.data || data >= c->ring.data + c->ring.size)){
+			return -1; //the client keeps using the socket after attaching its ring
+		}
+		if (c->state == STATE_JOINING){ //the next requests wait for the reply of this one
+			if (c->attached){ //read from the ring again once it is sent
+				return fed;
+			}
+			holdBytes(c, data, len);
+			return fed + len;
+		}
+		if (c->hdrRead == 0 && (c->state == STATE_READ_LEN || c->state == STATE_READ_HDR)){ //a new request
+			c->start = latNow();
+		}
+		if (c->state == STATE_READ_LEN || c->state == STATE_READ_HDR || c->state == STATE_READ_CHUNK){
+			size_t size = (c->state == STATE_READ_HDR) ? PCC_REQ_HDR_SIZE : sizeof(uint32_t);
+			n = size - c->hdrRead;
+			n = (n < len) ? n : len;
+			memcpy(c->hdr+c->hdrRead, data, n);
+			c->hdrRead += n;
+			if (c->hdrRead == size && headerDone(w, c) < 0){
+				return -1;
+			}
+		}
+		else if (c->state == STATE_READ_OPTS){
+			n = c->req.optLen - c->optsRead;
+			n = (n < len) ? n : len;
+			memcpy(c->opts+c->optsRead, data, n);
+			c->optsRead += n;
+			if (c->optsRead == c->req.optLen){
+				parseOptions(c);
+				startPayload(w, c, c->req.len);
+			}
+		}
+		else {
+			n = (c->toRead < len) ? c->toRead : len;
+			if (c->progressEvery > 0 && n > c->nextProgress - c->consumed){ //stop at the next progress point
+				n = c->nextProgress - c->consumed;
+			}
+			if (!c->badRequest && !c->shed){
+				countPayload(w, c, data, n);
+			}
+			c->toRead -= n;
+			c->consumed += n;
+			if (c->progressEvery > 0 && c->consumed == c->nextProgress){
+				if (!c->badRequest && !c->shed){
+					appendProgress(c);
+				}
+				c->nextProgress += c->progressEvery;
+			}
+			if (c->toRead == 0 && c->framed && (c->req.flags & PCC_FLAG_CHUNKED)){ //the chunk has been read
+				c->hdrRead = 0;
+				c->state = STATE_READ_CHUNK;
+			}
+			else if (c->toRead == 0){ //the whole payload has been read
+				finishRequest(w, c);
+			}
+		}
+		data += n;
+		len -= n;
+		fed += n;
+	}
+	return fed + len;
+}
+
+/** Returns whether the connection should read more requests.
+ * It stops while too many replies are waiting for the client to read them*/
+int isReading(Conn *c){
+	return c->state != STATE_DONE && c->state != STATE_JOINING && !c->poolFull && !c->eof &&
+			c->outLen - c->outSent <= OUT_HIGH_WATER;
+}
+
+/** Writes as much of the pending replies as the socket accepts,
+ * then updates what the connection waits for: more requests, writing,
+ * or nothing, in which case it is closed
+ *
+ * @param w - the worker owning the connection
+ * @param c - the connection
+ *
+ * @return
+ * 0 - the connection is still open
+ * -1 - the connection was closed
+ * */
+int flushConn(Worker *w, Conn *c){
+	while (c->outSent < c->outLen) {
+		ssize_t bytes_sent = send(c->fd, c->out+c->outSent, c->outLen-c->outSent, MSG_NOSIGNAL);
+		statAdd(&w->stats->syscalls, 1);
+		if (bytes_sent < 0){
+			if (errno == EAGAIN || errno == EWOULDBLOCK){ //wait for EPOLLOUT
+				break;
+			}
+			if (errno == EINTR){
+				continue;
+			}
+			perror("ERROR: Failed sending data to client");
+			closeConn(w, c);
+			return -1;
+		}
+		c->outSent += bytes_sent;
+	}
+	if (c->outSent == c->outLen){
+		c->outSent = c->outLen = 0;
+	}
+	statAdd(&w->stats->pending, (c->outLen - c->outSent) - c->reported);
+	c->reported = c->outLen - c->outSent;
+
+	int pending = c->outLen > 0;
+	if (!pending && c->state != STATE_JOINING && (c->state == STATE_DONE || c->eof)){ //nothing more to do
+		closeConn(w, c);
+		return -1;
+	}
+
+	int reading = isReading(c);
+	if (reading && c->ringPaused){ //the replies have been read, back to the ring
+		c->ringPaused = 0;
+		wakeRing(c);
+	}
+	unsigned events = (pending ? EPOLLOUT : 0) | ((reading && !c->uring) ? EPOLLIN|EPOLLRDHUP : 0);
+	if (events != c->events){
+		struct epoll_event ev = { .events = events, .data.ptr = c };
+		if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0){
+			perror("ERROR in epoll_ctl()");
+			exit(EXIT_FAILURE);
+		}
+		statAdd(&w->stats->syscalls, 1);
+		c->events = events;
+	}
+
+	if (c->uring){
+		if (reading && !c->armed){
+			if (uringRecvMultishot(&w->uring, c->fd, c) < 0){
+				perror("ERROR: Failed submitting recv");
+				exit(EXIT_FAILURE);
+			}
+			c->armed = 1;
+		}
+		else if (!reading && c->armed && !c->cancelling){ //pause the recv
+			if (uringCancel(&w->uring, c) < 0){
+				perror("ERROR: Failed cancelling recv");
+				exit(EXIT_FAILURE);
+			}
+			c->cancelling = 1;
+		}
+	}
+	return 0;
+}
+
+/** Handles the client closing its side of the connection.
+ * Between requests the pending replies are still written,
+ * in the middle of a request the connection is dropped
+ *
+ * @param w - the worker owning the connection
+ * @param c - the connection
+ * */
+void connEof(Worker *w, Conn *c){
+	if (c->state == STATE_JOINING){ //decided once the request is finished
+		c->eof = 1;
+		return;
+	}
+	if (c->state == STATE_DONE || (c->framed && c->state == STATE_READ_HDR && c->hdrRead == 0)){
+		c->eof = 1;
+		flushConn(w, c);
+		return;
+	}
+	closeConn(w, c);
+}
+
+/** Reads from the connection into the worker's receive buffer. A local client
+ * may pass descriptors with its bytes, which are kept for PCC_REQ_ATTACH
+ *
+ * @param w - the worker owning the connection
+ * @param c - the connection
+ *
+ * @return the result of the read
+ * */
+ssize_t recvConn(Worker *w, Conn *c, unsigned char *buff, size_t size){
+	if (!c->local){
+		return read(c->fd, buff, size);
+	}
+	char control[CMSG_SPACE(PCC_RING_FDS * sizeof(int))];
+	struct iovec iov = { .iov_base = buff, .iov_len = size };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+	ssize_t n = recvmsg(c->fd, &mh, MSG_CMSG_CLOEXEC);
+	if (n <= 0){
+		return n;
+	}
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)){
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS){
+			continue;
+		}
+		int num = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (int i=0; i<num; i++){
+			int fd;
+			memcpy(&fd, CMSG_DATA(cm) + i*sizeof(int), sizeof(int));
+			if (c->numPassed < PCC_RING_FDS){
+				c->passed[c->numPassed++] = fd;
+			}
+			else {
+				close(fd);
+			}
+		}
+	}
+	return n;
+}
+
+/** Reads whatever the socket has ready, in batches of read_size bytes,
+ * and counts it straight from the worker's receive buffer
+ *
+ * @param w - the worker owning the connection
+ * @param c - the connection
+ * */
+void readConn(Worker *w, Conn *c){
+	for (int i=0; i<MAX_READS_PER_EVENT; i++){
+		//a pooled payload is received straight into the pool's chunk, and counted there
+		unsigned char *buff = w->buff;
+		size_t size = read_size;
+		if (c->pooled && c->state == STATE_READ_DATA){
+			buff = jobBuffer(c->job, &size);
+			size = (size < c->toRead) ? size : c->toRead;
+		}
+		ssize_t read_bytes = recvConn(w, c, buff, size);
+		statAdd(&w->stats->syscalls, 1);
+		if (read_bytes < 0){
+			if (errno == EAGAIN || errno == EWOULDBLOCK){ //wait for more data
+				break;
+			}
+			if (errno == EINTR){
+				continue;
+			}
+			perror("ERROR: Failed getting data from client");
+			closeConn(w, c);
+			return;
+		}
+		if (read_bytes == 0){ //the client closed its side
+			connEof(w, c);
+			return;
+		}
+
+		if (feedConn(w, c, buff, read_bytes) < 0){
+			printf("ERROR: Protocol error, dropping client\n");
+			statAdd(&w->stats->errors, 1);
+			closeConn(w, c);
+			return;
+		}
+		if (!isReading(c) || (size_t)read_bytes < size){ //paused, or the socket has been drained
+			break;
+		}
+	}
+	flushConn(w, c);
+}
+
+/** Resumes the connections the pool has caught up with, once it wrote the
+ * worker's eventfd: a request waiting for its last chunks is answered and
+ * the bytes held meanwhile are fed, a connection stopped by a full job
+ * reads again
+ *
+ * @param w - the worker
+ * */
+void resumePooled(Worker *w){
+	uint64_t ignored;
+	if (read(w->poolfd, &ignored, sizeof(ignored)) < 0){
+		//a wakeup consumed by an earlier read
+	}
+	statAdd(&w->stats->syscalls, 1);
+	Conn *next;
+	for (Conn *c = w->conns; c != NULL; c = next){
+		next = c->next;
+		if (c->state == STATE_JOINING){
+			if (!sealJob(c->job)){
+				continue;
+			}
+			finishRequest(w, c);
+			unsigned char *held = c->held;
+			size_t heldLen = c->heldLen;
+			c->held = NULL;
+			c->heldLen = 0;
+			ssize_t rc = feedConn(w, c, held, heldLen);
+			free(held);
+			if (rc < 0){
+				printf("ERROR: Protocol error, dropping client\n");
+				statAdd(&w->stats->errors, 1);
+				closeConn(w, c);
+				continue;
+			}
+			if (c->eof && c->state != STATE_JOINING){ //the client closed its side while joining
+				c->eof = 0;
+				connEof(w, c);
+				continue;
+			}
+		}
+		else if (!c->poolFull || !jobHasRoom(c->job)){
+			continue;
+		}
+		c->poolFull = 0;
+		flushConn(w, c);
+	}
+}
 
-#include <unistd.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
+/** Counts the requests the client wrote into its shared memory ring where
+ * they are, until the ring is empty, in which case the client is asked to
+ * write the eventfd, or until the connection stops reading because of its
+ * pending replies
+ *
+ * @param w - the worker owning the connection
+ * @param c - the connection
+ * */
+void readRing(Worker *w, Conn *c){
+	uint64_t ignored;
+	if (read(c->ring.dataFd, &ignored, sizeof(ignored)) < 0){
+		//a wakeup consumed by an earlier read
+	}
+	statAdd(&w->stats->syscalls, 1);
+	while (1){
+		if (!isReading(c)){
+			c->ringPaused = 1;
+			break;
+		}
+		unsigned char *data;
+		ssize_t n = ringReadable(&c->ring, &data);
+		if (n == 0 && ringConsumerSleep(&c->ring)){
+			break;
+		}
+		n = ((size_t)n < read_size) ? n : (ssize_t)read_size;
+		if (n >= 0){
+			n = feedConn(w, c, data, n);
+		}
+		if (n < 0){
+			printf("ERROR: Protocol error, dropping client\n");
+			statAdd(&w->stats->errors, 1);
+			closeConn(w, c);
+			return;
+		}
+		ringConsume(&c->ring, n);
+	}
+	flushConn(w, c);
+}
 
-#include <sys/stat.h>
-#include <sys/wait.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/mman.h>
-#include <errno.h>
+/** Handles the completions of the worker's io_uring:
+ * counts the received buffers straight where the kernel filled them,
+ * gives them back and re-arms the multishot recvs that stopped
+ *
+ * @param w - the worker
+ * */
+void reapUring(Worker *w){
+	struct io_uring_cqe *cqe;
+	while ((cqe = uringPeek(&w->uring)) != NULL){
+		Conn *c = (Conn*)(unsigned long)cqe->user_data;
+		int res = cqe->res;
+		unsigned flags = cqe->flags;
+		int protoErr = 0;
 
-#define NUM_PCC 95 //number of printable chars
-#define MIN_PCC 32 //minimum value of printable char
-#define MAX_PCC 126 //maximum value of printable char
-#define BUFFER_SIZE 2048
-#define CONNECTION_QUEUE_SIZE 100
+		if (c != NULL && (flags & IORING_CQE_F_BUFFER)){
+			if (res > 0 && !c->closing && !c->eof){
+				protoErr = (feedConn(w, c, uringBuffer(&w->uring, cqe), res) < 0) ? -1 : 0;
+			}
+			uringRecycle(&w->uring, cqe);
+		}
+		uringSeen(&w->uring);
+		if (c == NULL){ //completion of a cancel request
+			continue;
+		}
 
-unsigned long pcc_count[NUM_PCC] = {0}; //global counter for printable chars
-pthread_t *threads; //threads array
-int num_threads; //total number of threads
-pthread_mutex_t lock;
-int listenfd; //listening socket file descriptor
-int isTerm = 0; //has SIGTERM been received
+		if (!(flags & IORING_CQE_F_MORE)){
+			c->armed = 0;
+			c->cancelling = 0;
+		}
+		if (c->closing){
+			if (!c->armed){ //the last completion of the connection
+				recycleConn(w, c);
+			}
+		}
+		else if (protoErr < 0){
+			printf("ERROR: Protocol error, dropping client\n");
+			statAdd(&w->stats->errors, 1);
+			closeConn(w, c);
+		}
+		else if (res == 0){ //the client closed its side
+			connEof(w, c);
+		}
+		else if (res < 0 && res != -ENOBUFS && res != -ECANCELED){
+			closeConn(w, c);
+		}
+		else {
+			flushConn(w, c);
+		}
+	}
+}
 
-/**
- * Writes the specified 4 bytes number to the file descriptor
- *
- * @param fd - the file descriptor
- * @param num - the 4 bytes number to write
+/** Removes the listening sockets from the worker's epoll instance
+ * or registers them again
  *
- * @return
- * 0 - on success
- * -1 - on error
+ * @param w - the worker
+ * @param pause - remove the listening sockets
  * */
-int writeInt(int fd, uint32_t num){
-	char *data = (char*)&num;
-	int left = sizeof(uint32_t);
-	int bytes_sent;
-	while (left > 0) {
-		bytes_sent = write (fd, data, left);
-		if (bytes_sent < 0){
-			return -1;
+void pauseAccepting(Worker *w, int pause){
+	int fds[2] = { w->listenfd, localfd };
+	void *ptrs[2] = { &w->listenfd, &localfd };
+	for (int i=0; i<2; i++){
+		if (fds[i] < 0){
+			continue;
+		}
+		if (pause){
+			epoll_ctl(w->epfd, EPOLL_CTL_DEL, fds[i], NULL);
 		}
 		else {
-			data += bytes_sent;
-			left -= bytes_sent;
+			//EPOLLEXCLUSIVE wakes a single worker per incoming connection
+			struct epoll_event ev = { .events = EPOLLIN|EPOLLEXCLUSIVE, .data.ptr = ptrs[i] };
+			if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fds[i], &ev) < 0){
+				perror("ERROR in epoll_ctl()");
+				exit(EXIT_FAILURE);
+			}
 		}
+		statAdd(&w->stats->syscalls, 1);
 	}
-	return 0;
+	w->paused = pause;
 }
 
-/** Reads 4 bytes from the specified file descriptor
- *
- * @param fd - socket file descriptor
- * @param res - pointer to get the number read
+/** Answers a connection over the worker's budget with the busy word and closes it.
+ * The socket buffer is empty, so the word never blocks*/
+void shedConn(Worker *w, int connfd){
+	uint32_t busy = htonl(PCC_BUSY);
+	if (send(connfd, &busy, sizeof(busy), MSG_NOSIGNAL|MSG_DONTWAIT) < 0){
+		//the client is gone already
+	}
+	close(connfd);
+	statAdd(&w->stats->syscalls, 2);
+	statAdd(&w->stats->shed, 1);
+}
+
+/** Accepts all pending connections on the listening socket
+ * and registers them in the worker's epoll instance.
+ * A worker at its connection budget stops accepting, leaving the connections
+ * in the listen queue, to the other workers unless it has its own socket,
+ * or sheds them
  *
- * @return
- * -1 - on error
- * 0 - on success
+ * @param w - the accepting worker
  * */
-int readInt (int fd, uint32_t *res){
-	char *data = (char*)res;
-	int left = sizeof(uint32_t);
-	int bytes_read;
-
-	while(left > 0) {
-		bytes_read = read(fd, data, left);
-		if (bytes_read < 0){
-			return -1;
+void acceptConns(Worker *w, int fd){
+	while (!isTerm) {
+		int full = conn_budget > 0 && w->numConns >= conn_budget;
+		if (full && !shed_conns){
+			pauseAccepting(w, 1);
+			return;
+		}
+		int connfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+		statAdd(&w->stats->syscalls, 1);
+		if (connfd == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK){ //no more pending connections
+				return;
+			}
+			if (errno == EINTR || errno == ECONNABORTED){
+				continue;
+			}
+			perror("ERROR: Failed accepting client connection");
+			return;
 		}
-		else{
-			data += bytes_read;
-			left -= bytes_read;
+
+		if (full){
+			shedConn(w, connfd);
+			continue;
+		}
+
+		if (rcvbuf_size > 0 && setsockopt(connfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf_size, sizeof(rcvbuf_size)) < 0){
+			perror("ERROR: Failed setting SO_RCVBUF");
 		}
 
+		Conn *c = newConn(w);
+		c->fd = connfd;
+		c->state = STATE_READ_LEN;
+		c->local = (fd == localfd);
+		//a local client may pass its ring with its bytes, which only recvmsg gets
+		c->uring = w->useUring && !c->local;
+
+		//with io_uring epoll is only used to wait until replies can be written
+		c->events = c->uring ? 0 : EPOLLIN|EPOLLRDHUP;
+		struct epoll_event ev = { .events = c->events, .data.ptr = c };
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, connfd, &ev) < 0){
+			perror("ERROR in epoll_ctl()");
+			exit(EXIT_FAILURE);
+		}
+		w->numConns++;
+		if ((unsigned long)w->numConns > w->stats->connsHigh){
+			statSet(&w->stats->connsHigh, w->numConns);
+		}
+		c->next = w->conns;
+		if (w->conns != NULL){
+			w->conns->prev = c;
+		}
+		w->conns = c;
+		statAdd(&w->stats->accepted, 1);
+		statAdd(&w->stats->syscalls, 1);
+		if (c->uring){
+			if (uringRecvMultishot(&w->uring, connfd, c) < 0){
+				perror("ERROR: Failed submitting recv");
+				exit(EXIT_FAILURE);
+			}
+			c->armed = 1;
+		}
 	}
-	return 0;
 }
 
-/** Returns whether the specified char is printable*/
-int isPrintableChar(unsigned char c){
-	return c>=MIN_PCC && c<=MAX_PCC;
+/** Removes the listening sockets and the wakeup eventfd from the
+ * worker's epoll instance, so it only finishes its own connections
+ *
+ * @param w - the worker
+ * */
+void stopAccepting(Worker *w){
+	if (!w->paused){
+		pauseAccepting(w, 1);
+	}
+	epoll_ctl(w->epfd, EPOLL_CTL_DEL, wakefd, NULL);
+	w->accepting = 0;
+	w->deadline = latNow() + (uint64_t)drain_secs * 1000000000ULL;
 }
 
-
-/** Updates the number of times each printable character
- * has been appeared in the buffer
+/** Returns whether the connection waits for its next request with every
+ * reply written, so closing it loses nothing. Any other connection is
+ * given until the drain deadline to finish its request
  *
- * @param buffer - array of characters
- * @param len - the lrngth of the buffer array
- * @param cntArr - array contains the number of times
- * 				   each printable characters appears
+ * @param c - the connection
  * */
-void updateLocalCounter(unsigned char *buffer, int len, unsigned long *cntArr){
-	for (int i=0; i<len; i++){
-		if (isPrintableChar(buffer[i])){ //printable character
-			cntArr[buffer[i]-MIN_PCC]++;
-		}
-	}
+int isIdle(Conn *c){
+	unsigned char *data;
+	return c->framed && c->state == STATE_READ_HDR && c->hdrRead == 0 && c->outSent == c->outLen &&
+			(!c->attached || ringReadable(&c->ring, &data) == 0);
 }
 
-/** Updates the global pcc_count array
- * according to the array specified
+/** Closes the worker's idle connections once it stopped accepting,
+ * and every connection left once the drain deadline has passed
  *
- * @param cntArr - array contains the number of times
- * 				   each printable characters appears
+ * @param w - the worker
  * */
-void updateGlobalCounter(unsigned long *cntArr){
-	for (int i=0; i<NUM_PCC; i++){
-		pcc_count[i] += cntArr[i];
+void drainConns(Worker *w){
+	int late = latNow() >= w->deadline;
+	Conn *next;
+	for (Conn *c = w->conns; c != NULL; c = next){
+		next = c->next;
+		if (late || isIdle(c)){
+			if (late){
+				w->dropped++;
+			}
+			w->drained++;
+			closeConn(w, c);
+		}
 	}
 }
 
-/** Returns the sum of all values in the array*/
-unsigned long sumArr(unsigned long *arr, int len){
-	unsigned long sum = 0;
-	for (int i=0; i<len; i++){
-		sum+=arr[i];
+/** Returns the epoll_wait timeout of the worker: none while accepting,
+ * the milliseconds left until the drain deadline while draining*/
+int drainTimeout(Worker *w){
+	if (w->accepting || w->conns == NULL){
+		return -1;
 	}
-	return sum;
+	uint64_t now = latNow();
+	if (now >= w->deadline){
+		return 0;
+	}
+	return (int)((w->deadline - now + 999999) / 1000000);
 }
 
-/** Reads the number of bytes specified from the file descriptor
- * and counts how many times each printable character appeared
- *
- * @param fd - file descriptor
- * @param toRead - number of bytes to read
- * @param cntArr - array to get the number of times each printable char appeared
+/** Runs the event loop of a worker until SIGINT has been received
+ * and all of the worker's connections are done
  *
- * @return
- * 0 - on success
- * -1 - on error*/
-int getCntArr(int fd, unsigned long toRead, unsigned long *cntArr){
-	unsigned char buff[BUFFER_SIZE];
-	int read_bytes;
-	int chunk;
-	while (toRead > 0){
-		chunk = (toRead < BUFFER_SIZE) ? toRead : BUFFER_SIZE;
-		read_bytes = read(fd, buff, chunk);
-		if (read_bytes == -1) {
-			return -1;
+ * @param t - the worker*/
+void* workerThread(void *t){
+	Worker *w = (Worker*)t;
+	struct epoll_event events[MAX_EVENTS];
+	int reap, resume;
+
+	while (w->accepting || w->numConns > 0){
+		int n = epoll_wait(w->epfd, events, MAX_EVENTS, drainTimeout(w));
+		statAdd(&w->stats->syscalls, 1);
+		if (n < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			perror("ERROR in epoll_wait()");
+			exit(EXIT_FAILURE);
 		}
 
-		updateLocalCounter(buff, read_bytes, cntArr);
+		statSet(&w->stats->ready, n);
+		reap = resume = 0;
+		for (int i=0; i<n; i++){
+			void *p = events[i].data.ptr;
+			if ((uintptr_t)p & RING_EVENT){
+				Conn *c = (Conn*)((uintptr_t)p & ~RING_EVENT);
+				if (c->attached){ //not closed by an earlier event
+					readRing(w, c);
+				}
+			}
+			else if (p == &w->listenfd){
+				acceptConns(w, w->listenfd);
+			}
+			else if (p == &localfd){
+				acceptConns(w, localfd);
+			}
+			else if (p == &w->uring){
+				reap = 1; //after the other events, as it may free connections they refer to
+			}
+			else if (p == &w->poolfd){
+				resume = 1; //after the other events too
+			}
+			else if (p != &wakefd){
+				Conn *c = (Conn*)p;
+				if ((c->events & EPOLLIN) && (events[i].events & (EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR))){
+					readConn(w, c);
+				}
+				else {
+					flushConn(w, c);
+				}
+			}
+		}
+		if (reap){
+			reapUring(w);
+		}
+		if (resume){
+			resumePooled(w);
+		}
+		if (w->useUring && w->uring.toSubmit > 0){
+			statAdd(&w->stats->syscalls, 1);
+		}
+		if (w->useUring && uringSubmit(&w->uring) < 0){
+			perror("ERROR: Failed submitting to io_uring");
+			exit(EXIT_FAILURE);
+		}
 
-		toRead -= read_bytes;
+		if (isTerm && w->accepting){
+			stopAccepting(w);
+		}
+		else if (w->paused && w->accepting && w->numConns < conn_budget){
+			pauseAccepting(w, 0);
+		}
+		if (!w->accepting){
+			drainConns(w);
+		}
 	}
 
-	return 0;
+	close(w->epfd);
+	if (w->useUring){
+		freeUring(&w->uring);
+	}
+	free(w->buff);
+	freeConns(w);
+	return NULL;
 }
 
-/** Reads a stream of bytes from the client,
- * computes its printable character count,
- * and writes the result to the client over the TCP connection.
- * Also updates the pcc_count global data structure
+/** Creates the epoll instance of the worker and registers
+ * the listening socket, the wakeup eventfd and, with a counting pool,
+ * the eventfd the pool tells the worker through in it
  *
- * @param t - connection file descriptor*/
-void* clientThread (void *t){
-	int connfd = (int)t;
-	//read the length of the char array from the cliennt
-	uint32_t len;
-	if (readInt(connfd, &len) < 0){ //error
-		perror("ERROR: Failed sending data to client");
+ * @param w - the worker
+ * @param id - the worker's index
+ * */
+void initWorker(Worker *w, int id){
+	w->id = id;
+	w->numConns = 0;
+	w->shard = getPccShard(id);
+	w->stats = getWorkerStats(id);
+	w->buff = (unsigned char*)malloc(read_size);
+	if (w->buff == NULL){
+		printf("ERROR: malloc has failed\n");
+		exit(EXIT_FAILURE);
+	}
+	w->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (w->epfd < 0){
+		perror("ERROR in epoll_create1()");
 		exit(EXIT_FAILURE);
 	}
-	len = ntohl(len);
 
-	//read the char array from the client
-	//and compute the number of times each printable char appeared
-	unsigned long cntArr[NUM_PCC];
-	if (getCntArr(connfd, len, cntArr) < 0){ //error
-		perror("ERROR: Failed getting data from client");
+	pauseAccepting(w, 0);
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &wakefd };
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, wakefd, &ev) < 0){
+		perror("ERROR in epoll_ctl()");
+		exit(EXIT_FAILURE);
+	}
+	w->accepting = 1;
+
+	w->poolfd = -1;
+	if (pool_threads > 0){
+		w->poolfd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+		if (w->poolfd == -1){
+			perror("ERROR in eventfd()");
+			exit(EXIT_FAILURE);
+		}
+		ev.data.ptr = &w->poolfd;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->poolfd, &ev) < 0){
+			perror("ERROR in epoll_ctl()");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	w->useUring = 0;
+	if (use_uring){
+		if (initUring(&w->uring, URING_ENTRIES, URING_BUFS, read_size) < 0){
+			perror("WARNING: io_uring is unavailable, using read()");
+			return;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = &w->uring;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->uring.fd, &ev) < 0){
+			perror("ERROR in epoll_ctl()");
+			exit(EXIT_FAILURE);
+		}
+		w->useUring = 1;
+	}
+}
+
+/** Creates a non blocking listening socket bound to the port.
+ * With reuse_port several of them share the port, and the kernel
+ * spreads the incoming connections between them
+ *
+ * @param port - the port
+ *
+ * @return the listening socket*/
+int openListener(unsigned int port){
+	int fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("Failed creating listening socket");
 		exit(EXIT_FAILURE);
 	}
 
-	//lock
-	int rc = pthread_mutex_lock(&lock);
-	if( 0 != rc ) { //error
-		perror("ERROR in pthread_mutex_lock()");
+	int one = 1;
+	if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0){
+		perror("ERROR: Failed setting SO_REUSEPORT");
 		exit(EXIT_FAILURE);
 	}
-	//update the global pcc_count
-	updateGlobalCounter(cntArr);
-	//unlock
-	rc = pthread_mutex_unlock(&lock);
-	if( 0 != rc ) { //error
-		perror("ERROR in pthread_mutex_unlock()");
+
+	struct sockaddr_in serv_addr;
+	memset(&serv_addr, 0, sizeof(struct sockaddr_in));
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	serv_addr.sin_port = htons(port);
+
+	//bind socket to specified port
+	if (bind(fd, (struct sockaddr *)&serv_addr, sizeof(struct sockaddr_in)) == -1) {
+		perror("Failed binding socket");
+		close(fd);
 		exit(EXIT_FAILURE);
 	}
 
-	unsigned long cnt = sumArr(cntArr, NUM_PCC); //total number of printable characters
+	if (listen(fd, CONNECTION_QUEUE_SIZE) == -1) {
+		perror("Failed to start listening to incoming connections");
+		close(fd);
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
 
-	//send the printable character count to the client
-	if (writeInt(connfd, htonl(cnt)) < 0){
-		perror("Failed sending data");
+/** Creates the non blocking listening socket local clients connect to,
+ * replacing the path if it exists
+ *
+ * @param path - the UNIX socket path
+ * @param ino - set to the inode of the socket, to tell it from a successor's
+ *
+ * @return the listening socket*/
+int openLocalListener(const char *path, ino_t *ino){
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)){
+		printf("ERROR: The UNIX socket path is too long\n");
 		exit(EXIT_FAILURE);
 	}
+	strcpy(addr.sun_path, path);
 
-	close(connfd);
+	int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("Failed creating local listening socket");
+		exit(EXIT_FAILURE);
+	}
+	//the path of the predecessor, or a stale one of a server that crashed
+	unlink(path);
+	struct stat st;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || stat(path, &st) == -1) {
+		perror("Failed binding local socket");
+		close(fd);
+		exit(EXIT_FAILURE);
+	}
+	*ino = st.st_ino;
 
-	return NULL;
+	if (listen(fd, CONNECTION_QUEUE_SIZE) == -1) {
+		perror("Failed to start listening to local connections");
+		close(fd);
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+/** Makes the kernel hand each connection to the listening socket of the worker
+ * pinned to the CPU that received it, instead of hashing the addresses.
+ * The sockets of a SO_REUSEPORT group are numbered in the order they were
+ * opened, which is the workers' order. Without the filter the hash is used
+ *
+ * @param fd - any listening socket of the group
+ * */
+void steerByCpu(int fd){
+	struct sock_filter code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU }, //A = the current CPU
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, num_workers }, //A %= num_workers
+		{ BPF_RET | BPF_A, 0, 0, 0 }, //the index of the socket
+	};
+	struct sock_fprog prog = { .len = sizeof(code)/sizeof(code[0]), .filter = code };
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) < 0){
+		perror("WARNING: Failed attaching the CPU filter, connections are hashed");
+	}
+}
 
+/** Pins the worker to the i-th CPU it may run on, wrapping around,
+ * so it runs where the kernel steers its connections
+ *
+ * @param attr - the attributes of the worker's thread
+ * @param i - the worker's index
+ * */
+void pinWorker(pthread_attr_t *attr, int i){
+	cpu_set_t allowed, set;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0 || CPU_COUNT(&allowed) == 0){
+		return;
+	}
+	int n = i % CPU_COUNT(&allowed);
+	for (int cpu=0; cpu<CPU_SETSIZE; cpu++){
+		if (CPU_ISSET(cpu, &allowed) && n-- == 0){
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+			return;
+		}
+	}
 }
 
 /**Registers the handler function to the specified signal
@@ -241,103 +1732,331 @@ int registerHandler(int signal, struct sigaction *action, void (*sa_action) (int
 	return 0;
 }
 
+/**Sets isTerm to true and wakes up the workers, which stop accepting
+ * and drain their connections. Also called once the listening sockets
+ * have been handed over to the next server
+ * */
+void startDrain(void){
+	uint64_t one = 1;
+	isTerm = 1;
+	if (write(wakefd, &one, sizeof(one)) < 0){
+		//nothing to do, the workers are already awake
+	}
+}
+
 /**Handles a SIGTERM signal
- * Closes the listening socket file descriptor
- * and sets done to true
+ * Sets isTerm to true and wakes up the workers,
+ * which stop accepting and finish their connections
  * */
 void sigtermHandler(int signum, siginfo_t *info, void *ptr){
-	close(listenfd);
-	isTerm = 1;
+	startDrain();
+}
+
+/**Prints the usage message and exits*/
+void usage(char *prog){
+	printf("Usage: %s [-w workers] [-b read_size] [-B rcvbuf_size] [-I] [-r] [-s stats_port] [-C max_conns] [-S] [-F MiB] [-R rate] [-p file] [-i seconds] [-j] [-K keys] [-E seconds] [-T threads] [-D seconds] [-H path] [-u path] <port>\n", prog);
+	printf("  -w  number of worker threads, one per core by default\n");
+	printf("  -b  bytes requested by each read, %d by default\n", DEFAULT_READ_SIZE);
+	printf("  -B  SO_RCVBUF of the connections, the kernel's auto tuning by default\n");
+	printf("  -I  receive with io_uring multishot recv into provided buffers\n");
+	printf("  -r  one SO_REUSEPORT listening socket per worker, each worker pinned to a core\n");
+	printf("  -s  serve live statistics on this port, send \"json\" for JSON\n");
+	printf("  -C  maximum number of connections, accepting pauses at the limit\n");
+	printf("  -S  shed the connections over -C with a busy reply instead of pausing\n");
+	printf("  -F  maximum MiB of payload announced by the requests being read\n");
+	printf("  -R  maximum requests per second per connection\n");
+	printf("  -p  persist pcc_count to this file and resume from it on start\n");
+	printf("  -i  seconds between snapshots to the -p file, %d by default\n", DEFAULT_SNAPSHOT_SECS);
+	printf("  -j  also log the counts added every %d ms between snapshots\n", PERSIST_LOG_MS);
+	printf("  -K  number of keyed histograms kept, %d by default, least recently used evicted first, below 2^32\n", DEFAULT_MAX_KEYS);
+	printf("  -E  seconds before an idle keyed histogram expires, never by default\n");
+	printf("  -T  count payloads over %d MiB with this many threads too, none by default\n", POOL_MIN_LEN >> 20);
+	printf("  -D  seconds the connections are given to finish on SIGINT or SIGTERM, %d by default\n", DEFAULT_DRAIN_SECS);
+	printf("  -H  take the listening sockets over from the server on this UNIX socket, and hand them on\n");
+	printf("  -u  also accept local clients on this UNIX socket, which may count from shared memory\n");
+	printf("  requests over -F or -R are answered with a busy reply and skipped\n");
+	exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[]) {
+	//number of workers, one per core by default
+	num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_conns = 0; //maximum number of connections, 0 for no limit
+	unsigned long max_inflight = 0; //maximum in-flight payload bytes, 0 for no limit
+	int opt;
+	while ((opt = getopt(argc, argv, "w:b:B:Irs:C:SF:R:p:i:jK:E:T:D:H:u:")) != -1){
+		switch (opt){
+		case 'w':
+			num_workers = atoi(optarg);
+			break;
+		case 'b':
+			read_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'B':
+			rcvbuf_size = atoi(optarg);
+			break;
+		case 'I':
+			use_uring = 1;
+			break;
+		case 'r':
+			reuse_port = 1;
+			break;
+		case 's':
+			stats_port = strtoul(optarg, NULL, 10);
+			break;
+		case 'C':
+			max_conns = atoi(optarg);
+			break;
+		case 'S':
+			shed_conns = 1;
+			break;
+		case 'F':
+			max_inflight = strtoul(optarg, NULL, 10) << 20;
+			break;
+		case 'R':
+			max_rate = atof(optarg);
+			break;
+		case 'p':
+			persist_path = optarg;
+			break;
+		case 'i':
+			snapshot_secs = strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			use_log = 1;
+			break;
+		case 'K':
+			max_keys = strtoul(optarg, NULL, 10);
+			break;
+		case 'E':
+			key_ttl = strtoul(optarg, NULL, 10);
+			break;
+		case 'T':
+			pool_threads = atoi(optarg);
+			break;
+		case 'D':
+			drain_secs = strtoul(optarg, NULL, 10);
+			break;
+		case 'H':
+			handoff_path = optarg;
+			break;
+		case 'u':
+			local_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind >= argc || num_workers < 1 || read_size < 1 || max_conns < 0 || max_rate < 0 || snapshot_secs < 1 || pool_threads < 0 ||
+			max_keys > UINT32_MAX){
+		usage(argv[0]);
+	}
+
+	//port
+	unsigned int port = strtoul(argv[optind], NULL, 10);
+
+	//take the listening sockets over from the server running on handoff_path, if any
+	int inherited[HANDOFF_MAX_FDS];
+	int num_inherited = 0;
+	int statsfd = -1; //listening socket of the stats endpoint, -1 for none
+	if (handoff_path != NULL){
+		num_inherited = takeListeners(handoff_path, inherited, &statsfd);
+		if (num_inherited < 0){
+			perror("ERROR: Failed taking over the listening sockets");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (num_inherited > 0){
+		//keep the predecessor's layout: one shared socket, or one SO_REUSEPORT socket per worker
+		reuse_port = num_inherited > 1;
+		if (num_workers < num_inherited){
+			num_workers = num_inherited;
+		}
+	}
+
+	//the limits are split between the workers, so they are enforced without sharing anything
+	conn_budget = (max_conns + num_workers - 1) / num_workers;
+	inflight_budget = (max_inflight + num_workers - 1) / num_workers;
+
+	//eventfd used by the signal handler to wake up the workers
+	wakefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (wakefd == -1) {
+		perror("ERROR in eventfd()");
+		exit(EXIT_FAILURE);
+	}
+
 	//structures to pass to the registration syscall
 	struct sigaction sigterm_action;
 	memset(&sigterm_action, 0, sizeof(sigterm_action));
-	//register the handler to SIGINT
-	if (registerHandler(SIGINT, &sigterm_action, sigtermHandler) < 0){
+	//eventfd stopping the stats and persistence threads, which keep running while draining
+	donefd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (donefd == -1) {
+		perror("ERROR in eventfd()");
+		exit(EXIT_FAILURE);
+	}
+
+	//register the handler to SIGINT and SIGTERM
+	if (registerHandler(SIGINT, &sigterm_action, sigtermHandler) < 0 ||
+			registerHandler(SIGTERM, &sigterm_action, sigtermHandler) < 0){
 		perror("ERROR: Signal handle registration failed");
 		exit(EXIT_FAILURE);
 	}
 
-	//port
-	unsigned int port = strtoul(argv[1], NULL, 10);
+	//the listening sockets: taken over, one per worker with reuse_port, or a shared one
+	int num_listeners = (num_inherited > 0) ? num_inherited : (reuse_port ? num_workers : 1);
+	int *listeners = (int*)malloc(num_listeners * sizeof(int));
+	if (listeners == NULL){
+		printf("ERROR: malloc has failed\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i=0; i<num_listeners; i++){
+		listeners[i] = (num_inherited > 0) ? inherited[i] : openListener(port);
+	}
+	if (!reuse_port){
+		listenfd = listeners[0];
+	}
+	else if (num_inherited == 0){
+		steerByCpu(listeners[0]);
+	}
+	ino_t local_ino = 0;
+	if (local_path != NULL){
+		localfd = openLocalListener(local_path, &local_ino);
+	}
 
-	//create a listening socket
-	listenfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (listenfd == -1) {
-		perror("Failed creating listening socket");
+	//one pcc_count shard per worker, and one written by main for the counts restored from the counter file
+	initBuiltinClasses();
+	if (initPccCount(num_workers + 1) < 0){
+		printf("ERROR: malloc has failed\n");
 		exit(EXIT_FAILURE);
 	}
 
-	struct sockaddr_in serv_addr;
-	memset(&serv_addr, 0, sizeof(struct sockaddr_in));
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	serv_addr.sin_port = htons(port);
+	//histograms per stream key
+	if (max_keys > 0 && initKeys(max_keys, key_ttl) < 0){
+		printf("ERROR: malloc has failed\n");
+		exit(EXIT_FAILURE);
+	}
 
-	//bind socket to specified port
-	if (bind(listenfd, (struct sockaddr *)&serv_addr, sizeof(struct sockaddr_in)) == -1) {
-		perror("Failed binding socket");
-		close(listenfd);
+	//threads sharing the counting of large payloads
+	if (pool_threads > 0 && initPool(pool_threads) < 0){
+		perror("ERROR: Failed starting the counting pool");
 		exit(EXIT_FAILURE);
 	}
 
-	if (listen(listenfd, CONNECTION_QUEUE_SIZE) == -1) {
-		perror("Failed to start listening to incoming connections");
-		close(listenfd);
+	//per worker statistics, served on stats_port if set
+	if (initStats(num_workers) < 0){
+		printf("ERROR: malloc has failed\n");
+		exit(EXIT_FAILURE);
+	}
+	if (statsfd < 0 && stats_port > 0){
+		statsfd = openStatsListener(stats_port);
+	}
+	if ((stats_port > 0 || statsfd >= 0) && (statsfd < 0 || startStatsServer(statsfd, donefd) < 0)){
+		perror("ERROR: Failed starting the stats endpoint");
 		exit(EXIT_FAILURE);
 	}
 
-	//init threads array
-	threads = (pthread_t*)malloc(sizeof(pthread_t));
-	if (threads == NULL){
+	//init workers array
+	workers = (Worker*)calloc(num_workers, sizeof(Worker));
+	if (workers == NULL){
 		printf("ERROR: malloc has failed\n");
 		exit(EXIT_FAILURE);
 	}
-	num_threads = 0;
 
-	//main loop
-	while (!isTerm) {
-		//accept new connection
-		struct sockaddr_in client_addr;
-		socklen_t client_addr_size = sizeof(struct sockaddr_in);
-		int connfd = accept(listenfd, (struct sockaddr *)&client_addr, &client_addr_size);
-		if (connfd == -1) { //error
-			if (errno == EINTR && isTerm){ //accept failed due to SIGTERM
-				break;
-			}
-			else {
-				perror("ERROR: Failed accepting client connection");
-				exit(EXIT_FAILURE);
-			}
-		}
-		//create new thread to handle the connection
-		int rc = pthread_create(&threads[num_threads++], NULL, clientThread, (void*)connfd);
-		threads = realloc(threads, (num_threads+1)*sizeof(pthread_t));
-		if (threads == NULL){ //error
-			printf("ERROR: realloc has failed\n");
-			exit(EXIT_FAILURE);
+	//with reuse_port every worker listens on its own socket
+	for (int i=0; i<num_workers; i++){
+		workers[i].listenfd = listeners[i % num_listeners];
+	}
+
+	//launch the workers
+	int rc;
+	for (int i=0; i<num_workers; i++){
+		initWorker(&workers[i], i);
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if (reuse_port){
+			pinWorker(&attr, i);
 		}
+		rc = pthread_create(&workers[i].thread, &attr, workerThread, &workers[i]);
+		pthread_attr_destroy(&attr);
 		if(rc) { //error
 			perror("ERROR in pthread_create()");
 			exit(EXIT_FAILURE);
-
 		}
+	}
 
+	//hand the listening sockets on to the next server started with the same path
+	if (handoff_path != NULL && startHandoff(handoff_path, listeners, num_listeners, statsfd, donefd, startDrain) < 0){
+		perror("ERROR: Failed listening for the next server");
+		exit(EXIT_FAILURE);
+	}
+
+	//resume pcc_count from the counter file once the previous server wrote its last snapshot
+	if (persist_path != NULL){
+		unsigned long restored[NUM_PCC];
+		waitPredecessor();
+		if (openPersist(persist_path, use_log, restored) < 0){
+			perror("ERROR: Failed opening the counter file");
+			exit(EXIT_FAILURE);
+		}
+		updateGlobalCounter(getPccShard(num_workers), restored);
+		if (startPersist(donefd, snapshot_secs) < 0){
+			perror("ERROR: Failed starting the persistence thread");
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	// Wait for all active threads to finish
-	for( int i = 0; i < num_threads; i++ ) {
-		int rc = pthread_join(threads[i], NULL);
+	// Wait for all workers to finish
+	unsigned long drained = 0, dropped = 0;
+	for( int i = 0; i < num_workers; i++ ) {
+		rc = pthread_join(workers[i].thread, NULL);
 		if (rc) { //error
-			perror("ERROR in pthread_mutex_join()");
+			perror("ERROR in pthread_join()");
 			exit(EXIT_FAILURE);
 		}
+		drained += workers[i].drained;
+		dropped += workers[i].dropped;
+	}
+	fprintf(stderr, "drained: %lu connections closed, %lu of them at the %u s deadline\n", drained, dropped, drain_secs);
+
+	//stop the helper threads, the last snapshot is written before the next server is told
+	uint64_t one = 1;
+	if (write(donefd, &one, sizeof(one)) < 0){
+		perror("ERROR: Failed stopping the helper threads");
+	}
+	freePool();
+	for (int i=0; i<num_workers; i++){ //written by the pool until it stopped
+		if (workers[i].poolfd >= 0){
+			close(workers[i].poolfd);
+		}
+	}
+	closePersist();
+	closeHandoff();
+	freeStats();
+	freeKeys();
+	for (int i=0; i<num_listeners; i++){
+		close(listeners[i]);
+	}
+	free(listeners);
+	if (localfd >= 0){
+		struct stat st;
+		close(localfd);
+		//unless a successor has bound the path again meanwhile
+		if (stat(local_path, &st) == 0 && st.st_ino == local_ino){
+			unlink(local_path);
+		}
 	}
+	close(wakefd);
+	close(donefd);
+	free(workers);
+
+	//merge the shards
+	unsigned long pcc_count[NUM_PCC];
+	snapshotPccCount(pcc_count);
+	freePccCount();
+
 	//print out the number of times each printable character has been observed
 	for (int i=0; i<NUM_PCC; i++){
-		printf("char '%c' : %u times\n", i+MIN_PCC, (uint32_t)pcc_count[i]);
+		printf("char '%c' : %lu times\n", i+MIN_PCC, pcc_count[i]);
 	}
 
 	exit(EXIT_SUCCESS);
@@ -0,0 +1,308 @@
+/*
+ * pcc_stats.c
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ *
+ * Live statistics of pcc_server.
+ * The workers keep their own counters and latency histograms, and a stats
+ * thread serves snapshots of them on a second port. Rates are computed over
+ * the last sampling interval, so a snapshot never waits for one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pcc_stats.h"
+#include "pcc_keys.h"
+#include "pcc_pool.h"
+
+#define STATS_INTERVAL_MS 1000 //time between samples of the rates
+#define STATS_REQUEST_MS 100 //time a stats client has to ask for JSON
+#define STATS_LINE_SIZE 128
+
+/**Totals of all workers*/
+typedef struct stats_totals_t {
+	unsigned long accepted, closed, requests, errors, shed, bytes, syscalls;
+	unsigned long connsHigh, connObjs; //sums of the workers' high-water marks
+} StatsTotals;
+
+static WorkerStats *stats = NULL; //statistics array
+static int num_stats = 0; //total number of workers
+static int statsfd = -1; //listening socket of the stats thread
+static int stop_fd = -1; //readable once the stats thread should stop
+static pthread_t stats_thread;
+static int started = 0; //has the stats thread been started
+static uint64_t start_time; //time the statistics were initialized
+static StatsTotals last; //totals of the last sample
+static double rates[3]; //accepted, requests and bytes per second over the last interval
+static uint64_t last_time; //time of the last sample
+
+int initStats(int num){
+	if (posix_memalign((void**)&stats, CACHE_LINE, num*sizeof(WorkerStats)) != 0){
+		return -1;
+	}
+	memset(stats, 0, num*sizeof(WorkerStats));
+	num_stats = num;
+	start_time = last_time = latNow();
+	return 0;
+}
+
+WorkerStats *getWorkerStats(int i){
+	return &stats[i];
+}
+
+/** Returns the number of connections owned by a worker*/
+static unsigned long workerConns(WorkerStats *s){
+	//closed is read first, so it never exceeds accepted
+	unsigned long closed = __atomic_load_n(&s->closed, __ATOMIC_RELAXED);
+	return __atomic_load_n(&s->accepted, __ATOMIC_RELAXED) - closed;
+}
+
+/** Sums the counters of all workers*/
+static void sumStats(StatsTotals *t){
+	memset(t, 0, sizeof(StatsTotals));
+	for (int i=0; i<num_stats; i++){
+		WorkerStats *s = &stats[i];
+		t->closed += __atomic_load_n(&s->closed, __ATOMIC_RELAXED);
+		t->accepted += __atomic_load_n(&s->accepted, __ATOMIC_RELAXED);
+		t->requests += __atomic_load_n(&s->requests, __ATOMIC_RELAXED);
+		t->errors += __atomic_load_n(&s->errors, __ATOMIC_RELAXED);
+		t->shed += __atomic_load_n(&s->shed, __ATOMIC_RELAXED);
+		t->bytes += __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+		t->syscalls += __atomic_load_n(&s->syscalls, __ATOMIC_RELAXED);
+		t->connsHigh += __atomic_load_n(&s->connsHigh, __ATOMIC_RELAXED);
+		t->connObjs += __atomic_load_n(&s->connObjs, __ATOMIC_RELAXED);
+	}
+}
+
+/** Updates the rates with the counters accumulated since the last sample*/
+static void sampleRates(void){
+	StatsTotals now;
+	uint64_t t = latNow();
+	sumStats(&now);
+	double secs = (t - last_time) / 1e9;
+	if (secs <= 0){
+		return;
+	}
+	rates[0] = (now.accepted - last.accepted) / secs;
+	rates[1] = (now.requests - last.requests) / secs;
+	rates[2] = (now.bytes - last.bytes) / secs;
+	last = now;
+	last_time = t;
+}
+
+/** Writes a snapshot of the statistics to out
+ *
+ * @param out - the stream to write to
+ * @param json - write JSON instead of text
+ * */
+static void writeSnapshot(FILE *out, int json){
+	StatsTotals t;
+	sumStats(&t);
+	LatHist *lat = (LatHist*)calloc(1, sizeof(LatHist));
+	if (lat == NULL){
+		printf("ERROR: malloc has failed\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i=0; i<num_stats; i++){
+		latMerge(lat, &stats[i].lat);
+	}
+	unsigned long pcc_count[NUM_PCC];
+	snapshotPccCount(pcc_count);
+
+	double uptime = (latNow() - start_time) / 1e9;
+	double perRequest = (t.requests > 0) ? (double)t.syscalls / t.requests : 0;
+	unsigned long active = t.accepted - t.closed;
+	double p50 = latPercentile(lat, 0.5) / 1e3, p99 = latPercentile(lat, 0.99) / 1e3;
+	double p999 = latPercentile(lat, 0.999) / 1e3, max = lat->max / 1e3;
+	unsigned long chunks, chunksHigh;
+	poolUsage(&chunks, &chunksHigh);
+
+	if (json){
+		fprintf(out, "{\"uptime\":%.3f,\"active\":%lu,\"accepted\":%lu,\"accepted_per_sec\":%.1f,"
+				"\"requests\":%lu,\"errors\":%lu,\"shed\":%lu,\"requests_per_sec\":%.1f,"
+				"\"bytes\":%lu,\"bytes_per_sec\":%.1f,\"syscalls_per_request\":%.2f,\"keys\":%lu,"
+				"\"memory\":{\"conn_objects\":%lu,\"conns_high\":%lu,\"pool_chunks\":%lu,\"pool_chunks_high\":%lu},"
+				"\"latency_us\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f},\"workers\":[",
+				uptime, active, t.accepted, rates[0], t.requests, t.errors, t.shed, rates[1],
+				t.bytes, rates[2], perRequest, keyedCount(), t.connObjs, t.connsHigh, chunks, chunksHigh, p50, p99, p999, max);
+		for (int i=0; i<num_stats; i++){
+			WorkerStats *s = &stats[i];
+			fprintf(out, "%s{\"id\":%d,\"connections\":%lu,\"ready\":%lu,\"pending\":%lu,\"inflight\":%lu,\"requests\":%lu,\"conns_high\":%lu}",
+					(i > 0) ? "," : "", i,
+					workerConns(s),
+					__atomic_load_n(&s->ready, __ATOMIC_RELAXED), __atomic_load_n(&s->pending, __ATOMIC_RELAXED),
+					__atomic_load_n(&s->inflight, __ATOMIC_RELAXED), __atomic_load_n(&s->requests, __ATOMIC_RELAXED),
+					__atomic_load_n(&s->connsHigh, __ATOMIC_RELAXED));
+		}
+		fprintf(out, "],\"histogram\":{");
+		for (int i=0; i<NUM_PCC; i++){
+			int c = i+MIN_PCC;
+			//escape the chars JSON does not allow in a string
+			fprintf(out, "%s\"%s%c\":%lu", (i > 0) ? "," : "", (c == '"' || c == '\\') ? "\\" : "", c, pcc_count[i]);
+		}
+		fprintf(out, "}}\n");
+	}
+	else {
+		fprintf(out, "uptime: %.3f s\n", uptime);
+		fprintf(out, "connections: %lu active, %lu accepted, %.1f accepted/s\n", active, t.accepted, rates[0]);
+		fprintf(out, "requests: %lu, %lu errors, %lu shed, %.1f requests/s\n", t.requests, t.errors, t.shed, rates[1]);
+		fprintf(out, "bytes: %lu, %.2f MB/s\n", t.bytes, rates[2] / 1e6);
+		fprintf(out, "syscalls per request: %.2f\n", perRequest);
+		fprintf(out, "keys: %lu\n", keyedCount());
+		fprintf(out, "memory: %lu connection objects, %lu connections at most, %lu pool chunks, %lu at most\n",
+				t.connObjs, t.connsHigh, chunks, chunksHigh);
+		fprintf(out, "latency (us): p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n", p50, p99, p999, max);
+		latPrint(lat, out);
+		for (int i=0; i<num_stats; i++){
+			WorkerStats *s = &stats[i];
+			fprintf(out, "worker %d: %lu connections, %lu ready events, %lu pending reply bytes, %lu in-flight bytes, %lu requests\n", i,
+					workerConns(s),
+					__atomic_load_n(&s->ready, __ATOMIC_RELAXED), __atomic_load_n(&s->pending, __ATOMIC_RELAXED),
+					__atomic_load_n(&s->inflight, __ATOMIC_RELAXED), __atomic_load_n(&s->requests, __ATOMIC_RELAXED));
+		}
+		for (int i=0; i<NUM_PCC; i++){
+			fprintf(out, "char '%c' : %lu times\n", i+MIN_PCC, pcc_count[i]);
+		}
+	}
+	free(lat);
+}
+
+/** Serves a snapshot to a stats client
+ *
+ * @param fd - the client's socket
+ * */
+static void serveStats(int fd){
+	//wait a little for the client to ask for JSON
+	char line[STATS_LINE_SIZE];
+	int json = 0;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	if (poll(&pfd, 1, STATS_REQUEST_MS) > 0){
+		ssize_t n = recv(fd, line, sizeof(line)-1, MSG_DONTWAIT);
+		if (n > 0){
+			line[n] = '\0';
+			json = strstr(line, "json") != NULL;
+		}
+	}
+
+	char *buff = NULL;
+	size_t len = 0;
+	FILE *out = open_memstream(&buff, &len);
+	if (out == NULL){
+		perror("ERROR in open_memstream()");
+		return;
+	}
+	writeSnapshot(out, json);
+	fclose(out);
+
+	size_t sent = 0;
+	while (sent < len){
+		ssize_t n = send(fd, buff+sent, len-sent, MSG_NOSIGNAL);
+		if (n < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			break; //the client is gone or too slow, the snapshot is dropped
+		}
+		sent += n;
+	}
+	free(buff);
+}
+
+/** Serves the stats clients one at a time and samples the rates,
+ * until stop_fd becomes readable*/
+static void* statsThread(void *arg){
+	struct pollfd pfds[2] = { { .fd = statsfd, .events = POLLIN }, { .fd = stop_fd, .events = POLLIN } };
+	struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+	uint64_t nextSample = latNow() + STATS_INTERVAL_MS * 1000000ULL;
+
+	for (;;){
+		uint64_t now = latNow();
+		if (now >= nextSample){
+			sampleRates();
+			nextSample = now + STATS_INTERVAL_MS * 1000000ULL;
+		}
+		int rc = poll(pfds, 2, (int)((nextSample - now) / 1000000) + 1);
+		if (rc < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			perror("ERROR in poll()");
+			break;
+		}
+		if (pfds[1].revents){ //stopping
+			break;
+		}
+		if (!pfds[0].revents){
+			continue;
+		}
+		int fd = accept(statsfd, NULL, NULL);
+		if (fd < 0){
+			continue;
+		}
+		//a stuck client must not block the stats thread forever
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		serveStats(fd);
+		close(fd);
+	}
+	return NULL;
+}
+
+int openStatsListener(unsigned int port){
+	int fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+	if (fd == -1){
+		return -1;
+	}
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1){
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+int startStatsServer(int fd, int stopfd){
+	statsfd = fd;
+	stop_fd = stopfd;
+	int rc = pthread_create(&stats_thread, NULL, statsThread, NULL);
+	if (rc){
+		close(statsfd);
+		statsfd = -1;
+		errno = rc;
+		return -1;
+	}
+	started = 1;
+	return 0;
+}
+
+void freeStats(void){
+	if (started){
+		pthread_join(stats_thread, NULL);
+		started = 0;
+	}
+	if (statsfd >= 0){
+		close(statsfd);
+		statsfd = -1;
+	}
+	free(stats);
+	stats = NULL;
+	num_stats = 0;
+}
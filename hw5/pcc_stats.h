@@ -0,0 +1,74 @@
+/*
+ * pcc_stats.h
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ */
+
+#ifndef PCC_STATS_H_
+#define PCC_STATS_H_
+
+#include "pcc_count.h"
+#include "pcc_latency.h"
+
+/**The statistics of one worker.
+ * Each worker only writes its own, with relaxed stores that cost the same as
+ * plain increments, so collecting them is always on. The stats thread reads
+ * them at any time without stopping the workers*/
+typedef struct worker_stats_t {
+	unsigned long accepted; //connections accepted
+	unsigned long closed; //connections closed
+	unsigned long requests; //requests answered
+	unsigned long errors; //bad requests and dropped connections
+	unsigned long shed; //requests and connections answered with a busy reply
+	unsigned long bytes; //payload bytes counted
+	unsigned long syscalls; //system calls made by the event loop
+	unsigned long ready; //events returned by the last epoll_wait
+	unsigned long pending; //reply bytes waiting to be written
+	unsigned long inflight; //payload bytes announced by the requests being read
+	unsigned long connsHigh; //most connections owned at once
+	unsigned long connObjs; //connection objects allocated, never more than connsHigh rounded up to a slab
+	LatHist lat; //latency of the requests, from their first byte to their reply
+} __attribute__((aligned(CACHE_LINE))) WorkerStats;
+
+/**Adds n to a counter. Must only be called by the counter's owner*/
+static inline void statAdd(unsigned long *ctr, unsigned long n){
+	__atomic_store_n(ctr, *ctr + n, __ATOMIC_RELAXED);
+}
+
+/**Sets a gauge. Must only be called by the gauge's owner*/
+static inline void statSet(unsigned long *gauge, unsigned long val){
+	__atomic_store_n(gauge, val, __ATOMIC_RELAXED);
+}
+
+/**Allocates the specified number of zeroed worker statistics
+ *
+ * @return
+ * 0 - on success
+ * -1 - on error*/
+int initStats(int num);
+
+/**Returns the statistics of the worker with the specified index*/
+WorkerStats *getWorkerStats(int i);
+
+/**Creates the listening socket of the stats endpoint on the specified port
+ *
+ * @return
+ * the socket - on success
+ * -1 - on error, errno is set*/
+int openStatsListener(unsigned int port);
+
+/**Starts the stats thread, which serves a snapshot to every client
+ * connecting to the listening socket fd, which it then owns: JSON if the
+ * client sends a line containing "json", text otherwise.
+ * It stops once stopfd becomes readable
+ *
+ * @return
+ * 0 - on success
+ * -1 - on error, errno is set*/
+int startStatsServer(int fd, int stopfd);
+
+/**Waits for the stats thread, if started, and frees the statistics*/
+void freeStats(void);
+
+#endif /* PCC_STATS_H_ */
@@ -0,0 +1,228 @@
+/*
+ * pcc_uring.c
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ *
+ * Thin io_uring wrapper over the raw system calls, so the server does not
+ * depend on liburing. It only supports what the ingest path needs:
+ * multishot recv into a ring of provided buffers, and cancellation.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "pcc_uring.h"
+
+#define BUF_GROUP 0 //the buffer group id of the receive buffers
+
+static int ioUringSetup(unsigned entries, struct io_uring_params *p){
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags){
+	return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int ioUringRegister(int fd, unsigned opcode, void *arg, unsigned nrArgs){
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+/** Adds a buffer to the tail of the provided buffers ring*/
+static void addBuffer(PccUring *u, unsigned short bid, unsigned short offset){
+	struct io_uring_buf *b = &u->bufRing->bufs[(u->bufRing->tail + offset) & (u->numBufs-1)];
+	b->addr = (unsigned long)(u->bufs + (size_t)bid*u->bufSize);
+	b->len = u->bufSize;
+	b->bid = bid;
+}
+
+int initUring(PccUring *u, unsigned entries, unsigned numBufs, size_t bufSize){
+	memset(u, 0, sizeof(PccUring));
+	u->fd = -1;
+	u->ringMem = MAP_FAILED;
+	u->sqes = MAP_FAILED;
+	u->bufRing = MAP_FAILED;
+
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = entries*16; //multishot requests post many completions per submission
+	u->fd = ioUringSetup(entries, &p);
+	if (u->fd < 0){
+		return -1;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)){
+		freeUring(u);
+		errno = ENOSYS;
+		return -1;
+	}
+
+	//map the submission and completion rings, which share one mapping
+	size_t sqSize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+	size_t cqSize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	u->ringSize = (sqSize > cqSize) ? sqSize : cqSize;
+	u->ringMem = mmap(NULL, u->ringSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->ringMem == MAP_FAILED){
+		freeUring(u);
+		return -1;
+	}
+	char *ring = (char*)u->ringMem;
+	u->sqHead = (unsigned*)(ring + p.sq_off.head);
+	u->sqTail = (unsigned*)(ring + p.sq_off.tail);
+	u->sqMask = (unsigned*)(ring + p.sq_off.ring_mask);
+	u->sqArray = (unsigned*)(ring + p.sq_off.array);
+	u->sqEntries = p.sq_entries;
+	u->sqLocalTail = *u->sqTail;
+	u->cqHead = (unsigned*)(ring + p.cq_off.head);
+	u->cqTail = (unsigned*)(ring + p.cq_off.tail);
+	u->cqMask = (unsigned*)(ring + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*)(ring + p.cq_off.cqes);
+
+	u->sqesSize = p.sq_entries*sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED){
+		freeUring(u);
+		return -1;
+	}
+
+	//register the provided buffers ring, its size must be a power of 2
+	unsigned n = 1;
+	while (n < numBufs){
+		n <<= 1;
+	}
+	u->numBufs = n;
+	u->bufSize = bufSize;
+	u->bufRing = mmap(NULL, n*sizeof(struct io_uring_buf), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (u->bufRing == MAP_FAILED){
+		freeUring(u);
+		return -1;
+	}
+	u->bufs = (unsigned char*)malloc((size_t)n*bufSize);
+	if (u->bufs == NULL){
+		freeUring(u);
+		errno = ENOMEM;
+		return -1;
+	}
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)u->bufRing;
+	reg.ring_entries = n;
+	reg.bgid = BUF_GROUP;
+	if (ioUringRegister(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+		freeUring(u);
+		return -1;
+	}
+	for (unsigned i=0; i<n; i++){
+		addBuffer(u, i, i);
+	}
+	__atomic_store_n(&u->bufRing->tail, (unsigned short)n, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/** Returns a zeroed submission entry, submitting the queued ones if the ring is full*/
+static struct io_uring_sqe *getSqe(PccUring *u){
+	while (u->sqLocalTail - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE) >= u->sqEntries){
+		if (uringSubmit(u) < 0){
+			return NULL;
+		}
+	}
+	unsigned idx = u->sqLocalTail & *u->sqMask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sqArray[idx] = idx;
+	return sqe;
+}
+
+/** Publishes the entry returned by getSqe*/
+static void pushSqe(PccUring *u){
+	u->sqLocalTail++;
+	u->toSubmit++;
+	__atomic_store_n(u->sqTail, u->sqLocalTail, __ATOMIC_RELEASE);
+}
+
+int uringRecvMultishot(PccUring *u, int fd, void *userData){
+	struct io_uring_sqe *sqe = getSqe(u);
+	if (sqe == NULL){
+		return -1;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BUF_GROUP;
+	sqe->user_data = (unsigned long)userData;
+	pushSqe(u);
+	return 0;
+}
+
+int uringCancel(PccUring *u, void *userData){
+	struct io_uring_sqe *sqe = getSqe(u);
+	if (sqe == NULL){
+		return -1;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long)userData;
+	sqe->user_data = 0; //the completion of the cancel request itself is ignored
+	pushSqe(u);
+	return 0;
+}
+
+int uringSubmit(PccUring *u){
+	while (u->toSubmit > 0){
+		int rc = ioUringEnter(u->fd, u->toSubmit, 0, 0);
+		if (rc < 0){
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY){
+				continue;
+			}
+			return -1;
+		}
+		u->toSubmit -= rc;
+	}
+	return 0;
+}
+
+struct io_uring_cqe *uringPeek(PccUring *u){
+	unsigned head = *u->cqHead;
+	if (head == __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE)){
+		return NULL;
+	}
+	return &u->cqes[head & *u->cqMask];
+}
+
+void uringSeen(PccUring *u){
+	__atomic_store_n(u->cqHead, *u->cqHead+1, __ATOMIC_RELEASE);
+}
+
+unsigned char *uringBuffer(PccUring *u, struct io_uring_cqe *cqe){
+	unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	return u->bufs + (size_t)bid*u->bufSize;
+}
+
+void uringRecycle(PccUring *u, struct io_uring_cqe *cqe){
+	addBuffer(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT, 0);
+	__atomic_store_n(&u->bufRing->tail, (unsigned short)(u->bufRing->tail+1), __ATOMIC_RELEASE);
+}
+
+void freeUring(PccUring *u){
+	if (u->fd >= 0){
+		close(u->fd);
+	}
+	if (u->ringMem != MAP_FAILED){
+		munmap(u->ringMem, u->ringSize);
+	}
+	if (u->sqes != MAP_FAILED){
+		munmap(u->sqes, u->sqesSize);
+	}
+	if (u->bufRing != MAP_FAILED){
+		munmap(u->bufRing, u->numBufs*sizeof(struct io_uring_buf));
+	}
+	free(u->bufs);
+	memset(u, 0, sizeof(PccUring));
+	u->fd = -1;
+}
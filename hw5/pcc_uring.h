@@ -0,0 +1,65 @@
+/*
+ * pcc_uring.h
+ *
+ *  Created on: 10 Jun 2018
+ *      Author: lital
+ */
+
+#ifndef PCC_URING_H_
+#define PCC_URING_H_
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+/**A minimal io_uring instance with a ring of provided receive buffers,
+ * used for multishot recv. Only the owning thread may use it*/
+typedef struct pcc_uring_t {
+	int fd; //the ring file descriptor, pollable when completions are ready
+	void *ringMem; //the mmaped submission and completion rings
+	size_t ringSize;
+	struct io_uring_sqe *sqes;
+	size_t sqesSize;
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned sqEntries;
+	unsigned sqLocalTail; //tail of the SQEs prepared but not published yet
+	unsigned toSubmit; //number of SQEs published but not submitted yet
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *bufRing; //the provided buffers ring
+	unsigned numBufs;
+	size_t bufSize;
+	unsigned char *bufs; //numBufs buffers of bufSize bytes each
+} PccUring;
+
+/**Creates an io_uring instance and registers numBufs receive buffers of bufSize bytes
+ *
+ * @return
+ * 0 - on success
+ * -1 - when io_uring or provided buffer rings are unavailable, errno is set*/
+int initUring(PccUring *u, unsigned entries, unsigned numBufs, size_t bufSize);
+
+/**Queues a multishot recv on the socket, reporting completions with userData*/
+int uringRecvMultishot(PccUring *u, int fd, void *userData);
+
+/**Queues the cancellation of the requests submitted with userData*/
+int uringCancel(PccUring *u, void *userData);
+
+/**Submits all queued requests to the kernel*/
+int uringSubmit(PccUring *u);
+
+/**Returns the next completion, or NULL if there is none*/
+struct io_uring_cqe *uringPeek(PccUring *u);
+
+/**Marks the completion returned by uringPeek as consumed*/
+void uringSeen(PccUring *u);
+
+/**Returns the receive buffer a completion was filled into*/
+unsigned char *uringBuffer(PccUring *u, struct io_uring_cqe *cqe);
+
+/**Gives a receive buffer back to the kernel*/
+void uringRecycle(PccUring *u, struct io_uring_cqe *cqe);
+
+/**Destroys the io_uring instance and frees its buffers*/
+void freeUring(PccUring *u);
+
+#endif /* PCC_URING_H_ */